@@ -6,22 +6,37 @@
 
 #include "interprocess/acceptor.h"
 #include <windows.h>
+#include <algorithm>
 #include <string>
+#include <vector>
 
 namespace interprocess {
 
-Acceptor::Acceptor(const std::string& endpoint)
+VOID WINAPI CompletedConnectRoutine(
+  DWORD err, DWORD, LPOVERLAPPED overlap) {
+  auto context = (Acceptor::ConnectCompletion*)overlap;
+  context->self->OnConnect(err);
+}
+
+Acceptor::Acceptor(const std::string& endpoint, int workers)
   : pipe_name_(std::string("\\\\.\\pipe\\").append(endpoint)),
     next_pipe_(NULL),
-    close_event_(CreateEvent(NULL, FALSE, FALSE, NULL)) {
+    next_loop_(nullptr),
+    next_worker_(0),
+    stopping_(false) {
+  for (int i = 0; i < std::max(workers, 1); ++i) {
+    workers_.emplace_back(new Worker);
+  }
   ZeroMemory(&connect_overlap_, sizeof connect_overlap_);
+  connect_overlap_.routine = CompletedConnectRoutine;
+  connect_overlap_.self = this;
   pendding_function_map_.insert(
-    std::make_pair(ERROR_IO_PENDING, [] { return true; }));
+    std::make_pair(ERROR_IO_PENDING, [] {}));
+  // The client connected between CreateNamedPipe and ConnectNamedPipe, no
+  // completion packet is queued in this case.
   pendding_function_map_.insert(std::make_pair(ERROR_PIPE_CONNECTED, [this] {
-    if (!SetEvent(connect_overlap_.hEvent)) {
-      raise_exception();
-    }
-    return false;
+    connect_overlap_.overlap.Internal = 0;
+    next_loop_->Post(&connect_overlap_);
   }));
 }
 
@@ -30,15 +45,36 @@ Acceptor::~Acceptor() {
 }
 
 void Acceptor::Listen() {
-  listen_thread_.swap(std::thread(std::bind(&Acceptor::ListenInThread, this)));
+  std::for_each(std::begin(workers_),
+                std::end(workers_),
+                [this](const std::unique_ptr<Worker>& worker) {
+    worker->thread.swap(std::thread(
+      std::bind(&Acceptor::ListenInThread, this, worker.get())));
+  });
 }
 
 void Acceptor::Stop() {
-  SetEvent(close_event_.get());
-  DisconnectNamedPipe(next_pipe_.get());
-  if (listen_thread_.joinable()) {
-    listen_thread_.join();
+  {
+    // The connect cancelled here completes with an error, it is not
+    // re-armed.
+    std::unique_lock<std::mutex> lock(next_mutex_);
+    stopping_ = true;
+    if (next_pipe_) {
+      DisconnectNamedPipe(next_pipe_.get());
+    }
   }
+  std::for_each(std::begin(workers_),
+                std::end(workers_),
+                [](const std::unique_ptr<Worker>& worker) {
+    worker->loop.Post(EventLoop::CLOSE);
+  });
+  std::for_each(std::begin(workers_),
+                std::end(workers_),
+                [](const std::unique_ptr<Worker>& worker) {
+    if (worker->thread.joinable()) {
+      worker->thread.join();
+    }
+  });
 }
 
 void Acceptor::SetNewConnectionCallback(const NewConnectionCallback& cb) {
@@ -49,81 +85,34 @@ void Acceptor::SetExceptionCallback(const ExceptionCallback& cb) {
   exception_callback_ = cb;
 }
 
-void Acceptor::MoveAsyncIOFunctionToAlertableThread(
-  const std::function<void()>& cb) {
-  async_io_callback_ = cb;
-}
-
-void Acceptor::MoveWaitResponseIOFunctionToAlertableThread(
-  const std::function<void()>& cb) {
-  async_wait_io_callback_ = cb;
+std::vector<EventLoop*> Acceptor::Loops() const {
+  std::vector<EventLoop*> loops;
+  std::for_each(std::begin(workers_),
+                std::end(workers_),
+                [&](const std::unique_ptr<Worker>& worker) {
+    loops.push_back(&worker->loop);
+  });
+  return loops;
 }
 
-void Acceptor::ListenInThread() {
+void Acceptor::ListenInThread(Worker* worker) {
   std::exception_ptr eptr;
   try {
-    SECURITY_CREATE_EVENT(conn_event, TRUE, TRUE);
-    SECURITY_CREATE_EVENT(post_event, FALSE, FALSE);
-    SECURITY_CREATE_EVENT(send_event, FALSE, FALSE);
-
-    HANDLE events[4] = {
-      conn_event, post_event, send_event, close_event_.get()
-    };
-    connect_overlap_.hEvent = conn_event;
-    bool pendding = CreateConnectInstance();
+    // The first pipe instance is created by the first worker, the others
+    // get theirs when a client connects.
+    if (worker == workers_.front().get()) {
+      CreateConnectInstance();
+    }
 
     while (true) {
-      auto wait = WaitForMultipleObjectsEx(
-        3,
-        events,         // events object to wait for
-        FALSE,          // wait any one
-        INFINITE,       // wait indefinitely
-        TRUE);          // alertable wait enabled
-
-      switch (wait) {
-      case WAIT_OBJECT_0:
-        // If an operation is pending, get the result of the
-        // connect operation.
-        if (pendding) {
-          raise_exception_if([&, this]() {
-            DWORD ret = 0;
-            return !GetOverlappedResult(
-              next_pipe_.get(),         // pipe handle
-              &connect_overlap_,  // OVERLAPPED structure
-              &ret,               // bytes transferred
-              FALSE);             // does not wait
-          });
-        }
-        call_if_exist(
-          new_connection_callback_,
-          next_pipe_.get(),
-          post_event,
-          send_event);
-
-        pendding = CreateConnectInstance();
-        break;
-
-      // Send operation pendding
-      case WAIT_OBJECT_0 + 1:
-        call_if_exist(async_io_callback_);
-        break;
-
-      case WAIT_OBJECT_0 + 2:
-        call_if_exist(async_wait_io_callback_);
-        break;
-
-      case WAIT_OBJECT_0 + 3:
+      switch (worker->loop.Wait()) {
+      case EventLoop::CLOSE:
         return;
 
-      // The wait is satisfied by a completed read or write
-      // operation. This allows the system to execute the
-      // completion routine.
-      case WAIT_IO_COMPLETION:
-        break;
-
-      // An error occurred in the wait function.
+      // A connect, read or write operation finished and its completion
+      // routine already ran.
       default:
-        raise_exception();
+        break;
       }
     }
   } catch (...) {
@@ -133,7 +122,11 @@ void Acceptor::ListenInThread() {
   call_if_exist(exception_callback_, eptr);
 }
 
-bool Acceptor::CreateConnectInstance() {
+void Acceptor::CreateConnectInstance() {
+  std::unique_lock<std::mutex> lock(next_mutex_);
+  if (stopping_) {
+    return;
+  }
   next_pipe_.reset(CreateNamedPipe(
     pipe_name_.c_str(),        // pipe name
     PIPE_ACCESS_DUPLEX |       // read/write access
@@ -142,8 +135,8 @@ bool Acceptor::CreateConnectInstance() {
     PIPE_READMODE_MESSAGE |    // message read mode
     PIPE_WAIT,                 // blocking mode
     PIPE_UNLIMITED_INSTANCES,  // unlimited instances
-    kBufferSize,               // output buffer size
-    kBufferSize,               // input buffer size
+    kPacketSize,               // output buffer size
+    kPacketSize,               // input buffer size
     kTimeout,                  // client time-out
     NULL));                    // default security attributes
 
@@ -151,21 +144,60 @@ bool Acceptor::CreateConnectInstance() {
     return next_pipe_.get() == INVALID_HANDLE_VALUE;
   });
 
+  // The connection made on this instance belongs to the next worker.
+  next_loop_ = &workers_[next_worker_++ % workers_.size()]->loop;
+  next_loop_->Associate(next_pipe_.get());
+
   // Overlapped ConnectNamedPipe should return zero.
   raise_exception_if([this]() {
-    return ConnectNamedPipe(next_pipe_.get(), &connect_overlap_);
+    return ConnectNamedPipe(next_pipe_.get(), &connect_overlap_.overlap);
   });
 
-  return Pendding(GetLastError());
+  Pendding(GetLastError());
 }
 
-bool Acceptor::Pendding(int err) {
+void Acceptor::Pendding(int err) {
   auto it = pendding_function_map_.find(err);
   if (it != pendding_function_map_.end()) {
-    return it->second();
+    it->second();
   } else {
     raise_exception();
-    return false;
+  }
+}
+
+void Acceptor::OnConnect(DWORD err) {
+  HANDLE pipe = NULL;
+  EventLoop* loop = nullptr;
+  {
+    std::unique_lock<std::mutex> lock(next_mutex_);
+    if (stopping_) {
+      return;
+    }
+    if (err) {
+      next_pipe_.reset();
+    } else {
+      pipe = next_pipe_.release();
+      loop = next_loop_;
+    }
+  }
+  // A failed connect, or a connection that could not be set up, costs only
+  // its own pipe instance: the error is reported and accepting goes on.
+  if (err) {
+    SetLastError(err);
+    call_if_exist(exception_callback_, last_error());
+  } else {
+    try {
+      // The connection owns the pipe instance from now on.
+      call_if_exist(new_connection_callback_, pipe, loop);
+    } catch (...) {
+      call_if_exist(exception_callback_, std::current_exception());
+    }
+  }
+  try {
+    CreateConnectInstance();
+  } catch (...) {
+    // No more connections are accepted, those of the worker carry on.
+    call_if_exist(exception_callback_, std::current_exception());
   }
 }
 
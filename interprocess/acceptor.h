@@ -9,15 +9,23 @@
 
 #include <windows.h>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
+#include "interprocess/event_loop.h"
 #include "interprocess/types.h"
 
 namespace interprocess {
 
+// Accepts pipe instances and hands each one to one of |workers| I/O threads,
+// round-robin. Every worker has its own completion port and runs the I/O and
+// callbacks of the connections it was given; the accept itself hops from
+// worker to worker along with the pipe instance it waits on.
 class Acceptor {
  public:
-  explicit Acceptor(const std::string& endpoint);
+  Acceptor(const std::string& endpoint, int workers);
   Acceptor(const Acceptor&) = delete;
   Acceptor& operator=(const Acceptor&) = delete;
   ~Acceptor();
@@ -25,25 +33,36 @@ class Acceptor {
   void Stop();
   void SetNewConnectionCallback(const NewConnectionCallback& cb);
   void SetExceptionCallback(const ExceptionCallback& cb);
-  void MoveAsyncIOFunctionToAlertableThread(const std::function<void()>& cb);
-  void MoveWaitResponseIOFunctionToAlertableThread(
-    const std::function<void()>& cb);
+  std::vector<EventLoop*> Loops() const;
 
  private:
-  void ListenInThread();
-  bool CreateConnectInstance();
-  bool Pendding(int err);
+  struct Worker {
+    EventLoop loop;
+    std::thread thread;
+  };
+  struct ConnectCompletion : IoCompletion {
+    Acceptor* self;
+  };
+  void ListenInThread(Worker* worker);
+  void CreateConnectInstance();
+  void Pendding(int err);
+  void OnConnect(DWORD err);
 
   const std::string pipe_name_;
-  std::thread listen_thread_;
-  std::map<int, std::function<bool()>> pendding_function_map_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::map<int, std::function<void()>> pendding_function_map_;
+  // Guards the pipe instance waiting for a client against Stop(), which
+  // runs on another thread than the worker replacing it.
+  std::mutex next_mutex_;
   handle next_pipe_;
-  handle close_event_;
-  OVERLAPPED connect_overlap_;
+  EventLoop* next_loop_;
+  size_t next_worker_;
+  bool stopping_;
+  ConnectCompletion connect_overlap_;
   NewConnectionCallback new_connection_callback_;
   ExceptionCallback exception_callback_;
-  std::function<void()> async_io_callback_;
-  std::function<void()> async_wait_io_callback_;
+
+  friend VOID WINAPI CompletedConnectRoutine(DWORD, DWORD, LPOVERLAPPED);
 };
 
 }  // namespace interprocess
@@ -0,0 +1,346 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#include "interprocess/broadcast.h"
+#include <windows.h>
+#include <algorithm>
+#include <cassert>
+#include <string>
+#include <vector>
+#include "interprocess/frame.h"
+
+namespace interprocess {
+
+namespace {
+
+const uint32_t kWrapMarker = 0xFFFFFFFF;
+
+const uint32_t kBroadcastStride =
+  sizeof(BroadcastRing::Header) + kBroadcastRingSize;
+
+inline uint32_t RecordSize(size_t size) {
+  return (sizeof(uint32_t) + size + 7) & ~7;
+}
+
+std::string SectionName(const std::string& endpoint) {
+  return std::string("Local\\interprocess#broadcast#").append(endpoint);
+}
+
+std::string WakeName(const std::string& endpoint, int slot) {
+  return SectionName(endpoint).append("#wake#").append(std::to_string(slot));
+}
+
+}  // namespace
+
+VOID WINAPI CompletedSubscriberRoutine(DWORD, DWORD, LPOVERLAPPED overlap) {
+  auto context = (Subscriber::IoCompletionRoutine*)overlap;
+  context->self->OnWake();
+}
+
+VOID CALLBACK SubscriberWaitCallback(PVOID context, BOOLEAN) {
+  // Runs on a thread pool wait thread, the ring is read on the loop thread.
+  auto self = static_cast<Subscriber*>(context);
+  self->loop_->Post(&self->wake_overlap_);
+}
+
+BroadcastRing::BroadcastRing()
+  : header_(nullptr),
+    data_(nullptr),
+    capacity_(0) {}
+
+void BroadcastRing::Attach(char* memory, uint32_t capacity, bool initialize) {
+  assert(("ring capacity must be a power of two",
+    (capacity & (capacity - 1)) == 0));
+  header_ = reinterpret_cast<Header*>(memory);
+  data_ = memory + sizeof(Header);
+  capacity_ = capacity;
+  if (initialize) {
+    header_->head.store(0);
+    header_->reserved.store(0);
+    std::for_each(std::begin(header_->slots),
+                  std::end(header_->slots),
+                  [](Slot& slot) {
+      slot.claimed.store(0);
+      slot.parked.store(0);
+    });
+  }
+}
+
+uint64_t BroadcastRing::Publish(const std::string& frames) {
+  auto head = header_->head.load(std::memory_order_relaxed);
+  PacketReader reader(frames.data(), frames.size());
+  const char* frame = nullptr;
+  size_t size = 0;
+  while (reader.Next(&frame, &size)) {
+    auto record = RecordSize(size);
+    auto offset = static_cast<uint32_t>(head & (capacity_ - 1));
+    auto contiguous = capacity_ - offset;
+    auto padding = record > contiguous ? contiguous : 0;
+    // Announced before the old records are overwritten, a reader still
+    // copying one of them finds out afterwards.
+    header_->reserved.store(
+      head + padding + record, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    if (padding) {
+      *reinterpret_cast<uint32_t*>(data_ + offset) = kWrapMarker;
+      head += padding;
+      offset = 0;
+    }
+    *reinterpret_cast<uint32_t*>(data_ + offset) = static_cast<uint32_t>(size);
+    CopyMemory(data_ + offset + sizeof(uint32_t), frame, size);
+    head += record;
+  }
+  header_->head.store(head, std::memory_order_seq_cst);
+  uint64_t parked = 0;
+  for (int i = 0; i < kBroadcastSubscribers; ++i) {
+    auto& slot = header_->slots[i];
+    if (slot.parked.load(std::memory_order_seq_cst) &&
+        slot.parked.exchange(0)) {
+      parked |= uint64_t(1) << i;
+    }
+  }
+  return parked;
+}
+
+bool BroadcastRing::Peek(
+  uint64_t* cursor, const char** frame, size_t* size) const {
+  auto position = *cursor;
+  if (position == header_->head.load(std::memory_order_acquire)) {
+    return false;
+  }
+  auto offset = static_cast<uint32_t>(position & (capacity_ - 1));
+  auto length = *reinterpret_cast<const uint32_t*>(data_ + offset);
+  if (length == kWrapMarker) {
+    position += capacity_ - offset;
+    offset = 0;
+    length = *reinterpret_cast<const uint32_t*>(data_);
+  }
+  // A length the writer is overwriting is caught by Lapped(), it must not
+  // send the reader out of the ring in the meantime.
+  length = std::min<uint32_t>(
+    length, capacity_ - offset - static_cast<uint32_t>(sizeof(uint32_t)));
+  *frame = data_ + offset + sizeof(uint32_t);
+  *size = length;
+  *cursor = position + RecordSize(length);
+  return true;
+}
+
+bool BroadcastRing::Lapped(uint64_t cursor) const {
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return header_->reserved.load(std::memory_order_relaxed) - cursor >
+    capacity_;
+}
+
+uint64_t BroadcastRing::Head() const {
+  return header_->head.load(std::memory_order_seq_cst);
+}
+
+int BroadcastRing::Claim() {
+  for (int i = 0; i < kBroadcastSubscribers; ++i) {
+    uint32_t free = 0;
+    if (header_->slots[i].claimed.compare_exchange_strong(free, 1)) {
+      header_->slots[i].parked.store(0);
+      return i;
+    }
+  }
+  return -1;
+}
+
+void BroadcastRing::Release(int slot) {
+  header_->slots[slot].parked.store(0);
+  header_->slots[slot].claimed.store(0);
+}
+
+void BroadcastRing::Park(int slot) {
+  header_->slots[slot].parked.store(1, std::memory_order_seq_cst);
+}
+
+BroadcastChannel::BroadcastChannel(const std::string& endpoint)
+  : endpoint_(endpoint),
+    view_(nullptr),
+    wakes_(kBroadcastSubscribers) {
+  section_.reset(CreateFileMapping(
+    INVALID_HANDLE_VALUE,  // backed by the paging file
+    NULL,                  // default security attributes
+    PAGE_READWRITE,        // read/write access
+    0,                     // maximum object size (high-order DWORD)
+    kBroadcastStride,      // maximum object size (low-order DWORD)
+    SectionName(endpoint).c_str()));
+  raise_exception_if([this]() { return !section_; });
+  // Subscribers of a previous server keep the section alive, they carry on
+  // from where it left off.
+  auto initialize = GetLastError() != ERROR_ALREADY_EXISTS;
+
+  view_ = static_cast<char*>(
+    MapViewOfFile(section_.get(), FILE_MAP_ALL_ACCESS, 0, 0, kBroadcastStride));
+  raise_exception_if([this]() { return !view_; });
+  ring_.Attach(view_, kBroadcastRingSize, initialize);
+}
+
+BroadcastChannel::~BroadcastChannel() {
+  if (view_) {
+    UnmapViewOfFile(view_);
+  }
+}
+
+void BroadcastChannel::Publish(const Buffer& buffer) {
+  if (buffer.frames_->size() > static_cast<size_t>(kBroadcastRingSize / 2)) {
+    throw ConnectionExcepton("message too long for the broadcast ring");
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto parked = ring_.Publish(*buffer.frames_);
+  for (int i = 0; parked; ++i, parked >>= 1) {
+    if (!(parked & 1)) {
+      continue;
+    }
+    // Held on to, a subscriber taking the slot later opens the same event.
+    auto& wake = wakes_[i];
+    if (!wake) {
+      wake.reset(OpenEvent(
+        EVENT_MODIFY_STATE, FALSE, WakeName(endpoint_, i).c_str()));
+    }
+    if (wake) {
+      SetEvent(wake.get());
+    }
+  }
+}
+
+Subscriber::Subscriber(
+  const std::string& endpoint,
+  EventLoop* loop,
+  const Callback& callback,
+  const std::function<void()>& lapped)
+  : view_(nullptr),
+    wait_(NULL),
+    loop_(loop),
+    slot_(-1),
+    receiver_(new Receiver),
+    callback_(callback),
+    lapped_(lapped) {
+  // Zeroed when created here, which is how an empty ring starts.
+  section_.reset(CreateFileMapping(
+    INVALID_HANDLE_VALUE,  // backed by the paging file
+    NULL,                  // default security attributes
+    PAGE_READWRITE,        // read/write access
+    0,                     // maximum object size (high-order DWORD)
+    kBroadcastStride,      // maximum object size (low-order DWORD)
+    SectionName(endpoint).c_str()));
+  raise_exception_if([this]() { return !section_; });
+
+  view_ = static_cast<char*>(
+    MapViewOfFile(section_.get(), FILE_MAP_ALL_ACCESS, 0, 0, kBroadcastStride));
+  raise_exception_if([this]() { return !view_; });
+
+  ring_.Attach(view_, kBroadcastRingSize, false);
+  slot_ = ring_.Claim();
+  if (slot_ < 0) {
+    UnmapViewOfFile(view_);
+    throw ConnectionExcepton("no free broadcast subscriber slot");
+  }
+  // Auto-reset, or opened as the writer left it: a stale wakeup only makes
+  // the subscriber look at the ring once for nothing.
+  wake_.reset(CreateEvent(
+    NULL, FALSE, FALSE, WakeName(endpoint, slot_).c_str()));
+  if (!wake_) {
+    auto error = last_error();
+    ring_.Release(slot_);
+    UnmapViewOfFile(view_);
+    std::rethrow_exception(error);
+  }
+  cursor_ = ring_.Head();
+  messages_.reserve(kMessageBatch);
+  ZeroMemory(&wake_overlap_.overlap, sizeof wake_overlap_.overlap);
+  wake_overlap_.routine = CompletedSubscriberRoutine;
+  wake_overlap_.self = this;
+  loop_->Post(&wake_overlap_);
+}
+
+Subscriber::~Subscriber() {
+  if (wait_) {
+    UnregisterWaitEx(wait_, INVALID_HANDLE_VALUE);
+  }
+  if (slot_ >= 0) {
+    ring_.Release(slot_);
+  }
+  if (view_) {
+    UnmapViewOfFile(view_);
+  }
+}
+
+void Subscriber::OnWake() {
+  if (wait_) {
+    UnregisterWaitEx(wait_, NULL);
+    wait_ = NULL;
+  }
+  // Parked before the last look at the head: a message published after it
+  // sets our event. One published in between is read now, and its wakeup
+  // only makes us look once more for nothing.
+  Drain();
+  ring_.Park(slot_);
+  while (ring_.Head() != cursor_) {
+    Drain();
+  }
+  raise_exception_if([this]() {
+    return !RegisterWaitForSingleObject(
+      &wait_,
+      wake_.get(),                // set by the publisher
+      SubscriberWaitCallback,
+      this,
+      INFINITE,                   // wait indefinitely
+      WT_EXECUTEONLYONCE |        // parked again after the ring is read
+      WT_EXECUTEINWAITTHREAD);    // the callback only posts to the loop
+  });
+}
+
+bool Subscriber::Drain() {
+  const char* frame = nullptr;
+  size_t size = 0;
+  auto batch = static_cast<size_t>(kMessageBatch);
+  auto lapped = false;
+  auto start = cursor_;
+  while (ring_.Peek(&cursor_, &frame, &size)) {
+    auto staged = messages_.size();
+    auto intact = !ring_.Lapped(start);
+    if (intact) {
+      try {
+        receiver_->Stage(frame, size, &messages_);
+      } catch (...) {
+        intact = false;
+      }
+      // The copy only counts if the writer had not reached it by the end.
+      intact = intact && !ring_.Lapped(start);
+    }
+    if (!intact) {
+      // Whatever was left to read is lost, so is a message half assembled.
+      messages_.erase(std::begin(messages_) + staged, std::end(messages_));
+      receiver_.reset(new Receiver);
+      cursor_ = ring_.Head();
+      lapped = true;
+    }
+    if (messages_.size() == batch) {
+      std::for_each(std::begin(messages_),
+                    std::end(messages_),
+                    [this](const Message& message) {
+        callback_(message);
+      });
+      messages_.clear();
+    }
+    start = cursor_;
+  }
+
+  std::for_each(std::begin(messages_),
+                std::end(messages_),
+                [this](const Message& message) {
+    callback_(message);
+  });
+  messages_.clear();
+  if (lapped) {
+    call_if_exist(lapped_);
+  }
+  return lapped;
+}
+
+}  // namespace interprocess
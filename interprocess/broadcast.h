@@ -0,0 +1,137 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef INTERPROCESS_BROADCAST_H_
+#define INTERPROCESS_BROADCAST_H_
+
+#include <windows.h>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "interprocess/buffer.h"
+#include "interprocess/event_loop.h"
+#include "interprocess/message.h"
+#include "interprocess/types.h"
+
+namespace interprocess {
+
+// Single-writer/multi-reader ring in a shared memory section. Records are
+// the length-prefixed frames of the pipe encoding, padded to 8 bytes and
+// preceded by a wrap marker where they would straddle the end of the ring.
+// Positions only grow, the writer never waits for readers: each reader
+// keeps its own cursor and finds out it was lapped when the writer got more
+// than a ring ahead of it. |reserved| runs ahead of |head| while a record
+// is written, a reader checks it after copying a record to know whether the
+// copy may have been overwritten meanwhile.
+// Each reader claims one of the |slots| and has a wake event of its own;
+// it marks its slot parked, and the writer sets the event of every parked
+// reader once, so that a wakeup always goes to the reader that parked.
+class BroadcastRing {
+ public:
+  struct Slot {
+    std::atomic<uint32_t> claimed;
+    std::atomic<uint32_t> parked;
+  };
+  struct Header {
+    __declspec(align(64)) std::atomic<uint64_t> head;
+    std::atomic<uint64_t> reserved;
+    __declspec(align(64)) Slot slots[kBroadcastSubscribers];
+  };
+
+  BroadcastRing();
+  BroadcastRing(const BroadcastRing&) = delete;
+  BroadcastRing& operator=(const BroadcastRing&) = delete;
+  void Attach(char* memory, uint32_t capacity, bool initialize);
+  // Writer only. Returns the slots of the readers to wake, one bit each.
+  uint64_t Publish(const std::string& frames);
+  // Reader only. Points |frame| at the record at |*cursor| and advances the
+  // cursor past it, skipping wrap markers. Returns false at the head.
+  bool Peek(uint64_t* cursor, const char** frame, size_t* size) const;
+  // Whether the records from |cursor| on may have been overwritten.
+  bool Lapped(uint64_t cursor) const;
+  uint64_t Head() const;
+  // Returns a free slot for a reader, or -1 if there is none. A reader that
+  // dies without releasing it keeps it until the section goes away.
+  int Claim();
+  void Release(int slot);
+  void Park(int slot);
+
+ private:
+  Header* header_;
+  char* data_;
+  uint32_t capacity_;
+};
+
+// Server side of the broadcast ring: creates the section named after the
+// endpoint, or opens the one a subscriber created, and publishes into it.
+class BroadcastChannel {
+ public:
+  explicit BroadcastChannel(const std::string& endpoint);
+  BroadcastChannel(const BroadcastChannel&) = delete;
+  BroadcastChannel& operator=(const BroadcastChannel&) = delete;
+  ~BroadcastChannel();
+  // Throws if the message does not fit into half the ring.
+  void Publish(const Buffer& buffer);
+
+ private:
+  std::string endpoint_;
+  handle section_;
+  char* view_;
+  // Wake events of the subscribers by slot, opened when first needed.
+  std::vector<handle> wakes_;
+  std::mutex mutex_;
+  BroadcastRing ring_;
+};
+
+// Client side of the broadcast ring. Reads on |loop| from the head of the
+// ring at the time it subscribed, and parks on its wake event once it has
+// caught up. Creates the section if the server has not published yet.
+// Throws if kBroadcastSubscribers are reading already.
+class Subscriber {
+ public:
+  typedef std::function<void(const Message&)> Callback;
+  Subscriber(
+    const std::string& endpoint,
+    EventLoop* loop,
+    const Callback& callback,
+    const std::function<void()>& lapped);
+  Subscriber(const Subscriber&) = delete;
+  Subscriber& operator=(const Subscriber&) = delete;
+  // Must not run while the loop thread does.
+  ~Subscriber();
+
+ private:
+  struct IoCompletionRoutine : IoCompletion {
+    Subscriber* self;
+  };
+  void OnWake();
+  bool Drain();
+
+  handle section_;
+  char* view_;
+  handle wake_;
+  HANDLE wait_;
+  EventLoop* loop_;
+  BroadcastRing ring_;
+  int slot_;
+  uint64_t cursor_;
+  std::unique_ptr<Receiver> receiver_;
+  std::vector<Message> messages_;
+  Callback callback_;
+  std::function<void()> lapped_;
+  IoCompletionRoutine wake_overlap_;
+
+  friend VOID WINAPI CompletedSubscriberRoutine(DWORD, DWORD, LPOVERLAPPED);
+  friend VOID CALLBACK SubscriberWaitCallback(PVOID, BOOLEAN);
+};
+
+}  // namespace interprocess
+
+#endif  // INTERPROCESS_BROADCAST_H_
@@ -0,0 +1,72 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#include "interprocess/buffer.h"
+#include <memory>
+#include <mutex>
+#include <string>
+#include "interprocess/compress.h"
+#include "interprocess/frame.h"
+
+namespace interprocess {
+
+Buffer::Buffer(const std::string& message)
+  : size_(message.size()) {
+  auto frames = std::make_shared<std::string>();
+  EncodeFrames(message, frames.get());
+  frames_ = frames;
+  if (size_ >= static_cast<size_t>(kMinCompressedSize)) {
+    compression_ = std::make_shared<Compression>();
+  }
+}
+
+Buffer::Buffer(
+  const std::string& message, uint8_t kind, uint64_t correlation)
+  : size_(message.size()) {
+  auto frames = std::make_shared<std::string>();
+  EncodeFrames(message, frames.get(), kind, correlation);
+  frames_ = frames;
+  if (size_ >= static_cast<size_t>(kMinCompressedSize) &&
+      !(kind & FRAME_CONTROL)) {
+    compression_ = std::make_shared<Compression>();
+  }
+}
+
+std::shared_ptr<const std::string> Buffer::Compressed() const {
+  if (!compression_) {
+    return nullptr;
+  }
+  std::call_once(compression_->once, [this]() {
+    // The message is read back out of its frames, with its kind and
+    // correlation id.
+    FrameAssembler assembler;
+    PacketReader reader(frames_->data(), frames_->size());
+    const char* frame = nullptr;
+    size_t size = 0;
+    const char* payload = nullptr;
+    size_t length = 0;
+    std::string message;
+    while (reader.Next(&frame, &size) &&
+           !assembler.Feed(frame, size, &payload, &length, &message)) {}
+    std::string compressed;
+    if (!Compress(payload ? payload : message.data(), length, &compressed)) {
+      return;
+    }
+    auto frames = std::make_shared<std::string>();
+    EncodeFrames(compressed,
+                 frames.get(),
+                 assembler.Kind() | FRAME_COMPRESSED,
+                 assembler.Correlation());
+    compression_->frames = frames;
+  });
+  return compression_->frames;
+}
+
+size_t Buffer::Size() const {
+  return size_;
+}
+
+}  // namespace interprocess
@@ -0,0 +1,49 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef INTERPROCESS_BUFFER_H_
+#define INTERPROCESS_BUFFER_H_
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "interprocess/types.h"
+
+namespace interprocess {
+
+// Immutable message, encoded into frames once. Connections sending it share
+// its storage and write to the pipe straight from it, so that a message sent
+// to many connections is copied and allocated only once. So is it
+// compressed only once, by the first connection that compresses it.
+class Buffer {
+ public:
+  explicit Buffer(const std::string& message);
+  size_t Size() const;
+
+ private:
+  friend class BroadcastChannel;
+  friend class Connection;
+  // Encodes a transaction request or reply, a control message or a message
+  // of a stream, see EncodeFrames().
+  Buffer(const std::string& message, uint8_t kind, uint64_t correlation);
+  // Frames of the compressed message, null if it does not compress.
+  std::shared_ptr<const std::string> Compressed() const;
+
+  struct Compression {
+    std::once_flag once;
+    std::shared_ptr<const std::string> frames;
+  };
+
+  std::shared_ptr<const std::string> frames_;
+  // Only for messages long enough to be worth compressing.
+  std::shared_ptr<Compression> compression_;
+  size_t size_;
+};
+
+}  // namespace interprocess
+
+#endif  // INTERPROCESS_BUFFER_H_
@@ -9,60 +9,97 @@
 #include <algorithm>
 #include <condition_variable>
 #include <memory>
+#include <random>
 #include <string>
 #include <utility>
+#include "interprocess/broadcast.h"
 #include "interprocess/connector.h"
 #include "interprocess/connection.h"
+#include "interprocess/session.h"
 
 namespace interprocess {
 
 class Client::Impl {
  public:
-  explicit Impl(const std::string& name);
+  Impl(const std::string& name, TransportE transport);
   Impl(const Impl&) = delete;
   Impl& operator=(const Impl&) = delete;
-  ~Impl() = default;
+  ~Impl();
   bool Connect(const std::string& server_name, int milliseconds);
   std::string Name() const;
   ConnectionPtr Connection();
   void SetMessageCallback(const MessageCallback& cb);
+  void SetMessageViewCallback(const MessageViewCallback& cb);
+  void SetBatchMessageCallback(const BatchMessageCallback& cb);
+  void SetStreamMessageCallback(const StreamMessageCallback& cb);
   void SetExceptionCallback(const ExceptionCallback& cb);
+  void SetSendLimits(const SendLimits& limits);
+  void SetCompressionThreshold(size_t bytes);
+  void SetSendBatching(const SendBatching& batching);
+  void SetHighWaterMarkCallback(const WaterMarkCallback& cb);
+  void SetLowWaterMarkCallback(const WaterMarkCallback& cb);
+  void SetReconnect(const ReconnectPolicy& policy);
+  bool Subscribe(const MessageViewCallback& cb, const LappedCallback& lapped);
   void Stop();
 
  private:
-  void NewConnection(HANDLE pipe, HANDLE post_event, HANDLE send_event);
+  void NewConnection(HANDLE pipe, EventLoop* loop);
   void ResetConnection(const ConnectionPtr& conn);
-  void AsyncWrite();
-  void AsyncWaitWrite();
 
+  // Replaced on the loop thread at every reconnect, read by any thread
+  // under |connected_mutex_|.
   ConnectionPtr conn_;
   std::unique_ptr<Connector> connector_;
+  // Destroyed after the loop stopped, before the connector closes its port.
+  std::unique_ptr<Subscriber> subscriber_;
   std::string name_;
+  std::string server_name_;
+  EventLoop* loop_;
+  std::shared_ptr<const std::string> prefix_;
+  ConnectionId connections_;
+  const TransportE transport_;
   bool connected_;
   std::mutex connected_mutex_;
   std::condition_variable connected_cond_;
-  MessageCallback message_callback_;
+  MessageViewCallback message_callback_;
+  BatchMessageCallback batch_message_callback_;
+  StreamMessageCallback stream_message_callback_;
   ExceptionCallback exception_callback_;
+  SendLimits send_limits_;
+  size_t compression_threshold_;
+  SendBatching send_batching_;
+  WaterMarkCallback high_water_mark_callback_;
+  WaterMarkCallback low_water_mark_callback_;
+  ReconnectPolicy reconnect_policy_;
+  std::shared_ptr<Session> session_;
 };
 
 // real implement of Client
 
-Client::Impl::Impl(const std::string& name)
+Client::Impl::Impl(const std::string& name, TransportE transport)
   : name_(name),
-    connected_(false) {}
+    loop_(nullptr),
+    prefix_(std::make_shared<const std::string>(name)),
+    connections_(0),
+    transport_(transport),
+    connected_(false),
+    compression_threshold_(0) {}
+
+Client::Impl::~Impl() {
+  if (connector_) {
+    connector_->Stop();
+  }
+  subscriber_.reset();
+}
 
 bool Client::Impl::Connect(const std::string& server_name, int milliseconds) {
   using std::placeholders::_1;
   using std::placeholders::_2;
-  using std::placeholders::_3;
+  server_name_ = server_name;
   connector_.reset(new Connector(server_name));
   connector_->SetNewConnectionCallback(
-    std::bind(&Client::Impl::NewConnection, this, _1, _2, _3));
+    std::bind(&Client::Impl::NewConnection, this, _1, _2));
   connector_->SetExceptionCallback(exception_callback_);
-  connector_->MoveAsyncIOFunctionToAlertableThread(
-    std::bind(&Client::Impl::AsyncWrite, this));
-  connector_->MoveWaitResponseIOFunctionToAlertableThread(
-    std::bind(&Client::Impl::AsyncWaitWrite, this));
   connector_->Connect();
   std::unique_lock<std::mutex> lock(connected_mutex_);
   return connected_cond_.wait_for(
@@ -76,59 +113,138 @@ std::string Client::Impl::Name() const {
 }
 
 ConnectionPtr Client::Impl::Connection() {
+  std::unique_lock<std::mutex> lock(connected_mutex_);
   return conn_;
 }
 
 void Client::Impl::SetMessageCallback(const MessageCallback& cb) {
+  message_callback_ = [cb](const ConnectionPtr& conn, const Message& message) {
+    cb(conn, message.ToString());
+  };
+}
+
+void Client::Impl::SetMessageViewCallback(const MessageViewCallback& cb) {
   message_callback_ = cb;
 }
 
+void Client::Impl::SetBatchMessageCallback(const BatchMessageCallback& cb) {
+  batch_message_callback_ = cb;
+}
+
+void Client::Impl::SetStreamMessageCallback(
+  const StreamMessageCallback& cb) {
+  stream_message_callback_ = cb;
+}
+
 void Client::Impl::SetExceptionCallback(const ExceptionCallback& cb) {
   exception_callback_ = cb;
 }
 
+void Client::Impl::SetSendLimits(const SendLimits& limits) {
+  send_limits_ = limits;
+}
+
+void Client::Impl::SetCompressionThreshold(size_t bytes) {
+  compression_threshold_ = bytes;
+}
+
+void Client::Impl::SetSendBatching(const SendBatching& batching) {
+  send_batching_ = batching;
+}
+
+void Client::Impl::SetHighWaterMarkCallback(const WaterMarkCallback& cb) {
+  high_water_mark_callback_ = cb;
+}
+
+void Client::Impl::SetLowWaterMarkCallback(const WaterMarkCallback& cb) {
+  low_water_mark_callback_ = cb;
+}
+
+void Client::Impl::SetReconnect(const ReconnectPolicy& policy) {
+  // The server tells sessions apart by their id, and binds each one to the
+  // process that opened it.
+  std::random_device device;
+  std::mt19937_64 random((static_cast<uint64_t>(device()) << 32) | device());
+  uint64_t id = 0;
+  while (!id) {
+    id = random();
+  }
+  reconnect_policy_ = policy;
+  session_ = std::make_shared<Session>(id, 0, 0);
+}
+
+bool Client::Impl::Subscribe(
+  const MessageViewCallback& cb, const LappedCallback& lapped) {
+  // A subscriber is only destroyed once the loop stopped, the loop may be
+  // reading it or have its wakeup queued.
+  if (!loop_ || subscriber_) {
+    return false;
+  }
+  try {
+    // The callbacks run on the loop thread, as the connection ones do.
+    subscriber_.reset(new Subscriber(
+      server_name_,
+      loop_,
+      [this, cb](const Message& message) { cb(Connection(), message); },
+      lapped));
+  } catch (const ConnectionExcepton&) {
+    return false;
+  }
+  return true;
+}
+
 void Client::Impl::Stop() {
   connector_->Stop();
+  subscriber_.reset();
 }
 
-void Client::Impl::NewConnection(
-  HANDLE pipe, HANDLE post_event, HANDLE send_event) {
+void Client::Impl::NewConnection(HANDLE pipe, EventLoop* loop) {
   using std::placeholders::_1;
   using interprocess::Connection;
-  auto name = name_.append("#").append(
-    std::to_string(reinterpret_cast<int32_t>(pipe)));
-  conn_ = std::make_shared<Connection>(name, pipe, post_event, send_event);
-  conn_->SetCloseCallback(
+  loop_ = loop;
+  auto conn = std::make_shared<Connection>(
+    ++connections_, prefix_, pipe, loop, transport_);
+  conn->SetCloseCallback(
     std::bind(&Client::Impl::ResetConnection, this, _1));
-  ConnectionAttorney::SetMessageCallback(conn_, message_callback_);
+  ConnectionAttorney::SetMessageCallback(conn, message_callback_);
+  ConnectionAttorney::SetBatchMessageCallback(
+    conn, batch_message_callback_);
+  ConnectionAttorney::SetStreamMessageCallback(
+    conn, stream_message_callback_);
+  ConnectionAttorney::SetSendLimits(conn, send_limits_);
+  ConnectionAttorney::SetCompressionThreshold(conn, compression_threshold_);
+  ConnectionAttorney::SetSendBatching(conn, send_batching_);
+  ConnectionAttorney::SetHighWaterMarkCallback(
+    conn, high_water_mark_callback_);
+  ConnectionAttorney::SetLowWaterMarkCallback(
+    conn, low_water_mark_callback_);
+  if (session_) {
+    ConnectionAttorney::SetSession(conn, session_);
+  }
+  ConnectionAttorney::Start(conn);
   std::unique_lock<std::mutex> lock(connected_mutex_);
+  conn_ = conn;
   connected_ = true;
   connected_cond_.notify_all();
 }
 
 void Client::Impl::ResetConnection(const ConnectionPtr& conn) {
-  conn_.reset();
+  // Released unlocked, it may be the last reference.
+  ConnectionPtr closed;
   std::unique_lock<std::mutex> lock(connected_mutex_);
+  closed.swap(conn_);
   connected_ = false;
   connected_cond_.notify_all();
-}
-
-void Client::Impl::AsyncWrite() {
-  if (conn_ && conn_->State() == Connection::SEND_PENDDING) {
-    ConnectionAttorney::AsyncWrite(conn_);
-  }
-}
-
-void Client::Impl::AsyncWaitWrite() {
-  if (conn_) {
-    ConnectionAttorney::AsyncWaitWrite(conn_);
+  lock.unlock();
+  if (session_) {
+    connector_->Reconnect(reconnect_policy_);
   }
 }
 
 // Client wrapper
 
-Client::Client(const std::string& name)
-  : impl_(new Impl(name)) {}
+Client::Client(const std::string& name, TransportE transport)
+  : impl_(new Impl(name, transport)) {}
 
 Client::Client(Client&& other) {
   swap(other);
@@ -161,10 +277,51 @@ void Client::SetMessageCallback(const MessageCallback& cb) {
   impl_->SetMessageCallback(cb);
 }
 
+void Client::SetMessageViewCallback(const MessageViewCallback& cb) {
+  impl_->SetMessageViewCallback(cb);
+}
+
+void Client::SetBatchMessageCallback(const BatchMessageCallback& cb) {
+  impl_->SetBatchMessageCallback(cb);
+}
+
+void Client::SetStreamMessageCallback(const StreamMessageCallback& cb) {
+  impl_->SetStreamMessageCallback(cb);
+}
+
 void Client::SetExceptionCallback(const ExceptionCallback& cb) {
   impl_->SetExceptionCallback(cb);
 }
 
+void Client::SetSendLimits(const SendLimits& limits) {
+  impl_->SetSendLimits(limits);
+}
+
+void Client::SetCompressionThreshold(size_t bytes) {
+  impl_->SetCompressionThreshold(bytes);
+}
+
+void Client::SetSendBatching(const SendBatching& batching) {
+  impl_->SetSendBatching(batching);
+}
+
+void Client::SetHighWaterMarkCallback(const WaterMarkCallback& cb) {
+  impl_->SetHighWaterMarkCallback(cb);
+}
+
+void Client::SetLowWaterMarkCallback(const WaterMarkCallback& cb) {
+  impl_->SetLowWaterMarkCallback(cb);
+}
+
+void Client::SetReconnect(const ReconnectPolicy& policy) {
+  impl_->SetReconnect(policy);
+}
+
+bool Client::Subscribe(
+  const MessageViewCallback& cb, const LappedCallback& lapped) {
+  return impl_->Subscribe(cb, lapped);
+}
+
 void Client::Stop() {
   impl_->Stop();
 }
@@ -10,13 +10,15 @@
 #include <algorithm>
 #include <memory>
 #include <string>
+#include "interprocess/message.h"
 #include "interprocess/types.h"
 
 namespace interprocess {
 
 class Client {
  public:
-  explicit Client(const std::string& name);
+  explicit Client(
+    const std::string& name, TransportE transport = NAMED_PIPE);
   Client(const Client&) = delete;
   Client(Client&& other);
   Client& operator=(const Client&) = delete;
@@ -25,9 +27,48 @@ class Client {
   void swap(Client& other);
   bool Connect(const std::string& server_name, int milliseconds);
   std::string Name() const;
+  // The connection to the server, null before Connect() succeeded, and
+  // with SetReconnect() while the client is connecting again.
   ConnectionPtr Connection();
   void SetMessageCallback(const MessageCallback& callback);
+  // Messages are loaned from the receive buffer, without a copy into a
+  // std::string. Takes the place of the message callback.
+  void SetMessageViewCallback(const MessageViewCallback& cb);
+  // Messages read together are handed over in one call instead of through
+  // the message callback.
+  void SetBatchMessageCallback(const BatchMessageCallback& cb);
+  // Messages on the streams peers open, see Connection::OpenStream().
+  // Without it they go to the message callback, and cannot be answered on
+  // their stream.
+  void SetStreamMessageCallback(const StreamMessageCallback& cb);
   void SetExceptionCallback(const ExceptionCallback& cb);
+  // Bounds the send queue of every connection made from now on, see
+  // SendLimits.
+  void SetSendLimits(const SendLimits& limits);
+  // Compresses the messages of at least |bytes|, kMinCompressedSize at
+  // least, that connections made from now on send to peers which compress
+  // too; 0, the default, turns it off. Peers find out about each other once
+  // connected. A message that would not shrink by a sixteenth is sent as is.
+  void SetCompressionThreshold(size_t bytes);
+  // Coalesces what connections made from now on send, see SendBatching.
+  void SetSendBatching(const SendBatching& batching);
+  void SetHighWaterMarkCallback(const WaterMarkCallback& cb);
+  void SetLowWaterMarkCallback(const WaterMarkCallback& cb);
+  // Connects again whenever the connection breaks, as |policy| says; call
+  // before Connect(). Plain messages then belong to a session with the
+  // server: sent on a broken connection, or not acknowledged by the server
+  // when it broke, they are sent again on the next one, in order, and the
+  // server does the same. Requests, replies and stream messages are not
+  // kept, transactions under way fail as they do without it. The server
+  // only lets this process resume the session.
+  void SetReconnect(const ReconnectPolicy& policy);
+  // Reads what the server publishes on the loop of the connection, from the
+  // next message on. Call once connected, and once only: returns false if
+  // the client already subscribed, or if the broadcast ring of the server
+  // could not be mapped.
+  // |lapped| runs after messages were skipped.
+  bool Subscribe(
+    const MessageViewCallback& cb, const LappedCallback& lapped = nullptr);
   void Stop();
 
  private:
@@ -0,0 +1,220 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#include "interprocess/compress.h"
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include "interprocess/frame.h"
+
+namespace interprocess {
+
+namespace {
+
+const size_t kMinMatch = 4;
+// The last literals of a block, and where the last match may start.
+const size_t kLastLiterals = 5;
+const size_t kMatchLimit = 12;
+const size_t kMaxOffset = 65535;
+const int kHashLog = 12;
+// Misses before the search step grows by one.
+const int kSkipTrigger = 6;
+
+inline uint32_t Read32(const char* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof value);
+  return value;
+}
+
+inline uint32_t Hash(uint32_t value) {
+  return (value * 2654435761u) >> (32 - kHashLog);
+}
+
+// A length field of 15 continues in bytes of 255, up to a smaller one.
+char* WriteLength(char* out, size_t length) {
+  for (; length >= 255; length -= 255) {
+    *out++ = static_cast<char>(255);
+  }
+  *out++ = static_cast<char>(length);
+  return out;
+}
+
+size_t ReadLength(const char** in, const char* end) {
+  size_t length = 0;
+  uint8_t byte = 0;
+  do {
+    if (*in == end) {
+      throw ConnectionExcepton("truncated compressed length");
+    }
+    byte = static_cast<uint8_t>(*(*in)++);
+    length += byte;
+  } while (byte == 255);
+  return length;
+}
+
+// Writes the literals from |anchor| to |match|, and the match of |length|
+// bytes |offset| back from it unless |length| is 0.
+char* WriteSequence(
+  char* out,
+  const char* anchor,
+  const char* match,
+  size_t offset,
+  size_t length) {
+  auto literals = static_cast<size_t>(match - anchor);
+  auto token = out++;
+  *token = static_cast<char>((literals < 15 ? literals : 15) << 4);
+  if (literals >= 15) {
+    out = WriteLength(out, literals - 15);
+  }
+  memcpy(out, anchor, literals);
+  out += literals;
+  if (!length) {
+    return out;
+  }
+  *out++ = static_cast<char>(offset & 0xFF);
+  *out++ = static_cast<char>(offset >> 8);
+  length -= kMinMatch;
+  *token |= static_cast<char>(length < 15 ? length : 15);
+  if (length >= 15) {
+    out = WriteLength(out, length - 15);
+  }
+  return out;
+}
+
+size_t CompressBlock(const char* data, size_t size, char* out) {
+  auto begin = out;
+  auto anchor = data;
+  auto end = data + size;
+  if (size > kMatchLimit + kMinMatch) {
+    uint32_t table[1 << kHashLog] = { 0 };
+    auto match_limit = end - kMatchLimit;
+    auto literals_limit = end - kLastLiterals;
+    auto in = data + 1;
+    int misses = 0;
+    while (in < match_limit) {
+      auto hash = Hash(Read32(in));
+      auto match = data + table[hash];
+      table[hash] = static_cast<uint32_t>(in - data);
+      if (match >= in || static_cast<size_t>(in - match) > kMaxOffset ||
+          Read32(match) != Read32(in)) {
+        in += 1 + (misses++ >> kSkipTrigger);
+        continue;
+      }
+      while (in > anchor && match > data && in[-1] == match[-1]) {
+        --in;
+        --match;
+      }
+      auto last = in + kMinMatch;
+      auto from = match + kMinMatch;
+      while (last < literals_limit && *last == *from) {
+        ++last;
+        ++from;
+      }
+      out = WriteSequence(out,
+                          anchor,
+                          in,
+                          static_cast<size_t>(in - match),
+                          static_cast<size_t>(last - in));
+      in = anchor = last;
+      misses = 0;
+      if (in < match_limit) {
+        table[Hash(Read32(in - 2))] = static_cast<uint32_t>(in - 2 - data);
+      }
+    }
+  }
+  out = WriteSequence(out, anchor, end, 0, 0);
+  return static_cast<size_t>(out - begin);
+}
+
+}  // namespace
+
+bool Compress(const char* data, size_t size, std::string* compressed) {
+  auto length = static_cast<uint32_t>(size);
+  auto bound = size + size / 255 + 16;
+  compressed->resize(sizeof length + bound);
+  auto out = &(*compressed)[0];
+  memcpy(out, &length, sizeof length);
+  auto written = sizeof length + CompressBlock(data, size, out + sizeof length);
+  if (written > size - size / 16) {
+    compressed->clear();
+    return false;
+  }
+  compressed->resize(written);
+  return true;
+}
+
+void Decompress(const char* data, size_t size, std::string* message) {
+  uint32_t length = 0;
+  if (size < sizeof length) {
+    throw ConnectionExcepton("truncated compressed message");
+  }
+  memcpy(&length, data, sizeof length);
+  if (length > static_cast<uint32_t>(kMaxMessageSize)) {
+    throw ConnectionExcepton("bad message length");
+  }
+  message->resize(length);
+  if (!length) {
+    // Nothing to copy into, the block is a lone empty token.
+    return;
+  }
+  auto in = data + sizeof length;
+  auto in_end = data + size;
+  auto begin = &(*message)[0];
+  auto out = begin;
+  auto out_end = begin + length;
+  for (;;) {
+    if (in == in_end) {
+      throw ConnectionExcepton("truncated compressed block");
+    }
+    auto token = static_cast<uint8_t>(*in++);
+    size_t literals = token >> 4;
+    if (literals == 15) {
+      literals += ReadLength(&in, in_end);
+    }
+    if (literals > static_cast<size_t>(in_end - in) ||
+        literals > static_cast<size_t>(out_end - out)) {
+      throw ConnectionExcepton("compressed literals overrun");
+    }
+    memcpy(out, in, literals);
+    in += literals;
+    out += literals;
+    // The last sequence has no match.
+    if (in == in_end) {
+      break;
+    }
+
+    if (in_end - in < 2) {
+      throw ConnectionExcepton("truncated match offset");
+    }
+    auto offset = static_cast<size_t>(static_cast<uint8_t>(in[0])) |
+      static_cast<size_t>(static_cast<uint8_t>(in[1])) << 8;
+    in += 2;
+    size_t match_length = token & 15;
+    if (match_length == 15) {
+      match_length += ReadLength(&in, in_end);
+    }
+    match_length += kMinMatch;
+    if (!offset || offset > static_cast<size_t>(out - begin) ||
+        match_length > static_cast<size_t>(out_end - out)) {
+      throw ConnectionExcepton("compressed match overrun");
+    }
+    auto match = out - offset;
+    if (offset >= match_length) {
+      memcpy(out, match, match_length);
+      out += match_length;
+    } else {
+      // Overlapping, the match repeats the bytes it is copying.
+      for (size_t i = 0; i < match_length; ++i) {
+        *out++ = *match++;
+      }
+    }
+  }
+  if (out != out_end) {
+    throw ConnectionExcepton("compressed message ended early");
+  }
+}
+
+}  // namespace interprocess
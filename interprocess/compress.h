@@ -0,0 +1,31 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef INTERPROCESS_COMPRESS_H_
+#define INTERPROCESS_COMPRESS_H_
+
+#include <string>
+#include "interprocess/types.h"
+
+namespace interprocess {
+
+// A compressed message is its original length, a uint32, followed by an
+// LZ4 block: runs of literals and back references of at least four bytes
+// into the last 64KB. Matches are found through a hash of the next four
+// bytes and taken greedily, skipping ahead faster the longer nothing
+// matches, so that incompressible data is given up on quickly.
+
+// Compresses |size| bytes at |data| into |compressed|. Returns false if
+// that would not save at least a sixteenth of them.
+bool Compress(const char* data, size_t size, std::string* compressed);
+
+// Replaces |message| with the decompressed message, throws on a malformed
+// one.
+void Decompress(const char* data, size_t size, std::string* message);
+
+}  // namespace interprocess
+
+#endif  // INTERPROCESS_COMPRESS_H_
@@ -5,29 +5,86 @@
 //  http://www.boost.org/LICENSE_1_0.txt
 
 #include "interprocess/connection.h"
+#include <algorithm>
 #include <cassert>
+#include <map>
 #include <string>
+#include <utility>
+#include <vector>
+#include "interprocess/trace.h"
 
 namespace interprocess {
 
+namespace {
+
+// The packets of a message are cut from its frames in order, the one that
+// reaches their end is the last.
+inline bool EndsMessage(const Packet& packet) {
+  return packet.offset + packet.size == packet.storage->size();
+}
+
+typedef HANDLE (WINAPI *CreateWaitableTimerExFunction)(
+  LPSECURITY_ATTRIBUTES, LPCSTR, DWORD, DWORD);
+
+// CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, missing from older SDKs.
+const DWORD kHighResolutionTimer = 0x00000002;
+
+const auto kCreateWaitableTimerEx =
+  reinterpret_cast<CreateWaitableTimerExFunction>(GetProcAddress(
+    GetModuleHandle("kernel32.dll"), "CreateWaitableTimerExA"));
+
+// Delays shorter than the system timer tick are only kept with a high
+// resolution timer, Windows 10 1803 and later. Elsewhere they round up to
+// the tick.
+HANDLE CreateBatchTimer() {
+  HANDLE timer = NULL;
+  if (kCreateWaitableTimerEx) {
+    timer = kCreateWaitableTimerEx(
+      NULL, NULL, kHighResolutionTimer, TIMER_ALL_ACCESS);
+  }
+  return timer ? timer : CreateWaitableTimer(NULL, FALSE, NULL);
+}
+
+// Plain messages, those a session numbers.
+inline bool Sequenceable(uint8_t kind) {
+  return !(kind & (FRAME_REQUEST | FRAME_REPLY | FRAME_CONTROL | FRAME_STREAM));
+}
+
+// Flags the frames of a message for the session, in a copy if they are
+// shared with connections that may have none.
+std::shared_ptr<const std::string> Sequenced(
+  const std::shared_ptr<const std::string>& frames) {
+  if (KindOf(*frames) & FRAME_SEQUENCED) {
+    return frames;
+  }
+  auto copy = std::make_shared<std::string>(*frames);
+  (*copy)[kFrameLengthSize] |= FRAME_SEQUENCED;
+  return copy;
+}
+
+// Set on the ids of the streams the peer opened. A side sends the id of a
+// stream as it knows it, the receiver flips the bit to read it as its own.
+const StreamId kPeerStream = 0x80000000u;
+
+// Counters written by the loop thread alone. Readers on other threads only
+// need the value not to tear, so no locked instruction is spent on them.
+inline void Count(std::atomic<uint64_t>* counter, uint64_t n = 1) {
+  counter->store(counter->load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+}
+
+}  // namespace
+
 VOID WINAPI CompletedReadRoutine(
   DWORD err, DWORD readed, LPOVERLAPPED overlap) {
   auto context = (Connection::IoCompletionRoutine*)overlap;
   auto self = context->self;
-
-  if (err == ERROR_OPERATION_ABORTED) {
-    SetEvent(self->cancel_io_event_.get());
+  ConnectionPtr closing;
+  if (!self->Release(&closing)) {
     return;
   }
-  bool io = false;
-  if ((err == 0) && (readed != 0)) {
-    auto message = std::string(self->read_buf_, readed);
-    io = self->AsyncRead(CompletedReadRoutine);
-    if (!message.empty()) {
-      self->message_callback_(self->shared_from_this(), message);
-    }
-  }
 
+  auto io = (err == 0) && (readed != 0) && self->ReadPackets(readed);
   if (!io) {
     self->Shutdown();
   }
@@ -37,31 +94,17 @@ VOID WINAPI CompletedWriteRoutine(
   DWORD err, DWORD written, LPOVERLAPPED overlap) {
   auto context = (Connection::IoCompletionRoutine*)overlap;
   auto self = context->self;
-  if (err == ERROR_OPERATION_ABORTED) {
-    SetEvent(self->cancel_io_event_.get());
-    assert(("write operation should not be cancelled", false));
+  INTERPROCESS_TRACE("write", ASYNC_END, self->id_);
+  ConnectionPtr closing;
+  if (!self->Release(&closing)) {
     return;
   }
+
   bool io = false;
-  // The write operation has finished, so read() the next request (if
-  // there is no error) or continue write if necessary.
-  if ((err == 0) && (written == self->write_size_)) {
-    bool pendding = false;
-    std::string message;
-    {
-      std::unique_lock<std::mutex> lock(self->sending_queue_mutex_);
-      pendding = !self->sending_queue_.empty();
-      if (pendding) {
-        message = self->sending_queue_.front();
-        self->sending_queue_.pop_front();
-        self->state_ = Connection::SEND_PENDDING;
-      } else {
-        self->state_ = Connection::CONNECTED;
-      }
-    }
-    io = pendding ?
-      self->AsyncWrite(message, CompletedWriteRoutine) :
-      self->AsyncRead(CompletedReadRoutine);
+  // The write operation has finished, continue write if necessary. The read
+  // operation stays pending on its own OVERLAPPED structure.
+  if ((err == 0) && (written == self->packet_.size)) {
+    io = self->NextPacket() ? self->WritePacket() : !self->disconnecting_;
   }
 
   if (!io) {
@@ -69,110 +112,296 @@ VOID WINAPI CompletedWriteRoutine(
   }
 }
 
-VOID WINAPI CompletedReadRoutineForWait(
-  DWORD err, DWORD readed, LPOVERLAPPED overlap) {
+VOID WINAPI CompletedWakeRoutine(DWORD, DWORD, LPOVERLAPPED overlap) {
   auto context = (Connection::IoCompletionRoutine*)overlap;
-  auto self = context->self;
-
-  if (err == ERROR_OPERATION_ABORTED) {
-    SetEvent(self->cancel_io_event_.get());
-    return;
-  }
-  bool io = false;
-  if ((err == 0) && (readed != 0)) {
-    auto message = std::string(self->read_buf_, readed);
-    std::unique_lock<std::mutex> lock(self->transact_message_buffer_mutex_);
-    message.swap(self->transact_message_buffer_);
-    self->transact_message_buffer_cond.notify_all();
-    io = self->AsyncRead(CompletedReadRoutine);
-  }
+  ConnectionPtr self;
+  self.swap(context->pin);
+  self->wake_posted_ = false;
+  self->OnWake();
+}
 
-  if (!io) {
-    self->Shutdown();
+VOID CALLBACK SharedMemoryWaitCallback(PVOID context, BOOLEAN) {
+  // Runs on a thread pool wait thread, the channel is drained on the loop
+  // thread like any other completion.
+  auto self = static_cast<Connection*>(context)->weak_self_.lock();
+  if (self) {
+    self->Wake();
   }
 }
 
-VOID WINAPI CompletedWriteRoutineForWait(
-  DWORD err, DWORD written, LPOVERLAPPED overlap) {
-  auto context = (Connection::IoCompletionRoutine*)overlap;
-  auto self = context->self;
-  if (err == ERROR_OPERATION_ABORTED) {
-    SetEvent(self->cancel_io_event_.get());
-    assert(("write operation should not be cancelled", false));
-    return;
-  }
-  bool io = false;
-  // The write operation has finished, so read() the next request (if
-  // there is no error) or continue write if necessary.
-  if ((err == 0) && (written == self->write_size_)) {
-    io = self->AsyncRead(CompletedReadRoutineForWait);
+VOID CALLBACK BatchTimerCallback(PVOID context, BOOLEAN) {
+  // The batch is due, it is written on the loop thread.
+  auto self = static_cast<Connection*>(context)->weak_self_.lock();
+  if (self) {
+    self->Wake();
   }
+}
 
-  if (!io) {
-    self->Shutdown();
-  }
+VOID CALLBACK TransactionTimerCallback(PVOID context, BOOLEAN) {
+  // Runs on the timer thread. A transaction completed meanwhile deletes the
+  // timer and waits for this callback before freeing the context.
+  auto transaction = static_cast<Connection::Transaction*>(context);
+  transaction->self->Expire(transaction->correlation);
 }
 
 Connection::Connection(
-  const std::string& name, HANDLE pipe, HANDLE post_event, HANDLE send_event)
-  : name_(name),
+  ConnectionId id,
+  const std::shared_ptr<const std::string>& prefix,
+  HANDLE pipe,
+  EventLoop* loop,
+  TransportE transport)
+  : id_(id),
+    prefix_(prefix),
     state_(UNKNOW),
     pipe_(pipe),
-    post_event_(post_event),
-    send_event_(send_event),
-    cancel_io_event_(CreateEvent(NULL, FALSE, FALSE, NULL)),
-    write_size_(0),
+    loop_(loop),
+    inline_io_(EventLoop::SkipCompletionOnSuccess(pipe)),
+    coalesced_(std::make_shared<std::string>()),
+    writes_(0),
+    messages_written_(0),
+    bounded_(false),
+    compression_threshold_(0),
+    batch_wait_(NULL),
+    peer_decompresses_(false),
+    queued_bytes_(0),
+    queued_messages_(0),
+    queued_bytes_peak_(0),
+    messages_in_(0),
+    bytes_in_(0),
+    messages_out_(0),
+    bytes_out_(0),
+    messages_dropped_(0),
+    messages_compressed_(0),
+    transact_timeouts_(0),
+    above_high_water_mark_(false),
+    high_water_mark_crossed_(false),
+    high_water_mark_reported_(false),
+    trim_(false),
+    overflowed_(false),
+    blocked_(0),
+    room_closed_(false),
+    writing_(false),
+    transactions_closed_(false),
+    next_correlation_(0),
+    replying_to_(0),
+    next_stream_(0),
+    sequenced_(false),
+    wake_posted_(false),
+    pending_io_(0),
     io_thread_id_(std::this_thread::get_id()),
-    disconnecting_(false) {
-  ZeroMemory(read_buf_, sizeof read_buf_);
-  ZeroMemory(write_buf_, sizeof write_buf_);
-  ZeroMemory(&io_overlap_, sizeof io_overlap_);
-  io_overlap_.self = this;
-  AsyncRead(CompletedReadRoutine);
+    disconnecting_(false),
+    shutdown_(false),
+    transport_(transport),
+    channel_wait_(NULL) {
+  read_batch_.reserve(kMessageBatch);
+  ring_batch_.reserve(kMessageBatch);
+  packet_.offset = packet_.size = 0;
+  ZeroMemory(&read_overlap_.overlap, sizeof read_overlap_.overlap);
+  ZeroMemory(&write_overlap_.overlap, sizeof write_overlap_.overlap);
+  ZeroMemory(&wake_overlap_.overlap, sizeof wake_overlap_.overlap);
+  read_overlap_.routine = CompletedReadRoutine;
+  read_overlap_.self = this;
+  write_overlap_.routine = CompletedWriteRoutine;
+  write_overlap_.self = this;
+  wake_overlap_.routine = CompletedWakeRoutine;
+  wake_overlap_.self = this;
 }
 
 Connection::~Connection() {
+  AbandonTransactions();
+  if (session_) {
+    session_->Detach(this);
+  }
+  if (channel_wait_) {
+    UnregisterWaitEx(channel_wait_, INVALID_HANDLE_VALUE);
+  }
+  if (batch_wait_) {
+    UnregisterWaitEx(batch_wait_, INVALID_HANDLE_VALUE);
+  }
   CancelIo(pipe_.get());
 }
 
+ConnectionId Connection::Id() const {
+  return id_;
+}
+
 std::string Connection::Name() const {
-  return name_;
+  // Built on demand, a connection keeps no name of its own.
+  return std::string(*prefix_).append("#").append(std::to_string(id_));
 }
 
-void Connection::Send(const std::string& message) {
-  {
-    std::unique_lock<std::mutex> lock(sending_queue_mutex_);
-    assert(("message buffer overflow", message.size() < kBufferSize));
-    sending_queue_.push_back(message);
+bool Connection::Send(const std::string& message) {
+  // Sent from the message callback of a request, it answers the request.
+  if (io_thread_id_ == std::this_thread::get_id() && replying_to_) {
+    auto correlation = replying_to_;
+    replying_to_ = 0;
+    return Send(Buffer(message, FRAME_REPLY, correlation));
+  }
+  return Send(sequenced_ ?
+              Buffer(message, FRAME_SEQUENCED, 0) :
+              Buffer(message));
+}
+
+bool Connection::Send(const Buffer& buffer) {
+  // Compressed by whichever connection to a compressing peer sends it first.
+  std::shared_ptr<const std::string> compressed;
+  if (compression_threshold_ && buffer.size_ >= compression_threshold_ &&
+      peer_decompresses_.load(std::memory_order_relaxed)) {
+    compressed = buffer.Compressed();
+  }
+  const auto& frames = compressed ? compressed : buffer.frames_;
+  auto bytes = frames->size();
+  if (bounded_ && !Admit(bytes)) {
+    return false;
+  }
+  if (compressed) {
+    messages_compressed_.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (sequenced_.load(std::memory_order_acquire) &&
+      Sequenceable(KindOf(*frames))) {
+    // Queued by the session, on whichever connection it has now.
+    session_->Send(Sequenced(frames));
+    return true;
+  }
+  Enqueue(frames);
+  return true;
+}
+
+void Connection::Enqueue(const std::shared_ptr<const std::string>& frames) {
+  auto bytes = frames->size();
+  auto queued = Enqueued(bytes);
+  INTERPROCESS_TRACE("send", INSTANT, id_);
+  // Only the send that finds the queue idle puts the connection on the
+  // ready queue of its loop, the others are drained along with it.
+  auto idle = outbox_.Push(frames);
+  if (transport_ == SHARED_MEMORY &&
+      io_thread_id_ == std::this_thread::get_id()) {
+    // Until the section is attached, or while the ring is full, messages
+    // wait in the queue so that they keep their order. A reply sent from the
+    // loop thread goes into the ring at once.
+    if (trim_.exchange(false)) {
+      Trim();
+    }
+    if (channel_) {
+      FlushSharedMemory();
+    }
+    return;
+  }
+  auto filled = batch_wait_ && queued >= batching_.bytes;
+  if (idle && batch_wait_ && !filled) {
+    // The send that opens a batch only arms its deadline, the loop is woken
+    // by the timer or by the send that fills the batch.
     state_ = SEND_PENDDING;
+    Hold();
+  } else if (idle) {
+    state_ = SEND_PENDDING;
+    Wake();
+  } else if (trim_ || (filled && queued - bytes < batching_.bytes)) {
+    Wake();
   }
-  SetEvent(post_event_.get());
 }
 
 std::string Connection::TransactMessage(std::string message) {
   assert(io_thread_id_ != std::this_thread::get_id() && message.size());
-  std::unique_lock<std::mutex> lock(transact_message_buffer_mutex_);
-  message.swap(transact_message_buffer_);
-  SetEvent(send_event_.get());
-  transact_message_buffer_cond.wait(lock, [this]() {
-    return transact_message_buffer_.empty();
-  });
+  auto reply = AsyncTransactMessage(message, std::chrono::seconds(2));
+  try {
+    return reply.get();
+  } catch (const ConnectionExcepton&) {
+    return std::string();
+  }
+}
 
-  transact_message_buffer_cond.wait_for(
-    lock,
-    std::chrono::seconds(2),
-    [this]() { return !transact_message_buffer_.empty(); });
-  std::string result;
-  result.swap(transact_message_buffer_);
-  return result;
+std::future<std::string> Connection::AsyncTransactMessage(
+  const std::string& message, std::chrono::milliseconds timeout) {
+  std::unique_ptr<Transaction> transaction(new Transaction);
+  auto correlation = ++next_correlation_;
+  auto reply = transaction->reply.get_future();
+  transaction->self = this;
+  transaction->correlation = correlation;
+  transaction->timer = NULL;
+  {
+    std::unique_lock<std::mutex> lock(transactions_mutex_);
+    if (transactions_closed_) {
+      transaction->reply.set_exception(std::make_exception_ptr(
+        DisconnectedException("connection closed")));
+      return reply;
+    }
+    // Armed under the lock, the timer cannot expire the transaction before
+    // it is registered.
+    raise_exception_if([&]() {
+      return !CreateTimerQueueTimer(
+        &transaction->timer,
+        NULL,                         // default timer queue
+        TransactionTimerCallback,
+        transaction.get(),
+        static_cast<DWORD>(timeout.count()),
+        0,                            // not periodic
+        WT_EXECUTEONLYONCE | WT_EXECUTEINTIMERTHREAD);
+    });
+    transactions_[correlation] = std::move(transaction);
+  }
+  if (!Send(Buffer(message, FRAME_REQUEST, correlation))) {
+    {
+      std::unique_lock<std::mutex> lock(transactions_mutex_);
+      auto it = transactions_.find(correlation);
+      if (it == std::end(transactions_)) {
+        // Abandoned meanwhile, the connection closed.
+        return reply;
+      }
+      transaction.swap(it->second);
+      transactions_.erase(it);
+    }
+    DeleteTimerQueueTimer(NULL, transaction->timer, INVALID_HANDLE_VALUE);
+    transaction->reply.set_exception(std::make_exception_ptr(
+      OverflowException("send queue full")));
+  }
+  return reply;
 }
 
-void Connection::Close() {
-  if (std::this_thread::get_id() != io_thread_id_) {
-    Shutdown();
-  } else {
-    disconnecting_ = true;
+void Connection::Reply(const Message& request, const std::string& reply) {
+  if (!(request.kind_ & FRAME_REQUEST)) {
+    Send(reply);
+    return;
+  }
+  if (io_thread_id_ == std::this_thread::get_id() &&
+      replying_to_ == request.correlation_) {
+    replying_to_ = 0;
   }
+  Send(Buffer(reply, FRAME_REPLY, request.correlation_));
+}
+
+void Connection::Subscribe(const std::string& pattern) {
+  Send(Buffer(std::string(1, CONTROL_SUBSCRIBE).append(pattern),
+              FRAME_CONTROL,
+              0));
+}
+
+void Connection::Unsubscribe(const std::string& pattern) {
+  Send(Buffer(std::string(1, CONTROL_UNSUBSCRIBE).append(pattern),
+              FRAME_CONTROL,
+              0));
+}
+
+void Connection::Flush() {
+  if (batch_wait_) {
+    Wake();
+  }
+}
+
+StreamPtr Connection::OpenStream(const StreamMessageCallback& cb) {
+  auto id = ++next_stream_;
+  assert(("too many streams", id < kPeerStream));
+  StreamPtr stream(new Stream(id, shared_from_this(), cb));
+  std::unique_lock<std::mutex> lock(streams_mutex_);
+  streams_[id] = stream;
+  return stream;
+}
+
+void Connection::Close() {
+  // The connection is shut down on the loop thread, once its sending queue
+  // is flushed.
+  disconnecting_ = true;
+  Wake();
 }
 
 void Connection::SetCloseCallback(const CloseCallback& cb) {
@@ -183,79 +412,805 @@ Connection::StateE Connection::State() const {
   return state_;
 }
 
+uint64_t Connection::Writes() const {
+  return writes_.load(std::memory_order_relaxed);
+}
+
+uint64_t Connection::MessagesWritten() const {
+  return messages_written_.load(std::memory_order_relaxed);
+}
+
+size_t Connection::QueuedBytes() const {
+  return queued_bytes_.load(std::memory_order_relaxed);
+}
+
+size_t Connection::QueuedMessages() const {
+  return queued_messages_.load(std::memory_order_relaxed);
+}
+
+ConnectionStats Connection::Stats() const {
+  ConnectionStats stats;
+  stats.id = id_;
+  stats.messages_in = messages_in_.load(std::memory_order_relaxed);
+  stats.bytes_in = bytes_in_.load(std::memory_order_relaxed);
+  stats.messages_out = messages_out_.load(std::memory_order_relaxed);
+  stats.bytes_out = bytes_out_.load(std::memory_order_relaxed);
+  stats.messages_dropped = messages_dropped_.load(std::memory_order_relaxed);
+  stats.messages_compressed =
+    messages_compressed_.load(std::memory_order_relaxed);
+  stats.writes = writes_.load(std::memory_order_relaxed);
+  stats.transact_timeouts = transact_timeouts_.load(std::memory_order_relaxed);
+  stats.queued_bytes = queued_bytes_.load(std::memory_order_relaxed);
+  stats.queued_messages = queued_messages_.load(std::memory_order_relaxed);
+  stats.queued_bytes_peak = queued_bytes_peak_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void Connection::Start() {
+  if (!AsyncRead()) {
+    Shutdown();
+    return;
+  }
+  if (compression_threshold_) {
+    Send(Buffer(std::string(1, CONTROL_COMPRESSION), FRAME_CONTROL, 0));
+  }
+  if (session_) {
+    // The server answers with its own hello, then the messages this side
+    // did not receive.
+    Send(Buffer(EncodeSessionHello(session_->Hello()), FRAME_CONTROL, 0));
+  }
+}
+
 void Connection::Shutdown() {
+  if (shutdown_) {
+    return;
+  }
+  shutdown_ = true;
+  AbandonTransactions();
+  if (session_) {
+    session_->Detach(this);
+  }
+  {
+    // Streams outlive the connection, their callbacks do not. Released
+    // after the lock, a callback may own a stream being closed.
+    std::unordered_map<StreamId, StreamPtr> streams;
+    std::unique_lock<std::mutex> lock(streams_mutex_);
+    streams.swap(streams_);
+  }
+  if (bounded_) {
+    // Blocked senders give up, nothing drains the queue any more.
+    std::unique_lock<std::mutex> lock(room_mutex_);
+    room_closed_ = true;
+    room_cond_.notify_all();
+  }
+  if (channel_wait_) {
+    UnregisterWaitEx(channel_wait_, INVALID_HANDLE_VALUE);
+    channel_wait_ = NULL;
+  }
+  if (batch_wait_) {
+    UnregisterWaitEx(batch_wait_, INVALID_HANDLE_VALUE);
+    batch_wait_ = NULL;
+  }
+  // Cancelled operations are still dequeued by the loop, they keep the
+  // connection alive until the last one is released.
+  if (pending_io_) {
+    closing_ = shared_from_this();
+    CancelIo(pipe_.get());
+  }
   close_callback_(shared_from_this());
 }
 
-void Connection::SetMessageCallback(const MessageCallback& cb) {
+void Connection::SetMessageCallback(const MessageViewCallback& cb) {
   message_callback_ = cb;
 }
 
+void Connection::SetBatchMessageCallback(const BatchMessageCallback& cb) {
+  batch_message_callback_ = cb;
+}
+
+void Connection::SetSession(const std::shared_ptr<Session>& session) {
+  session_ = session;
+  sequenced_.store(true, std::memory_order_release);
+}
+
+void Connection::Resume(
+  const std::shared_ptr<Session>& session, uint64_t received) {
+  SetSession(session);
+  Send(Buffer(EncodeSessionHello(session->Hello()), FRAME_CONTROL, 0));
+  session->Resume(this, received);
+}
+
+void Connection::SetControlCallback(const MessageViewCallback& cb) {
+  control_callback_ = cb;
+}
+
+void Connection::SetStreamMessageCallback(const StreamMessageCallback& cb) {
+  stream_message_callback_ = cb;
+}
+
+void Connection::SetSendLimits(const SendLimits& limits) {
+  limits_ = limits;
+  bounded_ = limits.max_bytes || limits.max_messages ||
+    limits.high_water_mark;
+}
+
+void Connection::SetCompressionThreshold(size_t bytes) {
+  compression_threshold_ = bytes;
+}
+
+void Connection::SetSendBatching(const SendBatching& batching) {
+  batching_ = batching;
+  if (!batching.delay.count() || batch_wait_) {
+    return;
+  }
+  batch_timer_.reset(CreateBatchTimer());
+  raise_exception_if([this]() { return !batch_timer_; });
+  weak_self_ = shared_from_this();
+  raise_exception_if([this]() {
+    return !RegisterWaitForSingleObject(
+      &batch_wait_,
+      batch_timer_.get(),         // set by the send opening a batch
+      BatchTimerCallback,
+      this,
+      INFINITE,                   // wait indefinitely
+      WT_EXECUTEINWAITTHREAD);    // the callback only posts to the loop
+  });
+}
+
+void Connection::SetHighWaterMarkCallback(const WaterMarkCallback& cb) {
+  high_water_mark_callback_ = cb;
+}
+
+void Connection::SetLowWaterMarkCallback(const WaterMarkCallback& cb) {
+  low_water_mark_callback_ = cb;
+}
+
 HANDLE Connection::Handle() const {
   return pipe_.get();
 }
 
-bool Connection::AsyncRead(LPOVERLAPPED_COMPLETION_ROUTINE cb) {
-  if (disconnecting_ && sending_queue_.empty()) {
+bool Connection::AsyncRead(DWORD* readed) {
+  if (disconnecting_ && Flushed()) {
     return false;
   }
-  ZeroMemory(read_buf_, sizeof read_buf_);
-  auto read = ReadFileEx(
+  ZeroMemory(&read_overlap_.overlap, sizeof read_overlap_.overlap);
+  auto read = ReadFile(
     pipe_.get(),
-    read_buf_,
-    kBufferSize * sizeof read_buf_[0],
-    (LPOVERLAPPED)&io_overlap_,
-    cb);
-  return !!read;
+    receiver_.Buffer(),
+    kPacketSize,
+    NULL,
+    &read_overlap_.overlap);
+  if (!read && GetLastError() != ERROR_IO_PENDING) {
+    return false;
+  }
+  if (!read || !inline_io_) {
+    ++pending_io_;
+    return true;
+  }
+
+  // Completed at once, no completion is queued for it. The caller either
+  // takes the packet in place or it goes through the loop like any other.
+  auto transferred = static_cast<DWORD>(read_overlap_.overlap.InternalHigh);
+  if (readed) {
+    *readed = transferred;
+    return transferred != 0;
+  }
+  ++pending_io_;
+  loop_->Post(&read_overlap_, transferred);
+  return true;
+}
+
+bool Connection::ReadPackets(DWORD readed) {
+  // Every packet the pipe has ready is unpacked in place, and the messages
+  // reach the application together, up to kMessageBatch of them.
+  auto& messages = read_batch_;
+  auto batch = static_cast<size_t>(kMessageBatch);
+  bool io = false;
+  messages.clear();
+  try {
+    do {
+      INTERPROCESS_TRACE("read", INSTANT, id_);
+      Count(&bytes_in_, readed);
+      receiver_.Unpack(readed, &messages);
+      readed = 0;
+      io = AsyncRead(messages.size() < batch ? &readed : nullptr);
+    } while (io && readed);
+  } catch (...) {
+    return false;
+  }
+
+  if (transport_ == SHARED_MEMORY && !channel_ && !messages.empty()) {
+    // The first message of a shared memory client is the section name.
+    try {
+      AttachSharedMemory(messages.front().ToString(), false);
+    } catch (...) {
+      return false;
+    }
+    messages.erase(std::begin(messages));
+  }
+  Dispatch(&messages);
+  messages.clear();
+  return io;
 }
 
 bool Connection::AsyncWrite() {
-  // must cancel read operation first
-  if (CancelIo(pipe_.get())) {
-    while (WAIT_OBJECT_0 != WaitForSingleObjectEx(
-      cancel_io_event_.get(), INFINITE, TRUE)) {
-      continue;
+  // A write in flight keeps draining the queue from its completion.
+  if (writing_) {
+    return true;
+  }
+  writing_ = true;
+  return !NextPacket() || WritePacket();
+}
+
+bool Connection::NextPacket() {
+  // With shared memory the pipe only carries the handshake, queued messages
+  // go to the ring.
+  if (transport_ == SHARED_MEMORY) {
+    writing_ = false;
+    state_ = CONNECTED;
+    return false;
+  }
+  while (sending_queue_.empty()) {
+    Collect();
+    if (sending_queue_.empty()) {
+      // Cleared before the queue goes idle, the send that schedules it
+      // again marks the connection pending after this.
+      state_ = CONNECTED;
+      if (outbox_.Idle()) {
+        writing_ = false;
+        return false;
+      }
     }
   }
-  std::string message;
-  {
-    std::unique_lock<std::mutex> lock(sending_queue_mutex_);
-    assert(("no more message to send", !sending_queue_.empty()));
-    message = sending_queue_.front();
+  state_ = SEND_PENDDING;
+  auto budget = static_cast<size_t>(kPacketSize);
+  auto& front = sending_queue_.front();
+  if (sending_queue_.size() == 1 ||
+      front.size + sending_queue_[1].size > budget) {
+    // Written straight from the buffer shared with other connections.
+    Sent(front.size, EndsMessage(front));
+    packet_ = std::move(front);
     sending_queue_.pop_front();
+    Count(&messages_written_);
+    return true;
+  }
+
+  // Everything queued while the last write was in flight goes out in the
+  // next one. The write in flight was the last user of coalesced_.
+  coalesced_->clear();
+  while (!sending_queue_.empty() &&
+         coalesced_->size() + sending_queue_.front().size <= budget) {
+    auto& packet = sending_queue_.front();
+    coalesced_->append(packet.Data(), packet.size);
+    Sent(packet.size, EndsMessage(packet));
+    sending_queue_.pop_front();
+    Count(&messages_written_);
+  }
+  packet_.storage = coalesced_;
+  packet_.offset = 0;
+  packet_.size = coalesced_->size();
+  return true;
+}
+
+bool Connection::WritePacket() {
+  // packet_ is owned by the write in flight until its completion.
+  do {
+    ZeroMemory(&write_overlap_.overlap, sizeof write_overlap_.overlap);
+    INTERPROCESS_TRACE("write", ASYNC_BEGIN, id_);
+    auto write = WriteFile(
+      pipe_.get(),
+      packet_.Data(),
+      static_cast<DWORD>(packet_.size),
+      NULL,
+      &write_overlap_.overlap);
+    if (!write && GetLastError() != ERROR_IO_PENDING) {
+      return false;
+    }
+    Count(&writes_);
+    if (!write || !inline_io_) {
+      ++pending_io_;
+      return true;
+    }
+    // Written at once, no completion is queued for it.
+    INTERPROCESS_TRACE("write", ASYNC_END, id_);
+  } while (NextPacket());
+
+  if (disconnecting_) {
+    // The queue is flushed, OnWake shuts the connection down.
+    Wake();
   }
-  return AsyncWrite(message, CompletedWriteRoutine);
+  return true;
 }
 
-bool Connection::AsyncWaitWrite() {
-  if (CancelIo(pipe_.get())) {
-    while (WAIT_OBJECT_0 != WaitForSingleObjectEx(
-      cancel_io_event_.get(), INFINITE, TRUE)) {
+void Connection::Wake() {
+  if (!wake_posted_.exchange(true)) {
+    wake_overlap_.pin = shared_from_this();
+    loop_->Post(&wake_overlap_);
+  }
+}
+
+void Connection::Hold() {
+  // Relative due time, in units of 100 nanoseconds.
+  LARGE_INTEGER due;
+  due.QuadPart = -10 * static_cast<LONGLONG>(batching_.delay.count());
+  if (!SetWaitableTimer(batch_timer_.get(), &due, 0, NULL, NULL, FALSE)) {
+    Wake();
+  }
+}
+
+void Connection::OnWake() {
+  if (shutdown_) {
+    return;
+  }
+  if (overflowed_) {
+    Shutdown();
+    return;
+  }
+  if (high_water_mark_crossed_.exchange(false) && above_high_water_mark_) {
+    high_water_mark_reported_ = true;
+    call_if_exist(
+      high_water_mark_callback_, shared_from_this(), queued_bytes_.load());
+  }
+  if (trim_.exchange(false)) {
+    Trim();
+  }
+  if (channel_) {
+    OnSharedMemoryWake();
+  } else if (transport_ == NAMED_PIPE && !AsyncWrite()) {
+    Shutdown();
+    return;
+  }
+  if (disconnecting_ && !writing_ && Flushed()) {
+    Shutdown();
+  }
+}
+
+bool Connection::Release(ConnectionPtr* closing) {
+  if (--pending_io_ == 0) {
+    closing->swap(closing_);
+  }
+  return !shutdown_;
+}
+
+void Connection::OfferSharedMemory(const std::string& section) {
+  AttachSharedMemory(section, true);
+  // The section name is the only message the pipe carries, the queue
+  // already drains into the ring.
+  Buffer buffer(section);
+  writing_ = true;
+  packet_.storage = buffer.frames_;
+  packet_.offset = 0;
+  packet_.size = buffer.frames_->size();
+  WritePacket();
+}
+
+void Connection::AttachSharedMemory(const std::string& section, bool create) {
+  std::unique_ptr<SharedMemoryChannel> channel(
+    new SharedMemoryChannel(section, create));
+  // Set already if a batch timer reads it.
+  if (weak_self_.expired()) {
+    weak_self_ = shared_from_this();
+  }
+  raise_exception_if([&, this]() {
+    return !RegisterWaitForSingleObject(
+      &channel_wait_,
+      channel->WakeEvent(),       // signaled by the peer
+      SharedMemoryWaitCallback,
+      this,
+      INFINITE,                   // wait indefinitely
+      WT_EXECUTEINWAITTHREAD);    // the callback only posts to the loop
+  });
+  channel_.swap(channel);
+  OnSharedMemoryWake();
+}
+
+void Connection::OnSharedMemoryWake() {
+  INTERPROCESS_TRACE("ring wake", INSTANT, id_);
+  FlushSharedMemory();
+  const char* frame = nullptr;
+  size_t size = 0;
+  auto& messages = ring_batch_;
+  auto batch = static_cast<size_t>(kMessageBatch);
+  messages.clear();
+  do {
+    channel_->Unpark();
+    while (channel_->Peek(&frame, &size)) {
+      Count(&bytes_in_, kFrameLengthSize + size);
+      try {
+        receiver_.Stage(frame, size, &messages);
+      } catch (...) {
+        Shutdown();
+        return;
+      }
+      channel_->Pop();
+      if (messages.size() == batch) {
+        Dispatch(&messages);
+        messages.clear();
+      }
+    }
+  } while (!channel_->Park());
+  Dispatch(&messages);
+  messages.clear();
+}
+
+void Connection::FlushSharedMemory() {
+  do {
+    Collect();
+    FlushRing();
+    // The ring is full. The queue stays scheduled, the peer signals the wake
+    // event once it has made room.
+    if (!sending_queue_.empty()) {
+      return;
+    }
+  } while (!stream_scheduler_.Empty() || !outbox_.Idle());
+}
+
+bool Connection::Admit(size_t bytes) {
+  if (!Fits(bytes)) {
+    switch (limits_.overflow) {
+    case OVERFLOW_BLOCK:
+      // The loop thread drains the queue, it must not wait for it.
+      if (io_thread_id_ != std::this_thread::get_id() &&
+          !WaitForRoom(bytes)) {
+        return false;
+      }
+      break;
+
+    case OVERFLOW_DROP_OLDEST:
+      trim_ = true;
+      break;
+
+    case OVERFLOW_DISCONNECT:
+      overflowed_ = true;
+      Wake();
+      return false;
+
+    case OVERFLOW_FAIL:
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t Connection::Enqueued(size_t bytes) {
+  auto queued = queued_bytes_ += bytes;
+  ++queued_messages_;
+  // Only a new peak pays for the exchange.
+  auto peak = queued_bytes_peak_.load(std::memory_order_relaxed);
+  while (queued > peak &&
+         !queued_bytes_peak_.compare_exchange_weak(
+           peak, queued, std::memory_order_relaxed)) {}
+  if (bounded_ && limits_.high_water_mark &&
+      queued >= limits_.high_water_mark &&
+      !above_high_water_mark_.exchange(true)) {
+    // Reported from the loop thread, where the sender may be holding locks
+    // the callback needs.
+    high_water_mark_crossed_ = true;
+    Wake();
+  }
+  return queued;
+}
+
+bool Connection::Fits(size_t bytes) const {
+  auto queued = queued_bytes_.load();
+  return !queued ||
+    ((!limits_.max_bytes || queued + bytes <= limits_.max_bytes) &&
+     (!limits_.max_messages || queued_messages_ < limits_.max_messages));
+}
+
+bool Connection::WaitForRoom(size_t bytes) {
+  std::unique_lock<std::mutex> lock(room_mutex_);
+  // Counted before the queue is looked at again, a drain after that look
+  // finds the waiter and notifies it.
+  ++blocked_;
+  room_cond_.wait(lock, [&, this]() { return room_closed_ || Fits(bytes); });
+  --blocked_;
+  return !room_closed_;
+}
+
+void Connection::Dequeued(size_t bytes, bool last) {
+  auto queued = queued_bytes_ -= bytes;
+  if (last) {
+    --queued_messages_;
+  }
+  if (!bounded_) {
+    return;
+  }
+  // Drained before its high water mark was reported, the crossing is not
+  // reported at all.
+  if (queued <= limits_.low_water_mark && above_high_water_mark_ &&
+      above_high_water_mark_.exchange(false) && high_water_mark_reported_) {
+    high_water_mark_reported_ = false;
+    call_if_exist(low_water_mark_callback_, shared_from_this(), queued);
+  }
+  if (blocked_) {
+    std::unique_lock<std::mutex> lock(room_mutex_);
+    room_cond_.notify_all();
+  }
+}
+
+void Connection::Trim() {
+  // Messages waiting for the turn of their stream are old too.
+  do {
+    Collect();
+  } while (!stream_scheduler_.Empty());
+  auto over = [this]() {
+    return (limits_.max_bytes && queued_bytes_ > limits_.max_bytes) ||
+      (limits_.max_messages && queued_messages_ > limits_.max_messages);
+  };
+  // A message partly on its way is kept, the peer would get the rest of it
+  // without its start. So are those that are not Droppable().
+  size_t kept = 0;
+  if (!sending_queue_.empty() && sending_queue_.front().offset != 0) {
+    while (!EndsMessage(sending_queue_[kept++])) {}
+  }
+  while (over() && queued_messages_ > 1 && kept < sending_queue_.size()) {
+    if (!Droppable(*sending_queue_[kept].storage)) {
+      while (!EndsMessage(sending_queue_[kept++])) {}
       continue;
     }
+    bool last = false;
+    do {
+      auto& packet = sending_queue_[kept];
+      last = EndsMessage(packet);
+      Dequeued(packet.size, last);
+      sending_queue_.erase(std::begin(sending_queue_) + kept);
+    } while (!last);
+    Count(&messages_dropped_);
   }
-  std::string message;
-  std::unique_lock<std::mutex> lock(transact_message_buffer_mutex_);
-  message.swap(transact_message_buffer_);
-  transact_message_buffer_cond.notify_all();
-  return AsyncWrite(message, CompletedWriteRoutineForWait);
 }
 
-bool Connection::AsyncWrite(
-  const std::string& message, LPOVERLAPPED_COMPLETION_ROUTINE cb) {
-  write_size_ = message.size();
-#pragma warning(disable:4996)
-  // already checked message length when push it into sendding queue
-  message.copy(std::begin(write_buf_), write_size_);
-#pragma warning(default:4996)
+void Connection::Sent(size_t bytes, bool last) {
+  Count(&bytes_out_, bytes);
+  if (last) {
+    Count(&messages_out_);
+  }
+  Dequeued(bytes, last);
+}
 
-  auto write = WriteFileEx(
-    pipe_.get(),
-    write_buf_,
-    write_size_,
-    (LPOVERLAPPED)&io_overlap_,
-    cb);
-  return !!write;
+void Connection::Collect() {
+  std::shared_ptr<const std::string> frames;
+  while (outbox_.Pop(&frames)) {
+    auto stream = StreamOf(*frames);
+    if (stream) {
+      stream_scheduler_.Push(stream, frames);
+    } else {
+      SlicePackets(frames, &sending_queue_);
+    }
+  }
+  // About a packet's worth of stream messages at a time, so that the turns
+  // of the streams sent later come soon.
+  size_t taken = 0;
+  while (taken < static_cast<size_t>(kPacketSize) &&
+         stream_scheduler_.Pop(&frames)) {
+    taken += frames->size();
+    SlicePackets(frames, &sending_queue_);
+  }
+}
+
+bool Connection::Flushed() const {
+  return sending_queue_.empty() && stream_scheduler_.Empty() &&
+    outbox_.Empty();
+}
+
+void Connection::FlushRing() {
+  while (!sending_queue_.empty() && WriteRing(&sending_queue_.front())) {
+    auto& packet = sending_queue_.front();
+    Sent(packet.size, EndsMessage(packet));
+    sending_queue_.pop_front();
+  }
+}
+
+bool Connection::WriteRing(Packet* packet) {
+  // Ring records are bare frames, the packet keeps whatever did not fit.
+  auto begin = packet->Data();
+  PacketReader reader(begin, packet->size);
+  const char* frame = nullptr;
+  size_t size = 0;
+  while (reader.Next(&frame, &size)) {
+    if (!channel_->Write(frame, size)) {
+      auto written = static_cast<size_t>(frame - kFrameLengthSize - begin);
+      packet->offset += written;
+      packet->size -= written;
+      Sent(written, false);
+      return false;
+    }
+  }
+  return true;
+}
+
+void Connection::Dispatch(const Message& message) {
+  if (Transact(message) || Control(message) || Demultiplex(message)) {
+    return;
+  }
+  replying_to_ = message.kind_ & FRAME_REQUEST ? message.correlation_ : 0;
+  INTERPROCESS_TRACE("message callback", BEGIN, id_);
+  message_callback_(shared_from_this(), message);
+  INTERPROCESS_TRACE("message callback", END, id_);
+  replying_to_ = 0;
+}
+
+void Connection::Dispatch(std::vector<Message>* messages) {
+  Count(&messages_in_, messages->size());
+  // Counted before the callbacks may take them, and acknowledged after the
+  // hello among them gave the connection its session.
+  auto sequenced = std::count_if(std::begin(*messages),
+                                 std::end(*messages),
+                                 [](const Message& message) {
+    return (message.kind_ & FRAME_SEQUENCED) != 0;
+  });
+  if (!batch_message_callback_) {
+    std::for_each(std::begin(*messages),
+                  std::end(*messages),
+                  [this](const Message& message) {
+      Dispatch(message);
+    });
+  } else {
+    size_t kept = 0;
+    std::for_each(std::begin(*messages),
+                  std::end(*messages),
+                  [&, this](Message& message) {
+      if (!Transact(message) && !Control(message) && !Demultiplex(message)) {
+        (*messages)[kept++].swap(message);
+      }
+    });
+    messages->resize(kept);
+    if (!messages->empty()) {
+      INTERPROCESS_TRACE("batch callback", BEGIN, id_);
+      batch_message_callback_(shared_from_this(), *messages);
+      INTERPROCESS_TRACE("batch callback", END, id_);
+    }
+  }
+  if (session_ && sequenced) {
+    auto ack = session_->Receive(static_cast<size_t>(sequenced));
+    if (ack) {
+      Send(Buffer(EncodeSessionAck(ack), FRAME_CONTROL, 0));
+    }
+  }
+}
+
+bool Connection::Transact(const Message& message) {
+  if (!(message.kind_ & FRAME_REPLY)) {
+    return false;
+  }
+  std::unique_ptr<Transaction> transaction;
+  {
+    std::unique_lock<std::mutex> lock(transactions_mutex_);
+    auto it = transactions_.find(message.correlation_);
+    if (it == std::end(transactions_)) {
+      // Its transaction has expired already, the reply is dropped.
+      return true;
+    }
+    transaction.swap(it->second);
+    transactions_.erase(it);
+  }
+  DeleteTimerQueueTimer(NULL, transaction->timer, INVALID_HANDLE_VALUE);
+  transaction->reply.set_value(message.ToString());
+  return true;
+}
+
+bool Connection::Control(const Message& message) {
+  if (!(message.kind_ & FRAME_CONTROL)) {
+    return false;
+  }
+  if (message.Size() == 1 && message.Data()[0] == CONTROL_COMPRESSION) {
+    peer_decompresses_ = true;
+    return true;
+  }
+  SessionHello hello;
+  if (session_ &&
+      DecodeSessionHello(message.Data(), message.Size(), &hello)) {
+    session_->Resume(this, hello.received);
+    return true;
+  }
+  uint64_t received = 0;
+  if (session_ && DecodeSessionAck(message.Data(), message.Size(), &received)) {
+    session_->Acknowledge(received);
+    return true;
+  }
+  if (message.Size() == 1 && message.Data()[0] == CONTROL_CLOSE_STREAM &&
+      (message.kind_ & FRAME_STREAM)) {
+    auto id = static_cast<StreamId>(message.correlation_) ^ kPeerStream;
+    StreamPtr closed;
+    std::unique_lock<std::mutex> lock(streams_mutex_);
+    auto it = streams_.find(id);
+    if (it != std::end(streams_)) {
+      // Released after the lock, see Shutdown().
+      closed.swap(it->second);
+      streams_.erase(it);
+    }
+    return true;
+  }
+  call_if_exist(control_callback_, shared_from_this(), message);
+  return true;
+}
+
+bool Connection::Demultiplex(const Message& message) {
+  if (!(message.kind_ & FRAME_STREAM)) {
+    return false;
+  }
+  auto id = static_cast<StreamId>(message.correlation_) ^ kPeerStream;
+  StreamPtr stream;
+  {
+    std::unique_lock<std::mutex> lock(streams_mutex_);
+    auto it = streams_.find(id);
+    if (it != std::end(streams_)) {
+      stream = it->second;
+    } else if ((id & kPeerStream) && stream_message_callback_) {
+      // Opened by the peer, the stream comes into being with its first
+      // message.
+      stream.reset(
+        new Stream(id, shared_from_this(), stream_message_callback_));
+      streams_[id] = stream;
+    }
+  }
+  if (!stream) {
+    // Closed on this side, its messages are dropped. Without a stream
+    // callback, those of the streams the peer opens go to the message
+    // callback.
+    return !(id & kPeerStream);
+  }
+  INTERPROCESS_TRACE("stream callback", BEGIN, id_);
+  call_if_exist(stream->message_callback_, stream, message);
+  INTERPROCESS_TRACE("stream callback", END, id_);
+  return true;
+}
+
+bool Connection::SendOnStream(StreamId id, const std::string& message) {
+  {
+    std::unique_lock<std::mutex> lock(streams_mutex_);
+    if (streams_.find(id) == std::end(streams_)) {
+      return false;
+    }
+  }
+  return Send(Buffer(message, FRAME_STREAM, id));
+}
+
+void Connection::CloseStream(StreamId id) {
+  {
+    std::unique_lock<std::mutex> lock(streams_mutex_);
+    if (!streams_.erase(id)) {
+      return;
+    }
+  }
+  Send(Buffer(std::string(1, CONTROL_CLOSE_STREAM),
+              FRAME_CONTROL | FRAME_STREAM,
+              id));
+}
+
+void Connection::Expire(uint64_t correlation) {
+  std::unique_ptr<Transaction> transaction;
+  {
+    std::unique_lock<std::mutex> lock(transactions_mutex_);
+    auto it = transactions_.find(correlation);
+    if (it == std::end(transactions_)) {
+      return;
+    }
+    transaction.swap(it->second);
+    transactions_.erase(it);
+  }
+  transact_timeouts_.fetch_add(1, std::memory_order_relaxed);
+  // Called from the timer callback itself, which must not wait for it.
+  DeleteTimerQueueTimer(NULL, transaction->timer, NULL);
+  transaction->reply.set_exception(std::make_exception_ptr(
+    TimeoutException("transaction timed out")));
+}
+
+void Connection::AbandonTransactions() {
+  std::map<uint64_t, std::unique_ptr<Transaction>> transactions;
+  {
+    std::unique_lock<std::mutex> lock(transactions_mutex_);
+    transactions_closed_ = true;
+    transactions.swap(transactions_);
+  }
+  std::for_each(std::begin(transactions),
+                std::end(transactions),
+                [](std::pair<const uint64_t, std::unique_ptr<Transaction>>& t) {
+    DeleteTimerQueueTimer(NULL, t.second->timer, INVALID_HANDLE_VALUE);
+    t.second->reply.set_exception(std::make_exception_ptr(
+      DisconnectedException("connection closed")));
+  });
 }
 
 }  // namespace interprocess
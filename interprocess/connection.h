@@ -8,12 +8,29 @@
 #define INTERPROCESS_CONNECTION_H_
 
 #include <windows.h>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
 #include <deque>
+#include <future>
+#include <map>
 #include <mutex>
 #include <memory>
 #include <string>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include "interprocess/buffer.h"
+#include "interprocess/event_loop.h"
+#include "interprocess/frame.h"
+#include "interprocess/message.h"
+#include "interprocess/send_queue.h"
+#include "interprocess/session.h"
+#include "interprocess/shared_memory.h"
+#include "interprocess/stream.h"
+#include "interprocess/typed.h"
 #include "interprocess/types.h"
 
 namespace interprocess {
@@ -25,59 +42,212 @@ class Connection : public std::enable_shared_from_this<Connection> {
     SEND_PENDDING,
     CONNECTED,
   };
+  // The name of the connection is |prefix| followed by its id.
   Connection(
-    const std::string& name, HANDLE pipe, HANDLE post_event, HANDLE send_event);
+    ConnectionId id,
+    const std::shared_ptr<const std::string>& prefix,
+    HANDLE pipe,
+    EventLoop* loop,
+    TransportE transport = NAMED_PIPE);
   Connection(const Connection&) = delete;
   Connection& operator=(const Connection&) = delete;
   ~Connection();
+  ConnectionId Id() const;
   std::string Name() const;
-  void Send(const std::string& message);
+  // Returns false if the send queue was full and the overflow policy
+  // refused the message.
+  bool Send(const std::string& message);
+  bool Send(const Buffer& buffer);
+  // Sends |value| as a typed message, see INTERPROCESS_TYPED_MESSAGE.
+  template <typename T>
+  typename std::enable_if<MessageTraits<T>::kTyped, bool>::type
+  Send(const T& value) {
+    return Send(TypedPayload(value));
+  }
+  // Sends |message| as a request and waits for its reply. Any number of
+  // threads may have a transaction in flight on the same connection, each
+  // reply goes to the caller of its own request. Returns an empty string if
+  // no reply arrived within two seconds.
   std::string TransactMessage(std::string message);
+  // Sends |message| as a request without waiting. The future throws
+  // TimeoutException if no reply arrived within |timeout|, or
+  // DisconnectedException if the connection closed first, or
+  // OverflowException if the request could not be queued.
+  std::future<std::string> AsyncTransactMessage(
+    const std::string& message, std::chrono::milliseconds timeout);
+  // Answers |request|. A message sent from the message callback of a request
+  // is its reply already, Reply() is for answering later or from a batch.
+  void Reply(const Message& request, const std::string& reply);
+  // Asks the server for the messages it publishes on topics matching
+  // |pattern|: a topic, or a topic prefix followed by '*'.
+  void Subscribe(const std::string& pattern);
+  void Unsubscribe(const std::string& pattern);
+  // Opens a logical stream over this connection, the peer's messages on it
+  // go to |cb| on the loop thread. A stream costs a map entry on each side,
+  // streams take turns writing, see StreamScheduler.
+  StreamPtr OpenStream(const StreamMessageCallback& cb);
+  // Writes what the send batching holds back without waiting for its delay.
+  void Flush();
   void Close();
   void SetCloseCallback(const CloseCallback& cb);
   Connection::StateE State() const;
+  // Pipe writes issued and the queued messages they carried, their ratio is
+  // the batching factor of the write path.
+  uint64_t Writes() const;
+  uint64_t MessagesWritten() const;
+  // What waits in the send queue.
+  size_t QueuedBytes() const;
+  size_t QueuedMessages() const;
+  // May be called from any thread while I/O goes on.
+  ConnectionStats Stats() const;
 
  private:
+  void Start();
   void Shutdown();
-  void SetMessageCallback(const MessageCallback& cb);
+  void SetMessageCallback(const MessageViewCallback& cb);
+  void SetBatchMessageCallback(const BatchMessageCallback& cb);
+  void SetControlCallback(const MessageViewCallback& cb);
+  void SetStreamMessageCallback(const StreamMessageCallback& cb);
+  void SetSendLimits(const SendLimits& limits);
+  void SetCompressionThreshold(size_t bytes);
+  void SetSendBatching(const SendBatching& batching);
+  void SetHighWaterMarkCallback(const WaterMarkCallback& cb);
+  void SetLowWaterMarkCallback(const WaterMarkCallback& cb);
+  void SetSession(const std::shared_ptr<Session>& session);
+  void Resume(const std::shared_ptr<Session>& session, uint64_t received);
   HANDLE Handle() const;
-  bool AsyncRead(LPOVERLAPPED_COMPLETION_ROUTINE cb);
+  bool AsyncRead(DWORD* readed = nullptr);
+  bool ReadPackets(DWORD readed);
   bool AsyncWrite();
-  bool AsyncWaitWrite();
-  bool AsyncWrite(
-    const std::string& message, LPOVERLAPPED_COMPLETION_ROUTINE cb);
-  typedef std::deque<std::string> SendingQueue;
-  struct IoCompletionRoutine {
-    OVERLAPPED overlap;
+  bool NextPacket();
+  bool WritePacket();
+  void Wake();
+  void Hold();
+  void OnWake();
+  bool Release(ConnectionPtr* closing);
+  void OfferSharedMemory(const std::string& section);
+  void AttachSharedMemory(const std::string& section, bool create);
+  void OnSharedMemoryWake();
+  void FlushSharedMemory();
+  bool Admit(size_t bytes);
+  bool Fits(size_t bytes) const;
+  bool WaitForRoom(size_t bytes);
+  // Returns how many bytes are queued, these included.
+  size_t Enqueued(size_t bytes);
+  void Enqueue(const std::shared_ptr<const std::string>& frames);
+  void Dequeued(size_t bytes, bool last);
+  void Sent(size_t bytes, bool last);
+  void Trim();
+  void Collect();
+  bool Flushed() const;
+  void FlushRing();
+  bool WriteRing(Packet* packet);
+  void Dispatch(const Message& message);
+  void Dispatch(std::vector<Message>* messages);
+  bool Transact(const Message& message);
+  bool Control(const Message& message);
+  bool Demultiplex(const Message& message);
+  bool SendOnStream(StreamId id, const std::string& message);
+  void CloseStream(StreamId id);
+  void Expire(uint64_t correlation);
+  void AbandonTransactions();
+  typedef std::deque<Packet> SendingQueue;
+  struct Transaction {
+    Connection* self;
+    uint64_t correlation;
+    HANDLE timer;
+    std::promise<std::string> reply;
+  };
+  struct IoCompletionRoutine : IoCompletion {
     Connection* self;
+    ConnectionPtr pin;
   };
 
   CloseCallback close_callback_;
-  MessageCallback message_callback_;
-  std::string name_;
-  StateE state_;
+  MessageViewCallback message_callback_;
+  BatchMessageCallback batch_message_callback_;
+  MessageViewCallback control_callback_;
+  StreamMessageCallback stream_message_callback_;
+  WaterMarkCallback high_water_mark_callback_;
+  WaterMarkCallback low_water_mark_callback_;
+  const ConnectionId id_;
+  std::shared_ptr<const std::string> prefix_;
+  std::atomic<StateE> state_;
   handle pipe_;
-  handle post_event_;
-  handle send_event_;
-  handle cancel_io_event_;
-  DWORD write_size_;
-  char read_buf_[kBufferSize];
-  char write_buf_[kBufferSize];
-  std::mutex sending_queue_mutex_;
+  EventLoop* loop_;
+  const bool inline_io_;
+  Receiver receiver_;
+  std::vector<Message> read_batch_;
+  std::vector<Message> ring_batch_;
+  Packet packet_;
+  std::shared_ptr<std::string> coalesced_;
+  std::atomic<uint64_t> writes_;
+  std::atomic<uint64_t> messages_written_;
+  SendQueue outbox_;
   SendingQueue sending_queue_;
-  std::condition_variable transact_message_buffer_cond;
-  std::string transact_message_buffer_;
-  std::mutex transact_message_buffer_mutex_;
-  IoCompletionRoutine io_overlap_;
+  StreamScheduler stream_scheduler_;
+  SendLimits limits_;
+  bool bounded_;
+  size_t compression_threshold_;
+  SendBatching batching_;
+  handle batch_timer_;
+  HANDLE batch_wait_;
+  std::atomic<bool> peer_decompresses_;
+  std::atomic<size_t> queued_bytes_;
+  std::atomic<size_t> queued_messages_;
+  std::atomic<size_t> queued_bytes_peak_;
+  std::atomic<uint64_t> messages_in_;
+  std::atomic<uint64_t> bytes_in_;
+  std::atomic<uint64_t> messages_out_;
+  std::atomic<uint64_t> bytes_out_;
+  std::atomic<uint64_t> messages_dropped_;
+  std::atomic<uint64_t> messages_compressed_;
+  std::atomic<uint64_t> transact_timeouts_;
+  std::atomic<bool> above_high_water_mark_;
+  std::atomic<bool> high_water_mark_crossed_;
+  bool high_water_mark_reported_;
+  std::atomic<bool> trim_;
+  std::atomic<bool> overflowed_;
+  std::mutex room_mutex_;
+  std::condition_variable room_cond_;
+  std::atomic<int> blocked_;
+  bool room_closed_;
+  bool writing_;
+  std::mutex transactions_mutex_;
+  std::map<uint64_t, std::unique_ptr<Transaction>> transactions_;
+  bool transactions_closed_;
+  std::atomic<uint64_t> next_correlation_;
+  uint64_t replying_to_;
+  std::mutex streams_mutex_;
+  std::unordered_map<StreamId, StreamPtr> streams_;
+  std::atomic<StreamId> next_stream_;
+  std::shared_ptr<Session> session_;
+  // Set once session_ is, plain messages go through the session.
+  std::atomic<bool> sequenced_;
+  IoCompletionRoutine read_overlap_;
+  IoCompletionRoutine write_overlap_;
+  IoCompletionRoutine wake_overlap_;
+  std::atomic<bool> wake_posted_;
+  int pending_io_;
+  ConnectionPtr closing_;
   std::thread::id io_thread_id_;
-  bool disconnecting_;
+  std::atomic<bool> disconnecting_;
+  bool shutdown_;
+  const TransportE transport_;
+  std::unique_ptr<SharedMemoryChannel> channel_;
+  std::weak_ptr<Connection> weak_self_;
+  HANDLE channel_wait_;
 
   friend class ConnectionAttorney;
+  friend class Session;
+  friend class Stream;
 
   friend VOID WINAPI CompletedReadRoutine(DWORD, DWORD, LPOVERLAPPED);
   friend VOID WINAPI CompletedWriteRoutine(DWORD, DWORD, LPOVERLAPPED);
-  friend VOID WINAPI CompletedReadRoutineForWait(DWORD, DWORD, LPOVERLAPPED);
-  friend VOID WINAPI CompletedWriteRoutineForWait(DWORD, DWORD, LPOVERLAPPED);
+  friend VOID WINAPI CompletedWakeRoutine(DWORD, DWORD, LPOVERLAPPED);
+  friend VOID CALLBACK SharedMemoryWaitCallback(PVOID, BOOLEAN);
+  friend VOID CALLBACK BatchTimerCallback(PVOID, BOOLEAN);
+  friend VOID CALLBACK TransactionTimerCallback(PVOID, BOOLEAN);
 };
 
 class ConnectionAttorney {
@@ -85,21 +255,73 @@ class ConnectionAttorney {
   friend class Client;
 
  private:
+  static void Start(const ConnectionPtr& c) {
+    c->Start();
+  }
+
   static void SetMessageCallback(
-    const ConnectionPtr& c, const MessageCallback& cb) {
+    const ConnectionPtr& c, const MessageViewCallback& cb) {
     c->SetMessageCallback(cb);
   }
 
-  static HANDLE Handle(const ConnectionPtr& c) {
-    return c->Handle();
+  static void SetBatchMessageCallback(
+    const ConnectionPtr& c, const BatchMessageCallback& cb) {
+    c->SetBatchMessageCallback(cb);
   }
 
-  static void AsyncWrite(const ConnectionPtr& c) {
-    c->AsyncWrite();
+  static void SetControlCallback(
+    const ConnectionPtr& c, const MessageViewCallback& cb) {
+    c->SetControlCallback(cb);
+  }
+
+  static void SetStreamMessageCallback(
+    const ConnectionPtr& c, const StreamMessageCallback& cb) {
+    c->SetStreamMessageCallback(cb);
+  }
+
+  static void SetSendLimits(
+    const ConnectionPtr& c, const SendLimits& limits) {
+    c->SetSendLimits(limits);
+  }
+
+  static void SetCompressionThreshold(const ConnectionPtr& c, size_t bytes) {
+    c->SetCompressionThreshold(bytes);
+  }
+
+  static void SetSendBatching(
+    const ConnectionPtr& c, const SendBatching& batching) {
+    c->SetSendBatching(batching);
+  }
+
+  static void SetHighWaterMarkCallback(
+    const ConnectionPtr& c, const WaterMarkCallback& cb) {
+    c->SetHighWaterMarkCallback(cb);
+  }
+
+  static void SetLowWaterMarkCallback(
+    const ConnectionPtr& c, const WaterMarkCallback& cb) {
+    c->SetLowWaterMarkCallback(cb);
+  }
+
+  static void SetSession(
+    const ConnectionPtr& c, const std::shared_ptr<Session>& session) {
+    c->SetSession(session);
+  }
+
+  static void ResumeSession(
+    const ConnectionPtr& c,
+    const std::shared_ptr<Session>& session,
+    uint64_t received) {
+    c->Resume(session, received);
+  }
+
+  static HANDLE Handle(const ConnectionPtr& c) {
+    return c->Handle();
   }
 
-  static void AsyncWaitWrite(const ConnectionPtr& c) {
-    c->AsyncWaitWrite();
+  static void OfferSharedMemory(
+    const ConnectionPtr& c, const std::string& section) {
+    c->OfferSharedMemory(section);
   }
 };
 
@@ -6,15 +6,33 @@
 
 #include "interprocess/connector.h"
 #include <windows.h>
-#include <cassert>
+#include <algorithm>
+#include <random>
 #include <string>
 
 namespace interprocess {
 
+VOID CALLBACK ReconnectTimerCallback(PVOID context, BOOLEAN) {
+  // Runs on the timer thread, the attempt is made on the loop thread.
+  auto self = static_cast<Connector*>(context);
+  self->loop_.Post(&self->reconnect_completion_);
+}
+
+VOID WINAPI CompletedReconnectRoutine(DWORD, DWORD, LPOVERLAPPED overlap) {
+  auto context = (Connector::ReconnectCompletion*)overlap;
+  context->self->OnReconnect();
+}
+
 Connector::Connector(const std::string& endpoint)
   : pipe_name_(std::string("\\\\.\\pipe\\").append(endpoint)),
-    close_event_(CreateEvent(NULL, FALSE, FALSE, NULL)) {
-  assert(("CreateEvent (close event) failed", close_event_ != NULL));
+    backoff_(0),
+    random_(std::random_device()()),
+    reconnect_timer_(NULL),
+    stopped_(false) {
+  ZeroMemory(&reconnect_completion_.overlap,
+             sizeof reconnect_completion_.overlap);
+  reconnect_completion_.routine = CompletedReconnectRoutine;
+  reconnect_completion_.self = this;
 }
 
 Connector::~Connector() {
@@ -22,16 +40,22 @@ Connector::~Connector() {
 }
 
 void Connector::Connect() {
-}
-
-void Connector::Establish() {
-  // TODO(bitdewy): connect first, then into async read mode
   connect_thread_.swap(
     std::thread(std::bind(&Connector::ConnectInThread, this)));
 }
 
 void Connector::Stop() {
-  SetEvent(close_event_.get());
+  HANDLE timer = NULL;
+  {
+    std::unique_lock<std::mutex> lock(reconnect_mutex_);
+    stopped_ = true;
+    std::swap(timer, reconnect_timer_);
+  }
+  if (timer) {
+    // Waits for a callback under way, the loop is still there to post to.
+    DeleteTimerQueueTimer(NULL, timer, INVALID_HANDLE_VALUE);
+  }
+  loop_.Post(EventLoop::CLOSE);
   if (connect_thread_.joinable()) {
     connect_thread_.join();
   }
@@ -45,27 +69,21 @@ void Connector::SetExceptionCallback(const ExceptionCallback& cb) {
   exception_callback_ = cb;
 }
 
-void Connector::MoveAsyncIOFunctionToAlertableThread(
-  const std::function<void()>& cb) {
-  async_io_callback_ = cb;
-}
-
-void Connector::MoveWaitResponseIOFunctionToAlertableThread(
-  const std::function<void()>& cb) {
-  async_wait_io_callback_ = cb;
+void Connector::Reconnect(const ReconnectPolicy& policy) {
+  policy_ = policy;
+  // A connection that broke soon after it was made counts as a failed
+  // attempt, against a server that keeps dropping clients.
+  if (backoff_ < policy.initial ||
+      std::chrono::steady_clock::now() - connected_ >= policy.maximum) {
+    backoff_ = policy.initial;
+  }
+  ScheduleReconnect();
 }
 
 HANDLE Connector::CreateConnectionInstance() {
   HANDLE pipe = INVALID_HANDLE_VALUE;
   while (true) {
-    pipe = CreateFile(
-      pipe_name_.c_str(),            // pipe name
-      GENERIC_READ | GENERIC_WRITE,  // read and write access
-      0,                             // no sharing
-      NULL,                          // default security attributes
-      OPEN_EXISTING,                 // opens existing pipe
-      FILE_FLAG_OVERLAPPED,          // default attributes
-      NULL);                         // no template file
+    pipe = OpenPipe();
 
     // Break if the pipe handle is valid.
     if (pipe != INVALID_HANDLE_VALUE) {
@@ -83,55 +101,49 @@ HANDLE Connector::CreateConnectionInstance() {
   return pipe;
 }
 
+HANDLE Connector::OpenPipe() {
+  return CreateFile(
+    pipe_name_.c_str(),            // pipe name
+    GENERIC_READ | GENERIC_WRITE,  // read and write access
+    0,                             // no sharing
+    NULL,                          // default security attributes
+    OPEN_EXISTING,                 // opens existing pipe
+    FILE_FLAG_OVERLAPPED,          // default attributes
+    NULL);                         // no template file
+}
+
+void Connector::Attach(HANDLE pipe) {
+  // Closed on failure until the new connection callback takes it over.
+  ScopeGuard guard([pipe]() { CloseHandle(pipe); });
+  // The pipe connected; change to message-read mode.
+  DWORD mode = PIPE_READMODE_MESSAGE;
+  auto success = SetNamedPipeHandleState(
+    pipe,     // pipe handle
+    &mode,    // new pipe mode
+    NULL,     // don't set maximum bytes
+    NULL);    // don't set maximum time
+  raise_exception_if([&]() { return !success; });
+
+  loop_.Associate(pipe);
+  guard.Dismiss();
+  call_if_exist(new_connection_callback_, pipe, &loop_);
+  connected_ = std::chrono::steady_clock::now();
+}
+
 void Connector::ConnectInThread() {
   std::exception_ptr eptr;
   try {
-    auto pipe = CreateConnectionInstance();
-
-    // The pipe connected; change to message-read mode.
-    DWORD mode = PIPE_READMODE_MESSAGE;
-    auto success = SetNamedPipeHandleState(
-      pipe,     // pipe handle
-      &mode,    // new pipe mode
-      NULL,     // don't set maximum bytes
-      NULL);    // don't set maximum time
-    raise_exception_if([&]() { return !success; });
-
-    SECURITY_CREATE_EVENT(post_event, FALSE, FALSE);
-    SECURITY_CREATE_EVENT(send_event, FALSE, FALSE);
-
-    call_if_exist(new_connection_callback_, pipe, post_event, send_event);
-
-    HANDLE events[3] = { post_event, send_event, close_event_.get() };
+    Attach(CreateConnectionInstance());
 
     while (true) {
-      auto wait = WaitForMultipleObjectsEx(
-        2,
-        events,         // events object to wait for
-        FALSE,          // wait any one
-        INFINITE,       // wait indefinitely
-        TRUE);          // alertable wait enabled
-
-      switch (wait) {
-      case WAIT_OBJECT_0:
-        call_if_exist(async_io_callback_);
-        break;
-
-      case WAIT_OBJECT_0 + 1:
-        call_if_exist(async_wait_io_callback_);
-        break;
-
-      case WAIT_OBJECT_0 + 2:
+      switch (loop_.Wait()) {
+      case EventLoop::CLOSE:
         return;
 
-      // The wait is satisfied by a completed read or write
-      // operation. This allows the system to execute the
-      // completion routine.
-      case WAIT_IO_COMPLETION:
-        break;
-
+      // A read or write operation finished and its completion routine
+      // already ran.
       default:
-        raise_exception();
+        break;
       }
     }
   } catch (...) {
@@ -140,4 +152,59 @@ void Connector::ConnectInThread() {
   call_if_exist(exception_callback_, eptr);
 }
 
+void Connector::ScheduleReconnect() {
+  // Uniform in [backoff / 2, backoff], so that clients of a restarted
+  // server do not all come back at once.
+  auto backoff = static_cast<DWORD>(backoff_.count());
+  std::uniform_int_distribution<DWORD> jitter(backoff / 2, backoff);
+  auto delay = jitter(random_);
+  backoff_ = std::min(backoff_ * 2, policy_.maximum);
+
+  std::unique_lock<std::mutex> lock(reconnect_mutex_);
+  if (stopped_) {
+    return;
+  }
+  auto success = CreateTimerQueueTimer(
+    &reconnect_timer_,
+    NULL,                         // default timer queue
+    ReconnectTimerCallback,
+    this,
+    delay,
+    0,                            // not periodic
+    WT_EXECUTEONLYONCE | WT_EXECUTEINTIMERTHREAD);
+  if (!success) {
+    reconnect_timer_ = NULL;
+    lock.unlock();
+    call_if_exist(exception_callback_, last_error());
+  }
+}
+
+void Connector::OnReconnect() {
+  {
+    std::unique_lock<std::mutex> lock(reconnect_mutex_);
+    if (stopped_ || !reconnect_timer_) {
+      return;
+    }
+    // Fired, its callback only posts and is not waited for.
+    DeleteTimerQueueTimer(NULL, reconnect_timer_, NULL);
+    reconnect_timer_ = NULL;
+  }
+  auto pipe = OpenPipe();
+  if (pipe == INVALID_HANDLE_VALUE) {
+    // A busy server is retried as a missing one is, no thread waits here.
+    auto error = GetLastError();
+    if (error != ERROR_FILE_NOT_FOUND && error != ERROR_PIPE_BUSY) {
+      call_if_exist(exception_callback_, last_error());
+    }
+    ScheduleReconnect();
+    return;
+  }
+  try {
+    Attach(pipe);
+  } catch (...) {
+    call_if_exist(exception_callback_, std::current_exception());
+    ScheduleReconnect();
+  }
+}
+
 }  // namespace interprocess
@@ -8,8 +8,12 @@
 #define INTERPROCESS_CONNECTOR_H_
 
 #include <ppltasks.h>
+#include <chrono>
+#include <mutex>
+#include <random>
 #include <string>
 #include <thread>
+#include "interprocess/event_loop.h"
 #include "interprocess/types.h"
 
 namespace interprocess {
@@ -21,25 +25,45 @@ class Connector {
   Connector& operator=(const Connector&) = delete;
   ~Connector();
   void Connect();
-  void Establish();
   void Stop();
   void SetNewConnectionCallback(const NewConnectionCallback& cb);
   void SetExceptionCallback(const ExceptionCallback& cb);
-  void MoveAsyncIOFunctionToAlertableThread(const std::function<void()>& cb);
-  void MoveWaitResponseIOFunctionToAlertableThread(
-    const std::function<void()>& cb);
+  // Connects again once the connection broke, on the loop thread. Attempts
+  // are spaced out as |policy| says until one succeeds or the connector
+  // stops; those that fail for another reason than a missing or busy server
+  // are reported to the exception callback too.
+  void Reconnect(const ReconnectPolicy& policy);
 
  private:
+  struct ReconnectCompletion : IoCompletion {
+    Connector* self;
+  };
   HANDLE CreateConnectionInstance();
+  // A single attempt, returns INVALID_HANDLE_VALUE if it failed.
+  HANDLE OpenPipe();
+  // Hands |pipe| to the new connection callback, closes it if it throws
+  // before.
+  void Attach(HANDLE pipe);
   void ConnectInThread();
+  void ScheduleReconnect();
+  void OnReconnect();
 
   std::string pipe_name_;
   std::thread connect_thread_;
-  handle close_event_;
+  EventLoop loop_;
   NewConnectionCallback new_connection_callback_;
   ExceptionCallback exception_callback_;
-  std::function<void()> async_io_callback_;
-  std::function<void()> async_wait_io_callback_;
+  ReconnectPolicy policy_;
+  std::chrono::milliseconds backoff_;
+  std::chrono::steady_clock::time_point connected_;
+  std::mt19937 random_;
+  std::mutex reconnect_mutex_;
+  HANDLE reconnect_timer_;
+  bool stopped_;
+  ReconnectCompletion reconnect_completion_;
+
+  friend VOID CALLBACK ReconnectTimerCallback(PVOID, BOOLEAN);
+  friend VOID WINAPI CompletedReconnectRoutine(DWORD, DWORD, LPOVERLAPPED);
 };
 
 }  // namespace interprocess
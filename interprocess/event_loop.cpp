@@ -0,0 +1,140 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#include "interprocess/event_loop.h"
+#include <windows.h>
+#include <atomic>
+
+namespace interprocess {
+
+namespace {
+
+typedef BOOL (WINAPI *GetQueuedCompletionStatusExFunction)(
+  HANDLE, LPOVERLAPPED_ENTRY, ULONG, ULONG*, DWORD, BOOL);
+
+typedef ULONG (WINAPI *RtlNtStatusToDosErrorFunction)(LONG);
+
+typedef BOOL (WINAPI *SetFileCompletionNotificationModesFunction)(
+  HANDLE, UCHAR);
+
+template <typename Function>
+Function Resolve(const char* module, const char* name) {
+  return reinterpret_cast<Function>(
+    GetProcAddress(GetModuleHandle(module), name));
+}
+
+// Resolved at runtime so that the library still loads on systems without
+// batched dequeue, Wait() falls back to one completion per call there.
+const auto kGetQueuedCompletionStatusEx =
+  Resolve<GetQueuedCompletionStatusExFunction>(
+    "kernel32.dll", "GetQueuedCompletionStatusEx");
+
+const auto kRtlNtStatusToDosError =
+  Resolve<RtlNtStatusToDosErrorFunction>("ntdll.dll", "RtlNtStatusToDosError");
+
+const auto kSetFileCompletionNotificationModes =
+  Resolve<SetFileCompletionNotificationModesFunction>(
+    "kernel32.dll", "SetFileCompletionNotificationModes");
+
+std::atomic<bool> batching(kGetQueuedCompletionStatusEx != nullptr);
+
+}  // namespace
+
+EventLoop::EventLoop()
+  : port_(CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1)),
+    count_(0),
+    next_(0) {
+  raise_exception_if([this]() { return !port_; });
+}
+
+void EventLoop::Associate(HANDLE file) {
+  raise_exception_if([&, this]() {
+    return CreateIoCompletionPort(file, port_.get(), COMPLETION, 0) == NULL;
+  });
+}
+
+void EventLoop::Post(KeyE key) {
+  PostQueuedCompletionStatus(port_.get(), 0, key, NULL);
+}
+
+void EventLoop::Post(IoCompletion* completion, DWORD transferred) {
+  PostQueuedCompletionStatus(
+    port_.get(), transferred, COMPLETION, &completion->overlap);
+}
+
+bool EventLoop::SkipCompletionOnSuccess(HANDLE file) {
+  return kSetFileCompletionNotificationModes &&
+    kSetFileCompletionNotificationModes(
+      file,
+      FILE_SKIP_COMPLETION_PORT_ON_SUCCESS | FILE_SKIP_SET_EVENT_ON_HANDLE);
+}
+
+EventLoop::KeyE EventLoop::Wait() {
+  if (next_ == count_) {
+    if (!batching) {
+      return WaitOne();
+    }
+    next_ = count_ = 0;
+    raise_exception_if([this]() {
+      return !kGetQueuedCompletionStatusEx(
+        port_.get(),
+        entries_,           // completions dequeued by this call
+        kCompletionBatch,   // at most this many
+        &count_,            // number of entries filled
+        INFINITE,           // wait indefinitely
+        FALSE);             // not alertable
+    });
+  }
+
+  auto& entry = entries_[next_++];
+  auto overlap = entry.lpOverlapped;
+  if (overlap) {
+    // The status of each operation is left in its OVERLAPPED structure.
+    auto status = static_cast<LONG>(overlap->Internal);
+    DWORD err = 0;
+    if (status != 0) {
+      err = kRtlNtStatusToDosError ? kRtlNtStatusToDosError(status) : status;
+    }
+    reinterpret_cast<IoCompletion*>(overlap)->routine(
+      err, entry.dwNumberOfBytesTransferred, overlap);
+    return COMPLETION;
+  }
+  return static_cast<KeyE>(entry.lpCompletionKey);
+}
+
+bool EventLoop::Batching() {
+  return batching;
+}
+
+void EventLoop::EnableBatching(bool enable) {
+  batching = enable && kGetQueuedCompletionStatusEx != nullptr;
+}
+
+EventLoop::KeyE EventLoop::WaitOne() {
+  DWORD transferred = 0;
+  ULONG_PTR key = 0;
+  LPOVERLAPPED overlap = NULL;
+  auto success = GetQueuedCompletionStatus(
+    port_.get(),
+    &transferred,   // bytes transferred
+    &key,           // completion key
+    &overlap,       // OVERLAPPED structure of the operation
+    INFINITE);      // wait indefinitely
+
+  // A failed operation still dequeues its OVERLAPPED structure, let the
+  // completion routine see the error.
+  if (overlap) {
+    DWORD err = success ? 0 : GetLastError();
+    reinterpret_cast<IoCompletion*>(overlap)->routine(
+      err, transferred, overlap);
+    return COMPLETION;
+  }
+
+  raise_exception_if([&]() { return !success; });
+  return static_cast<KeyE>(key);
+}
+
+}  // namespace interprocess
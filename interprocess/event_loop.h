@@ -0,0 +1,60 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef INTERPROCESS_EVENT_LOOP_H_
+#define INTERPROCESS_EVENT_LOOP_H_
+
+#include <windows.h>
+#include "interprocess/types.h"
+
+namespace interprocess {
+
+struct IoCompletion {
+  OVERLAPPED overlap;
+  LPOVERLAPPED_COMPLETION_ROUTINE routine;
+};
+
+// I/O completion port driving every pipe of an acceptor or a connector.
+// Overlapped operations started on associated handles complete through
+// IoCompletion::routine on the thread calling Wait(), and only finished
+// operations are dequeued, however many pipes are associated. Post() takes
+// the place of the send/close events: a connection with output to write
+// posts its own completion, so the port doubles as the ready queue of the
+// loop and a send never walks the other connections.
+// When GetQueuedCompletionStatusEx is available (Vista and later) up to
+// kCompletionBatch completions are dequeued per call, Wait() hands them out
+// one by one before entering the kernel again.
+class EventLoop {
+ public:
+  enum KeyE {
+    COMPLETION,
+    CLOSE,
+  };
+  EventLoop();
+  EventLoop(const EventLoop&) = delete;
+  EventLoop& operator=(const EventLoop&) = delete;
+  void Associate(HANDLE file);
+  void Post(KeyE key);
+  void Post(IoCompletion* completion, DWORD transferred = 0);
+  // Operations on |file| that succeed at once queue no completion, the caller
+  // finishes them in place. Returns false where this is not supported.
+  static bool SkipCompletionOnSuccess(HANDLE file);
+  KeyE Wait();
+  static bool Batching();
+  static void EnableBatching(bool enable);
+
+ private:
+  KeyE WaitOne();
+
+  handle port_;
+  OVERLAPPED_ENTRY entries_[kCompletionBatch];
+  ULONG count_;
+  ULONG next_;
+};
+
+}  // namespace interprocess
+
+#endif  // INTERPROCESS_EVENT_LOOP_H_
@@ -0,0 +1,237 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#include "interprocess/frame.h"
+#include <algorithm>
+#include <cassert>
+#include <deque>
+#include <string>
+
+namespace interprocess {
+
+namespace {
+
+// Bytes from the start of a frame to its payload, a first fragment carries
+// the total length and a transaction or stream message its |id|.
+size_t HeaderSize(bool total, size_t id) {
+  return FrameAlign(kFrameLengthSize + kFrameHeaderSize +
+                    (total ? sizeof(uint32_t) : 0) + id);
+}
+
+}  // namespace
+
+void EncodeFrames(
+  const std::string& message,
+  std::string* frames,
+  uint8_t kind,
+  uint64_t correlation) {
+  assert(("message too long",
+    message.size() <= static_cast<size_t>(kMaxMessageSize)));
+  auto id = static_cast<size_t>(
+    kind & (FRAME_REQUEST | FRAME_REPLY | FRAME_STREAM) ?
+    kCorrelationSize : 0);
+  auto buffer = static_cast<size_t>(kBufferSize);
+  auto header = HeaderSize(false, id);
+  // Fast path, the whole message fits into one frame.
+  if (header + message.size() <= buffer) {
+    auto start = frames->size();
+    auto length = static_cast<uint32_t>(
+      header - kFrameLengthSize + message.size());
+    frames->reserve(start + FrameAlign(header + message.size()));
+    frames->append(reinterpret_cast<const char*>(&length), sizeof length);
+    frames->push_back(static_cast<char>(kind));
+    frames->append(reinterpret_cast<const char*>(&correlation), id);
+    frames->resize(start + header);
+    frames->append(message);
+    frames->resize(start + FrameAlign(header + message.size()));
+    return;
+  }
+
+  auto total = static_cast<uint32_t>(message.size());
+  header = HeaderSize(true, id);
+  auto rest = HeaderSize(false, 0);
+  auto count = 1 + (message.size() - (buffer - header) + buffer - rest - 1) /
+                   (buffer - rest);
+  frames->reserve(frames->size() + message.size() + header +
+                  (count - 1) * rest + kFrameAlignment);
+  size_t offset = 0;
+  while (offset < message.size()) {
+    auto start = frames->size();
+    auto size = std::min(buffer - header, message.size() - offset);
+    bool more = offset + size < message.size();
+    auto length = static_cast<uint32_t>(header - kFrameLengthSize + size);
+    frames->append(reinterpret_cast<const char*>(&length), sizeof length);
+    frames->push_back(static_cast<char>((more ? FRAME_MORE : 0) |
+                                        (offset ? 0 : kind)));
+    if (offset == 0) {
+      frames->append(reinterpret_cast<const char*>(&total), sizeof total);
+      frames->append(reinterpret_cast<const char*>(&correlation), id);
+    }
+    frames->resize(start + header);
+    frames->append(message, offset, size);
+    frames->resize(start + FrameAlign(header + size));
+    offset += size;
+    header = rest;
+  }
+}
+
+uint8_t KindOf(const std::string& frames) {
+  return static_cast<uint8_t>(frames[kFrameLengthSize]) & ~FRAME_MORE;
+}
+
+bool Droppable(const std::string& frames) {
+  return !(KindOf(frames) & (FRAME_SEQUENCED | FRAME_CONTROL));
+}
+
+uint64_t StreamOf(const std::string& frames) {
+  auto flags = static_cast<uint8_t>(frames[kFrameLengthSize]);
+  if (!(flags & FRAME_STREAM)) {
+    return 0;
+  }
+  auto id = kFrameLengthSize + kFrameHeaderSize +
+    (flags & FRAME_MORE ? sizeof(uint32_t) : 0);
+  uint64_t stream = 0;
+  std::copy(frames.data() + id,
+            frames.data() + id + sizeof stream,
+            reinterpret_cast<char*>(&stream));
+  return stream;
+}
+
+void SlicePackets(
+  const std::shared_ptr<const std::string>& frames,
+  std::deque<Packet>* packets) {
+  auto budget = static_cast<size_t>(kPacketSize);
+  Packet packet = { frames, 0, 0 };
+  // Fast path, the frames fit into one packet.
+  if (frames->size() <= budget) {
+    packet.size = frames->size();
+    packets->push_back(packet);
+    return;
+  }
+
+  PacketReader reader(frames->data(), frames->size());
+  const char* frame = nullptr;
+  size_t size = 0;
+  while (reader.Next(&frame, &size)) {
+    auto end = FrameAlign(frame + size - frames->data());
+    if (end - packet.offset > budget) {
+      packets->push_back(packet);
+      packet.offset += packet.size;
+      packet.size = 0;
+    }
+    packet.size = end - packet.offset;
+  }
+  packets->push_back(packet);
+}
+
+PacketReader::PacketReader(const char* packet, size_t size)
+  : packet_(packet),
+    size_(size) {}
+
+bool PacketReader::Next(const char** frame, size_t* size) {
+  if (!size_) {
+    return false;
+  }
+  uint32_t length = 0;
+  if (size_ < sizeof length) {
+    throw ConnectionExcepton("truncated frame length");
+  }
+  std::copy(packet_, packet_ + sizeof length, reinterpret_cast<char*>(&length));
+  packet_ += sizeof length;
+  size_ -= sizeof length;
+  auto padded = FrameAlign(sizeof length + length) - sizeof length;
+  if (padded > size_) {
+    throw ConnectionExcepton("truncated frame");
+  }
+  *frame = packet_;
+  *size = length;
+  packet_ += padded;
+  size_ -= padded;
+  return true;
+}
+
+FrameAssembler::FrameAssembler()
+  : expected_(0),
+    kind_(0),
+    correlation_(0) {}
+
+bool FrameAssembler::Feed(
+  const char* frame,
+  size_t size,
+  const char** payload,
+  size_t* length,
+  std::string* message) {
+  if (size < kFrameHeaderSize) {
+    throw ConnectionExcepton("empty frame");
+  }
+  auto flags = static_cast<uint8_t>(frame[0]);
+  bool more = (flags & FRAME_MORE) != 0;
+  bool first = !expected_;
+  bool id = first && (flags & (FRAME_REQUEST | FRAME_REPLY | FRAME_STREAM));
+  auto header = HeaderSize(first && more, id ? kCorrelationSize : 0) -
+                kFrameLengthSize;
+  if (size < header) {
+    throw ConnectionExcepton("truncated frame header");
+  }
+  auto fields = frame + kFrameHeaderSize;
+  frame += header;
+  size -= header;
+
+  if (first) {
+    uint32_t total = 0;
+    if (more) {
+      std::copy(fields, fields + sizeof total, reinterpret_cast<char*>(&total));
+      if (!total || total > static_cast<uint32_t>(kMaxMessageSize)) {
+        throw ConnectionExcepton("bad message length");
+      }
+      fields += sizeof total;
+    }
+    kind_ = flags & (FRAME_REQUEST | FRAME_REPLY | FRAME_CONTROL |
+                     FRAME_COMPRESSED | FRAME_STREAM | FRAME_SEQUENCED);
+    correlation_ = 0;
+    if (id) {
+      std::copy(fields,
+                fields + sizeof correlation_,
+                reinterpret_cast<char*>(&correlation_));
+    }
+
+    // Fast path, a single frame message.
+    if (!more) {
+      *payload = frame;
+      *length = size;
+      return true;
+    }
+    expected_ = total;
+    message_.reserve(expected_);
+  }
+
+  if (message_.size() + size > expected_) {
+    throw ConnectionExcepton("fragment overruns message");
+  }
+  message_.append(frame, size);
+  if (more) {
+    return false;
+  }
+  if (message_.size() != expected_) {
+    throw ConnectionExcepton("message ended early");
+  }
+  message->swap(message_);
+  message_.clear();
+  expected_ = 0;
+  *payload = nullptr;
+  *length = message->size();
+  return true;
+}
+
+uint8_t FrameAssembler::Kind() const {
+  return kind_;
+}
+
+uint64_t FrameAssembler::Correlation() const {
+  return correlation_;
+}
+
+}  // namespace interprocess
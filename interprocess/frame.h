@@ -0,0 +1,155 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef INTERPROCESS_FRAME_H_
+#define INTERPROCESS_FRAME_H_
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include "interprocess/types.h"
+
+namespace interprocess {
+
+// Every ring record, and every record of a pipe packet, is a frame: a flags
+// byte followed by the payload. A message too long for one frame is split,
+// all fragments but the last have FRAME_MORE set and the first one carries
+// the total length of the message right after the flags, so that the reader
+// reserves it only once. The first frame of a transaction request or reply
+// then carries its correlation id, which pairs the reply with its request
+// however many transactions are in flight. A message of a stream carries
+// the stream id in its place. A control message is meant for the connection
+// itself and never reaches the message callback. The payload of a
+// compressed message is encoded as described in compress.h. A sequenced
+// message belongs to the session of the connection, see session.h.
+// Frames start on kFrameAlignment boundaries and their header is padded up
+// to the next one, so that a payload read in place is as aligned as the
+// buffer holding the packet.
+enum FrameFlagsE {
+  FRAME_MORE = 0x01,
+  FRAME_REQUEST = 0x02,
+  FRAME_REPLY = 0x04,
+  FRAME_CONTROL = 0x08,
+  FRAME_COMPRESSED = 0x10,
+  FRAME_STREAM = 0x20,
+  FRAME_SEQUENCED = 0x40,
+};
+
+// First byte of a control message, the rest is its argument.
+enum ControlE {
+  CONTROL_SUBSCRIBE = 1,
+  CONTROL_UNSUBSCRIBE = 2,
+  // The sender decompresses what it receives, and compresses what it sends
+  // from then on.
+  CONTROL_COMPRESSION = 3,
+  // Sent on a stream, the sender closed it.
+  CONTROL_CLOSE_STREAM = 4,
+  // Opens or resumes the session of the connection, see SessionHello.
+  CONTROL_SESSION = 5,
+  // The sender received this many sequenced messages of the session.
+  CONTROL_ACK = 6,
+};
+
+static const int kFrameHeaderSize = 1;
+
+static const int kFrameLengthSize = sizeof(uint32_t);
+
+static const int kCorrelationSize = sizeof(uint64_t);
+
+static const int kFrameAlignment = 8;
+
+static const int kMaxMessageSize = 64 * 1024 * 1024;
+
+// Rounds |size| up to a multiple of kFrameAlignment.
+inline size_t FrameAlign(size_t size) {
+  return (size + kFrameAlignment - 1) & ~static_cast<size_t>(
+    kFrameAlignment - 1);
+}
+
+// Appends the frames of |message| to |frames|, each one behind its length
+// and padded to kFrameAlignment.
+// |kind| is FRAME_REQUEST or FRAME_REPLY for a transaction message, or
+// FRAME_STREAM or FRAME_SEQUENCED, or FRAME_CONTROL, possibly along with
+// FRAME_COMPRESSED or FRAME_STREAM. |correlation| is then the correlation
+// or the stream id.
+void EncodeFrames(
+  const std::string& message,
+  std::string* frames,
+  uint8_t kind = 0,
+  uint64_t correlation = 0);
+
+// Returns the flags of the message encoded in |frames|, but FRAME_MORE.
+uint8_t KindOf(const std::string& frames);
+
+// Whether the message encoded in |frames| may be dropped from a full send
+// queue. The session numbers sequenced messages by their order on the
+// wire, and control messages keep the connection working.
+bool Droppable(const std::string& frames);
+
+// Returns the stream id of the message encoded in |frames|, or 0 if it is
+// not sent on a stream.
+uint64_t StreamOf(const std::string& frames);
+
+// A pipe message is a packet: a run of whole frames, each one behind its
+// length, at most kPacketSize long. Packets point into encoded frames which
+// every connection sending the same message shares.
+struct Packet {
+  std::shared_ptr<const std::string> storage;
+  size_t offset;
+  size_t size;
+
+  const char* Data() const {
+    return storage->data() + offset;
+  }
+};
+
+// Cuts encoded |frames| into packets appended to |packets|.
+void SlicePackets(
+  const std::shared_ptr<const std::string>& frames,
+  std::deque<Packet>* packets);
+
+class PacketReader {
+ public:
+  PacketReader(const char* packet, size_t size);
+  // Returns false at the end of the packet, throws on a truncated frame.
+  // |size| does not count the padding behind the frame.
+  bool Next(const char** frame, size_t* size);
+
+ private:
+  const char* packet_;
+  size_t size_;
+};
+
+class FrameAssembler {
+ public:
+  FrameAssembler();
+  FrameAssembler(const FrameAssembler&) = delete;
+  FrameAssembler& operator=(const FrameAssembler&) = delete;
+  // Returns true once a whole message has arrived, throws on a frame that
+  // does not fit the message being assembled. A message carried by a single
+  // frame is left in place, |payload| points into |frame|; a reassembled one
+  // is moved into |message| and |payload| is null.
+  bool Feed(
+    const char* frame,
+    size_t size,
+    const char** payload,
+    size_t* length,
+    std::string* message);
+  // Kind and correlation or stream id of the last whole message.
+  uint8_t Kind() const;
+  uint64_t Correlation() const;
+
+ private:
+  std::string message_;
+  size_t expected_;
+  uint8_t kind_;
+  uint64_t correlation_;
+};
+
+}  // namespace interprocess
+
+#endif  // INTERPROCESS_FRAME_H_
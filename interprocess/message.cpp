@@ -0,0 +1,240 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#include "interprocess/message.h"
+#include <windows.h>
+#include <malloc.h>
+#include <atomic>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+#include "interprocess/compress.h"
+
+namespace interprocess {
+
+// Frames are aligned within a packet, the data is aligned for any payload
+// read in place.
+struct Block {
+  SLIST_ENTRY entry;
+  std::atomic<long> refs;
+  __declspec(align(16)) char data[kPacketSize];
+};
+
+namespace {
+
+// Free blocks beyond this many go back to the heap.
+const USHORT kPoolDepth = 64;
+
+// A zeroed SLIST_HEADER is an empty list, so the pool is usable before any
+// dynamic initialization runs. It is never torn down: messages may still be
+// released by other threads while the process exits.
+SLIST_HEADER free_blocks;
+
+Block* AcquireBlock() {
+  auto block = reinterpret_cast<Block*>(InterlockedPopEntrySList(&free_blocks));
+  if (!block) {
+    auto memory = _aligned_malloc(sizeof(Block), MEMORY_ALLOCATION_ALIGNMENT);
+    if (!memory) {
+      throw std::bad_alloc();
+    }
+    block = new (memory) Block;
+  }
+  block->refs.store(1, std::memory_order_relaxed);
+  return block;
+}
+
+void RetainBlock(Block* block) {
+  block->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ReleaseBlock(Block* block) {
+  if (block->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+    return;
+  }
+  if (QueryDepthSList(&free_blocks) >= kPoolDepth) {
+    _aligned_free(block);
+  } else {
+    InterlockedPushEntrySList(&free_blocks, &block->entry);
+  }
+}
+
+}  // namespace
+
+Message::Message()
+  : block_(nullptr),
+    data_(nullptr),
+    size_(0),
+    kind_(0),
+    correlation_(0) {}
+
+Message::Message(const Message& other)
+  : block_(other.block_),
+    assembled_(other.assembled_),
+    data_(other.data_),
+    size_(other.size_),
+    kind_(other.kind_),
+    correlation_(other.correlation_) {
+  if (block_) {
+    RetainBlock(block_);
+  }
+}
+
+Message::Message(Message&& other)
+  : block_(other.block_),
+    assembled_(std::move(other.assembled_)),
+    data_(other.data_),
+    size_(other.size_),
+    kind_(other.kind_),
+    correlation_(other.correlation_) {
+  other.block_ = nullptr;
+  other.data_ = nullptr;
+  other.size_ = 0;
+}
+
+Message& Message::operator=(Message other) {
+  swap(other);
+  return *this;
+}
+
+Message::~Message() {
+  if (block_) {
+    ReleaseBlock(block_);
+  }
+}
+
+void Message::swap(Message& other) {
+  std::swap(block_, other.block_);
+  assembled_.swap(other.assembled_);
+  std::swap(data_, other.data_);
+  std::swap(size_, other.size_);
+  std::swap(kind_, other.kind_);
+  std::swap(correlation_, other.correlation_);
+}
+
+const char* Message::Data() const {
+  return data_;
+}
+
+size_t Message::Size() const {
+  return size_;
+}
+
+std::string Message::ToString() const {
+  return std::string(data_, size_);
+}
+
+Message::Message(Block* block, const char* data, size_t size)
+  : block_(block),
+    data_(data),
+    size_(size),
+    kind_(0),
+    correlation_(0) {
+  RetainBlock(block_);
+}
+
+Message::Message(std::string* assembled)
+  : block_(nullptr),
+    kind_(0),
+    correlation_(0) {
+  auto message = std::make_shared<std::string>();
+  message->swap(*assembled);
+  assembled_ = message;
+  data_ = assembled_->data();
+  size_ = assembled_->size();
+}
+
+Receiver::Receiver()
+  : block_(AcquireBlock()),
+    stage_(nullptr),
+    staged_(0) {}
+
+Receiver::~Receiver() {
+  ReleaseBlock(block_);
+  if (stage_) {
+    ReleaseBlock(stage_);
+  }
+}
+
+char* Receiver::Buffer() {
+  // Messages loaned from the last packet keep its buffer, the next read
+  // goes into another one.
+  if (block_->refs.load(std::memory_order_acquire) != 1) {
+    ReleaseBlock(block_);
+    block_ = AcquireBlock();
+  }
+  return block_->data;
+}
+
+void Receiver::Unpack(size_t size, std::vector<Message>* messages) {
+  PacketReader packet(block_->data, size);
+  const char* frame = nullptr;
+  size_t length = 0;
+  const char* payload = nullptr;
+  size_t bytes = 0;
+  while (packet.Next(&frame, &length)) {
+    if (assembler_.Feed(frame, length, &payload, &bytes, &assembled_)) {
+      if (!Inflate(payload, bytes, messages)) {
+        messages->push_back(payload ?
+          Message(block_, payload, bytes) : Message(&assembled_));
+      }
+      Correlate(&messages->back());
+    }
+  }
+}
+
+void Receiver::Stage(
+  const char* frame, size_t size, std::vector<Message>* messages) {
+  const char* payload = nullptr;
+  size_t bytes = 0;
+  if (!assembler_.Feed(frame, size, &payload, &bytes, &assembled_)) {
+    return;
+  }
+  if (Inflate(payload, bytes, messages)) {
+    Correlate(&messages->back());
+    return;
+  }
+  if (!payload) {
+    messages->push_back(Message(&assembled_));
+    Correlate(&messages->back());
+    return;
+  }
+
+  if (stage_ && stage_->refs.load(std::memory_order_acquire) == 1) {
+    staged_ = 0;
+  }
+  staged_ = FrameAlign(staged_);
+  if (!stage_ || staged_ + bytes > sizeof stage_->data) {
+    if (stage_) {
+      ReleaseBlock(stage_);
+    }
+    stage_ = AcquireBlock();
+    staged_ = 0;
+  }
+  auto data = stage_->data + staged_;
+  CopyMemory(data, payload, bytes);
+  staged_ += bytes;
+  messages->push_back(Message(stage_, data, bytes));
+  Correlate(&messages->back());
+}
+
+bool Receiver::Inflate(
+  const char* payload, size_t size, std::vector<Message>* messages) {
+  if (!(assembler_.Kind() & FRAME_COMPRESSED)) {
+    return false;
+  }
+  Decompress(payload ? payload : assembled_.data(), size, &inflated_);
+  messages->push_back(Message(&inflated_));
+  return true;
+}
+
+void Receiver::Correlate(Message* message) const {
+  message->kind_ =
+    static_cast<uint8_t>(assembler_.Kind() & ~FRAME_COMPRESSED);
+  message->correlation_ = assembler_.Correlation();
+}
+
+}  // namespace interprocess
@@ -0,0 +1,85 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef INTERPROCESS_MESSAGE_H_
+#define INTERPROCESS_MESSAGE_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "interprocess/frame.h"
+#include "interprocess/types.h"
+
+namespace interprocess {
+
+// Receive buffer of kPacketSize bytes, recycled through a lock-free list
+// shared by every connection.
+struct Block;
+
+// A received message. It is loaned straight from the receive buffer it was
+// read into, copying it only takes a reference on that buffer, so it can be
+// kept past the callback without copying the payload.
+class Message {
+ public:
+  Message();
+  Message(const Message& other);
+  Message(Message&& other);
+  Message& operator=(Message other);
+  ~Message();
+  void swap(Message& other);
+  const char* Data() const;
+  size_t Size() const;
+  std::string ToString() const;
+
+ private:
+  friend class Connection;
+  friend class Receiver;
+  Message(Block* block, const char* data, size_t size);
+  explicit Message(std::string* assembled);
+
+  Block* block_;
+  std::shared_ptr<const std::string> assembled_;
+  const char* data_;
+  size_t size_;
+  uint8_t kind_;
+  uint64_t correlation_;
+};
+
+// Receive side of a connection. Packets are read into a pooled buffer and
+// unpacked into messages loaned from it; the buffer is reused for the next
+// read unless some message still holds it. Only messages reassembled from
+// several frames, or decompressed, are copied out.
+class Receiver {
+ public:
+  Receiver();
+  Receiver(const Receiver&) = delete;
+  Receiver& operator=(const Receiver&) = delete;
+  ~Receiver();
+  // The buffer the next read goes into, kPacketSize bytes long.
+  char* Buffer();
+  // Unpacks |size| bytes read into Buffer(), throws on a malformed packet.
+  void Unpack(size_t size, std::vector<Message>* messages);
+  // Copies a frame out of a shared memory ring into a staging buffer, next
+  // to the frames staged before it.
+  void Stage(const char* frame, size_t size, std::vector<Message>* messages);
+
+ private:
+  bool Inflate(
+    const char* payload, size_t size, std::vector<Message>* messages);
+  void Correlate(Message* message) const;
+
+  FrameAssembler assembler_;
+  std::string assembled_;
+  std::string inflated_;
+  Block* block_;
+  Block* stage_;
+  size_t staged_;
+};
+
+}  // namespace interprocess
+
+#endif  // INTERPROCESS_MESSAGE_H_
@@ -0,0 +1,84 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#include "interprocess/send_queue.h"
+#include <memory>
+#include <string>
+
+namespace interprocess {
+
+SendQueue::SendQueue()
+  : head_(&stub_),
+    tail_(&stub_),
+    scheduled_(false) {
+  stub_.next.store(nullptr, std::memory_order_relaxed);
+}
+
+SendQueue::~SendQueue() {
+  std::shared_ptr<const std::string> frames;
+  while (Pop(&frames)) {}
+}
+
+bool SendQueue::Push(const std::shared_ptr<const std::string>& frames) {
+  auto node = new Node;
+  node->frames = frames;
+  Link(node);
+  return !scheduled_.exchange(true);
+}
+
+bool SendQueue::Pop(std::shared_ptr<const std::string>* frames) {
+  auto tail = tail_;
+  auto next = tail->next.load(std::memory_order_acquire);
+  if (tail == &stub_) {
+    if (!next) {
+      return false;
+    }
+    tail_ = tail = next;
+    next = next->next.load(std::memory_order_acquire);
+  }
+  if (!next) {
+    // The last node can only be taken once the stub is queued behind it, a
+    // producer may be halfway through linking another one.
+    if (tail != head_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    Link(&stub_);
+    next = tail->next.load(std::memory_order_acquire);
+    if (!next) {
+      return false;
+    }
+  }
+  tail_ = next;
+  frames->swap(tail->frames);
+  delete tail;
+  return true;
+}
+
+bool SendQueue::Idle() {
+  scheduled_.store(false);
+  // A producer still linking its node finds the flag cleared once it is
+  // done and wakes the consumer itself. Anything linked already is ours to
+  // take, unless some producer has scheduled the queue again meanwhile.
+  if (Empty()) {
+    return true;
+  }
+  return scheduled_.exchange(true);
+}
+
+bool SendQueue::Empty() const {
+  if (tail_->next.load()) {
+    return false;
+  }
+  return tail_ == &stub_ || tail_ != head_.load();
+}
+
+void SendQueue::Link(Node* node) {
+  node->next.store(nullptr, std::memory_order_relaxed);
+  auto prev = head_.exchange(node);
+  prev->next.store(node);
+}
+
+}  // namespace interprocess
@@ -0,0 +1,52 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef INTERPROCESS_SEND_QUEUE_H_
+#define INTERPROCESS_SEND_QUEUE_H_
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+namespace interprocess {
+
+// Intrusive multi-producer/single-consumer queue of encoded messages, after
+// Dmitry Vyukov's. Push() is a single exchange from any thread, Pop() and
+// Idle() belong to the loop thread of the connection.
+// The queue is scheduled from the push that finds it idle until the consumer
+// drains it, only that push has to wake the consumer up.
+class SendQueue {
+ public:
+  SendQueue();
+  SendQueue(const SendQueue&) = delete;
+  SendQueue& operator=(const SendQueue&) = delete;
+  ~SendQueue();
+  // Returns true if the queue was idle, the caller then wakes the consumer.
+  bool Push(const std::shared_ptr<const std::string>& frames);
+  // Returns false once nothing is left that can be taken yet.
+  bool Pop(std::shared_ptr<const std::string>* frames);
+  // Called by the consumer once Pop() failed. Returns false if it has to
+  // keep draining, a message was pushed that no producer will wake it for.
+  bool Idle();
+  // Whether the consumer has nothing left to take.
+  bool Empty() const;
+
+ private:
+  struct Node {
+    std::atomic<Node*> next;
+    std::shared_ptr<const std::string> frames;
+  };
+  void Link(Node* node);
+
+  std::atomic<Node*> head_;
+  Node* tail_;
+  Node stub_;
+  std::atomic<bool> scheduled_;
+};
+
+}  // namespace interprocess
+
+#endif  // INTERPROCESS_SEND_QUEUE_H_
@@ -6,60 +6,152 @@
 
 #include "interprocess/server.h"
 #include <algorithm>
-#include <map>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 #include "interprocess/acceptor.h"
+#include "interprocess/broadcast.h"
 #include "interprocess/connection.h"
+#include "interprocess/session.h"
+#include "interprocess/slot_map.h"
+#include "interprocess/topic_index.h"
 
 namespace interprocess {
 
+namespace {
+
+// The top byte of the slot index of a connection id names its shard.
+const int kShardShift = 24;
+
+// Adds the counters of |from| to |to|, the queue figures are left alone.
+void Accumulate(const ConnectionStats& from, ConnectionStats* to) {
+  to->messages_in += from.messages_in;
+  to->bytes_in += from.bytes_in;
+  to->messages_out += from.messages_out;
+  to->bytes_out += from.bytes_out;
+  to->messages_dropped += from.messages_dropped;
+  to->messages_compressed += from.messages_compressed;
+  to->writes += from.writes;
+  to->transact_timeouts += from.transact_timeouts;
+}
+
+}  // namespace
+
 class Server::Impl {
  public:
-  typedef std::map<std::string, ConnectionPtr> ConnectionMap;
-  explicit Impl(const std::string& endpoint);
+  typedef SlotMap<ConnectionPtr> ConnectionMap;
+  Impl(const std::string& endpoint, TransportE transport, int workers);
   ~Impl();
   void swap();
   void Listen();
   void Stop();
   void SetMessageCallback(const MessageCallback& cb);
+  void SetMessageViewCallback(const MessageViewCallback& cb);
+  void SetBatchMessageCallback(const BatchMessageCallback& cb);
+  void SetStreamMessageCallback(const StreamMessageCallback& cb);
   void SetExceptionCallback(const ExceptionCallback& cb);
+  void SetSendLimits(const SendLimits& limits);
+  void SetCompressionThreshold(size_t bytes);
+  void SetSendBatching(const SendBatching& batching);
+  void SetHighWaterMarkCallback(const WaterMarkCallback& cb);
+  void SetLowWaterMarkCallback(const WaterMarkCallback& cb);
   void Broadcast(const std::string& message);
+  void Broadcast(const Buffer& buffer);
+  void Publish(const std::string& message);
+  void Publish(const Buffer& buffer);
+  void Publish(const std::string& topic, const std::string& message);
+  void Publish(const std::string& topic, const Buffer& buffer);
   void CloseConnection(const std::string& name);
+  void CloseConnection(ConnectionId id);
+  ServerStats Stats(std::vector<ConnectionStats>* connections) const;
 
  private:
-  void NewConnection(HANDLE pipe, HANDLE post_event, HANDLE send_event);
-  void RemoveConnection(const ConnectionPtr& conn);
-  void AsyncWrite();
-  void AsyncWaitWrite();
+  // Connections of one worker. Only its loop thread changes them, under the
+  // mutex so that Broadcast() and CloseConnection() can reach them from any
+  // thread. The counters of closed connections are kept in |closed|.
+  struct Shard {
+    Shard(EventLoop* loop, uint32_t first_index)
+      : loop(loop),
+        connection_map(first_index),
+        accepted(0),
+        disconnected(0) {}
+    EventLoop* const loop;
+    std::mutex mutex;
+    ConnectionMap connection_map;
+    uint64_t accepted;
+    uint64_t disconnected;
+    ConnectionStats closed;
+  };
+  typedef std::vector<std::unique_ptr<Shard>> ShardList;
+
+  void NewConnection(HANDLE pipe, EventLoop* loop);
+  void RemoveConnection(Shard* shard, const ConnectionPtr& conn);
+  void OnControl(const ConnectionPtr& conn, const Message& message);
+  void OnSession(const ConnectionPtr& conn, const Message& message);
 
-  ConnectionMap connection_map_;
   std::unique_ptr<Acceptor> acceptor_;
-  std::string name_;
-  MessageCallback message_callback_;
+  // Created by the first Publish(), 1MB of section is not mapped for
+  // nothing.
+  std::mutex broadcast_mutex_;
+  std::unique_ptr<BroadcastChannel> broadcast_;
+  ShardList shards_;
+  // Subscriptions by connection id, changed from the loops of the shards.
+  std::mutex topics_mutex_;
+  TopicIndex topics_;
+  // Sessions of reconnecting clients by id, kept kSessionLinger after their
+  // client left. A session is only resumed from the process that opened it.
+  struct SessionEntry {
+    std::shared_ptr<Session> session;
+    ULONG process;
+  };
+  std::mutex sessions_mutex_;
+  std::unordered_map<uint64_t, SessionEntry> sessions_;
+  std::shared_ptr<const std::string> name_;
+  const TransportE transport_;
+  std::atomic<int> sections_;
+  MessageViewCallback message_callback_;
+  BatchMessageCallback batch_message_callback_;
+  StreamMessageCallback stream_message_callback_;
   ExceptionCallback exception_callback_;
+  SendLimits send_limits_;
+  size_t compression_threshold_;
+  SendBatching send_batching_;
+  WaterMarkCallback high_water_mark_callback_;
+  WaterMarkCallback low_water_mark_callback_;
 };
 
 // real implement of Server
 
-Server::Impl::Impl(const std::string& endpoint)
-  : acceptor_(new Acceptor(endpoint)),
-    name_(endpoint) {}
+Server::Impl::Impl(
+  const std::string& endpoint, TransportE transport, int workers)
+  : acceptor_(new Acceptor(endpoint, workers)),
+    name_(std::make_shared<const std::string>(endpoint)),
+    transport_(transport),
+    sections_(0),
+    compression_threshold_(0) {
+  auto loops = acceptor_->Loops();
+  assert(("too many workers", loops.size() <= (1u << (32 - kShardShift))));
+  std::for_each(std::begin(loops), std::end(loops), [this](EventLoop* loop) {
+    auto first_index = static_cast<uint32_t>(shards_.size()) << kShardShift;
+    shards_.emplace_back(new Shard(loop, first_index));
+  });
+}
 
 Server::Impl::~Impl() {}
 
 void Server::Impl::Listen() {
   using std::placeholders::_1;
   using std::placeholders::_2;
-  using std::placeholders::_3;
   acceptor_->SetNewConnectionCallback(
-    std::bind(&Server::Impl::NewConnection, this, _1, _2, _3));
+    std::bind(&Server::Impl::NewConnection, this, _1, _2));
   acceptor_->SetExceptionCallback(exception_callback_);
-  acceptor_->MoveAsyncIOFunctionToAlertableThread(
-    std::bind(&Server::Impl::AsyncWrite, this));
-  acceptor_->MoveWaitResponseIOFunctionToAlertableThread(
-    std::bind(&Server::Impl::AsyncWaitWrite, this));
   acceptor_->Listen();
 }
 
@@ -68,72 +160,304 @@ void Server::Impl::Stop() {
 }
 
 void Server::Impl::SetMessageCallback(const MessageCallback& cb) {
+  message_callback_ = [cb](const ConnectionPtr& conn, const Message& message) {
+    cb(conn, message.ToString());
+  };
+}
+
+void Server::Impl::SetMessageViewCallback(const MessageViewCallback& cb) {
   message_callback_ = cb;
 }
 
+void Server::Impl::SetBatchMessageCallback(const BatchMessageCallback& cb) {
+  batch_message_callback_ = cb;
+}
+
+void Server::Impl::SetStreamMessageCallback(
+  const StreamMessageCallback& cb) {
+  stream_message_callback_ = cb;
+}
+
 void Server::Impl::SetExceptionCallback(const ExceptionCallback& cb) {
   exception_callback_ = cb;
 }
 
+void Server::Impl::SetSendLimits(const SendLimits& limits) {
+  send_limits_ = limits;
+}
+
+void Server::Impl::SetCompressionThreshold(size_t bytes) {
+  compression_threshold_ = bytes;
+}
+
+void Server::Impl::SetSendBatching(const SendBatching& batching) {
+  send_batching_ = batching;
+}
+
+void Server::Impl::SetHighWaterMarkCallback(const WaterMarkCallback& cb) {
+  high_water_mark_callback_ = cb;
+}
+
+void Server::Impl::SetLowWaterMarkCallback(const WaterMarkCallback& cb) {
+  low_water_mark_callback_ = cb;
+}
+
 void Server::Impl::Broadcast(const std::string& message) {
-  typedef std::pair<std::string, ConnectionPtr> ConnectionMapItem;
-  std::for_each(std::begin(connection_map_),
-                std::end(connection_map_),
-                [=](const ConnectionMapItem& pair) {
-    pair.second->Send(message);
+  Broadcast(Buffer(message));
+}
+
+void Server::Impl::Broadcast(const Buffer& buffer) {
+  // Sent once the shards are unlocked: a send may wait for room, and the
+  // loops that make it need their shard to add and remove connections.
+  std::vector<ConnectionPtr> conns;
+  std::for_each(std::begin(shards_),
+                std::end(shards_),
+                [&](const std::unique_ptr<Shard>& shard) {
+    std::unique_lock<std::mutex> lock(shard->mutex);
+    shard->connection_map.ForEach([&](ConnectionId, ConnectionPtr& conn) {
+      conns.push_back(conn);
+    });
+  });
+  std::for_each(std::begin(conns),
+                std::end(conns),
+                [&](const ConnectionPtr& conn) {
+    conn->Send(buffer);
   });
 }
 
-void Server::Impl::CloseConnection(const std::string& name) {
-  typedef std::pair<std::string, ConnectionPtr> ConnectionMapItem;
-  auto it = std::find_if(std::begin(connection_map_),
-                         std::end(connection_map_),
-                         [&](const ConnectionMapItem& pair) {
-    return name == pair.first;
+void Server::Impl::Publish(const std::string& message) {
+  Publish(Buffer(message));
+}
+
+void Server::Impl::Publish(const Buffer& buffer) {
+  BroadcastChannel* broadcast = nullptr;
+  {
+    std::unique_lock<std::mutex> lock(broadcast_mutex_);
+    if (!broadcast_) {
+      broadcast_.reset(new BroadcastChannel(*name_));
+    }
+    broadcast = broadcast_.get();
+  }
+  broadcast->Publish(buffer);
+}
+
+void Server::Impl::Publish(
+  const std::string& topic, const std::string& message) {
+  Publish(topic, Buffer(message));
+}
+
+void Server::Impl::Publish(const std::string& topic, const Buffer& buffer) {
+  std::vector<ConnectionId> ids;
+  {
+    std::unique_lock<std::mutex> lock(topics_mutex_);
+    topics_.Match(topic, &ids);
+  }
+  // Grouped by slot index, hence by shard, each shard is locked once.
+  std::sort(std::begin(ids),
+            std::end(ids),
+            [](ConnectionId lhs, ConnectionId rhs) {
+    return static_cast<uint32_t>(lhs) < static_cast<uint32_t>(rhs);
+  });
+  std::vector<ConnectionPtr> conns;
+  conns.reserve(ids.size());
+  {
+    std::unique_lock<std::mutex> lock;
+    std::for_each(std::begin(ids), std::end(ids), [&](ConnectionId id) {
+      auto shard = shards_[static_cast<uint32_t>(id) >> kShardShift].get();
+      if (lock.mutex() != &shard->mutex) {
+        lock = std::unique_lock<std::mutex>(shard->mutex);
+      }
+      // Gone since it matched, its subscriptions are being dropped.
+      auto conn = shard->connection_map.Find(id);
+      if (conn) {
+        conns.push_back(*conn);
+      }
+    });
+  }
+  // Unlocked, as in Broadcast().
+  std::for_each(std::begin(conns),
+                std::end(conns),
+                [&](const ConnectionPtr& conn) {
+    conn->Send(buffer);
   });
-  if (it != std::end(connection_map_)) {
-    it->second->Close();
+}
+
+void Server::Impl::CloseConnection(const std::string& name) {
+  // A connection name ends with its id.
+  auto hash = name.rfind('#');
+  if (hash != std::string::npos) {
+    CloseConnection(std::strtoull(name.c_str() + hash + 1, nullptr, 10));
   }
 }
 
-void Server::Impl::NewConnection(
-  HANDLE pipe, HANDLE post_event, HANDLE send_event) {
+void Server::Impl::CloseConnection(ConnectionId id) {
+  auto index = static_cast<size_t>(static_cast<uint32_t>(id) >> kShardShift);
+  if (index >= shards_.size()) {
+    return;
+  }
+  auto shard = shards_[index].get();
+  std::unique_lock<std::mutex> lock(shard->mutex);
+  auto conn = shard->connection_map.Find(id);
+  if (conn) {
+    (*conn)->Close();
+  }
+}
+
+ServerStats Server::Impl::Stats(
+  std::vector<ConnectionStats>* connections) const {
+  ServerStats stats;
+  auto& totals = stats.totals;
+  std::for_each(std::begin(shards_),
+                std::end(shards_),
+                [&](const std::unique_ptr<Shard>& shard) {
+    std::unique_lock<std::mutex> lock(shard->mutex);
+    stats.accepted += shard->accepted;
+    stats.disconnected += shard->disconnected;
+    Accumulate(shard->closed, &totals);
+    shard->connection_map.ForEach([&](ConnectionId, ConnectionPtr& conn) {
+      auto connection = conn->Stats();
+      Accumulate(connection, &totals);
+      totals.queued_bytes += connection.queued_bytes;
+      totals.queued_messages += connection.queued_messages;
+      totals.queued_bytes_peak =
+        std::max(totals.queued_bytes_peak, connection.queued_bytes_peak);
+      ++stats.connections;
+      if (connections) {
+        connections->push_back(connection);
+      }
+    });
+  });
+  return stats;
+}
+
+void Server::Impl::NewConnection(HANDLE pipe, EventLoop* loop) {
   using std::placeholders::_1;
-  auto name = name_.append("#").append(
-    std::to_string(reinterpret_cast<int32_t>(pipe)));
-  auto conn = std::make_shared<Connection>(name, pipe, post_event, send_event);
+  using std::placeholders::_2;
+  // Runs on the loop thread of the worker the pipe was handed to.
+  auto shard = std::find_if(std::begin(shards_),
+                            std::end(shards_),
+                            [loop](const std::unique_ptr<Shard>& shard) {
+    return shard->loop == loop;
+  })->get();
+  std::unique_lock<std::mutex> lock(shard->mutex);
+  auto id = shard->connection_map.Insert(ConnectionPtr());
+  // The slot stays empty until the connection is set up, a setter that
+  // throws must not leave it behind for Broadcast() to find.
+  ScopeGuard guard([&]() { shard->connection_map.Erase(id); });
+  auto conn = std::make_shared<Connection>(id, name_, pipe, loop, transport_);
   conn->SetCloseCallback(
-    std::bind(&Server::Impl::RemoveConnection, this, _1));
+    std::bind(&Server::Impl::RemoveConnection, this, shard, _1));
   ConnectionAttorney::SetMessageCallback(conn, message_callback_);
-  connection_map_.insert(std::make_pair(name, conn));
+  ConnectionAttorney::SetBatchMessageCallback(conn, batch_message_callback_);
+  ConnectionAttorney::SetStreamMessageCallback(
+    conn, stream_message_callback_);
+  ConnectionAttorney::SetControlCallback(
+    conn, std::bind(&Server::Impl::OnControl, this, _1, _2));
+  ConnectionAttorney::SetSendLimits(conn, send_limits_);
+  ConnectionAttorney::SetCompressionThreshold(conn, compression_threshold_);
+  ConnectionAttorney::SetSendBatching(conn, send_batching_);
+  ConnectionAttorney::SetHighWaterMarkCallback(
+    conn, high_water_mark_callback_);
+  ConnectionAttorney::SetLowWaterMarkCallback(conn, low_water_mark_callback_);
+  *shard->connection_map.Find(id) = conn;
+  guard.Dismiss();
+  ++shard->accepted;
+  lock.unlock();
+  ConnectionAttorney::Start(conn);
+  if (transport_ == SHARED_MEMORY) {
+    auto section = std::string("Local\\interprocess#")
+      .append(std::to_string(GetCurrentProcessId()))
+      .append("#")
+      .append(std::to_string(++sections_));
+    ConnectionAttorney::OfferSharedMemory(conn, section);
+  }
 }
 
-void Server::Impl::RemoveConnection(const ConnectionPtr& conn) {
+void Server::Impl::RemoveConnection(
+  Shard* shard, const ConnectionPtr& conn) {
   if (!DisconnectNamedPipe(ConnectionAttorney::Handle(conn))) {
-    // FIXME: throw exception instead
-    printf("DisconnectNamedPipe failed with %d.\n", GetLastError());
+    // Runs on a loop thread, which a throw would stop.
+    call_if_exist(exception_callback_, last_error());
+  }
+  {
+    std::unique_lock<std::mutex> lock(topics_mutex_);
+    topics_.Remove(conn->Id());
   }
-  connection_map_.erase(conn->Name());
+  std::unique_lock<std::mutex> lock(shard->mutex);
+  shard->connection_map.Erase(conn->Id());
+  Accumulate(conn->Stats(), &shard->closed);
+  ++shard->disconnected;
 }
 
-void Server::Impl::AsyncWrite() {
-  std::for_each(std::begin(connection_map_),
-                std::end(connection_map_),
-                [](const std::pair<std::string, ConnectionPtr>& pair) {
-    if (pair.second->State() == Connection::SEND_PENDDING) {
-      ConnectionAttorney::AsyncWrite(pair.second);
-    }
-  });
+void Server::Impl::OnControl(
+  const ConnectionPtr& conn, const Message& message) {
+  if (!message.Size()) {
+    return;
+  }
+  if (message.Data()[0] == CONTROL_SESSION) {
+    OnSession(conn, message);
+    return;
+  }
+  auto pattern = std::string(message.Data() + 1, message.Size() - 1);
+  std::unique_lock<std::mutex> lock(topics_mutex_);
+  switch (message.Data()[0]) {
+  case CONTROL_SUBSCRIBE:
+    topics_.Subscribe(conn->Id(), pattern);
+    break;
+
+  case CONTROL_UNSUBSCRIBE:
+    topics_.Unsubscribe(conn->Id(), pattern);
+    break;
+
+  default:
+    break;
+  }
 }
 
-void Server::Impl::AsyncWaitWrite() {
-  assert(("server should not use async + timeout", false));
+void Server::Impl::OnSession(
+  const ConnectionPtr& conn, const Message& message) {
+  SessionHello hello;
+  if (!DecodeSessionHello(message.Data(), message.Size(), &hello)) {
+    return;
+  }
+  ULONG process = 0;
+  GetNamedPipeClientProcessId(ConnectionAttorney::Handle(conn), &process);
+  std::shared_ptr<Session> session;
+  {
+    std::unique_lock<std::mutex> lock(sessions_mutex_);
+    // Swept here, the sessions only change when a client says hello.
+    auto now = std::chrono::steady_clock::now();
+    auto linger = std::chrono::milliseconds(kSessionLinger);
+    for (auto it = std::begin(sessions_); it != std::end(sessions_);) {
+      if (it->second.session->Expired(now, linger)) {
+        it = sessions_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    auto& found = sessions_[hello.id];
+    if (!found.session) {
+      // New, or lost to a restart of this server: the client's counts are
+      // taken as they are.
+      found.session = std::make_shared<Session>(
+        hello.id, hello.received, hello.acknowledged);
+      found.process = process;
+    } else if (!process || found.process != process) {
+      lock.unlock();
+      conn->Close();
+      call_if_exist(exception_callback_, std::make_exception_ptr(
+        ConnectionExcepton("session resumed by another process")));
+      return;
+    }
+    session = found.session;
+  }
+  ConnectionAttorney::ResumeSession(conn, session, hello.received);
 }
 
 // Server wrapper
 
-Server::Server(const std::string& name)
-  : impl_(new Impl(name)) {}
+Server::Server(const std::string& name, TransportE transport, int workers)
+  : impl_(new Impl(name, transport, workers)) {}
 
 Server::Server(Server&& other) {
   swap(other);
@@ -162,16 +486,76 @@ void Server::SetMessageCallback(const MessageCallback& cb) {
   impl_->SetMessageCallback(cb);
 }
 
+void Server::SetMessageViewCallback(const MessageViewCallback& cb) {
+  impl_->SetMessageViewCallback(cb);
+}
+
+void Server::SetBatchMessageCallback(const BatchMessageCallback& cb) {
+  impl_->SetBatchMessageCallback(cb);
+}
+
+void Server::SetStreamMessageCallback(const StreamMessageCallback& cb) {
+  impl_->SetStreamMessageCallback(cb);
+}
+
 void Server::SetExceptionCallback(const ExceptionCallback& cb) {
   impl_->SetExceptionCallback(cb);
 }
 
+void Server::SetSendLimits(const SendLimits& limits) {
+  impl_->SetSendLimits(limits);
+}
+
+void Server::SetCompressionThreshold(size_t bytes) {
+  impl_->SetCompressionThreshold(bytes);
+}
+
+void Server::SetSendBatching(const SendBatching& batching) {
+  impl_->SetSendBatching(batching);
+}
+
+void Server::SetHighWaterMarkCallback(const WaterMarkCallback& cb) {
+  impl_->SetHighWaterMarkCallback(cb);
+}
+
+void Server::SetLowWaterMarkCallback(const WaterMarkCallback& cb) {
+  impl_->SetLowWaterMarkCallback(cb);
+}
+
 void Server::Broadcast(const std::string& message) {
   impl_->Broadcast(message);
 }
 
+void Server::Broadcast(const Buffer& buffer) {
+  impl_->Broadcast(buffer);
+}
+
+void Server::Publish(const std::string& message) {
+  impl_->Publish(message);
+}
+
+void Server::Publish(const Buffer& buffer) {
+  impl_->Publish(buffer);
+}
+
+void Server::Publish(const std::string& topic, const std::string& message) {
+  impl_->Publish(topic, message);
+}
+
+void Server::Publish(const std::string& topic, const Buffer& buffer) {
+  impl_->Publish(topic, buffer);
+}
+
 void Server::CloseConnection(const std::string& name) {
   impl_->CloseConnection(name);
 }
 
+void Server::CloseConnection(ConnectionId id) {
+  impl_->CloseConnection(id);
+}
+
+ServerStats Server::Stats(std::vector<ConnectionStats>* connections) const {
+  return impl_->Stats(connections);
+}
+
 }  // namespace interprocess
@@ -10,13 +10,21 @@
 #include <algorithm>
 #include <memory>
 #include <string>
+#include <vector>
+#include "interprocess/buffer.h"
+#include "interprocess/message.h"
 #include "interprocess/types.h"
 
 namespace interprocess {
 
 class Server {
  public:
-  explicit Server(const std::string& endpoint);
+  // Connections are spread over |workers| I/O threads, each one running the
+  // I/O and callbacks of its own connections.
+  explicit Server(
+    const std::string& endpoint,
+    TransportE transport = NAMED_PIPE,
+    int workers = 1);
   Server(const Server&) = delete;
   Server(Server&& other);
   Server& operator=(const Server&) = delete;
@@ -26,9 +34,47 @@ class Server {
   void Listen();
   void Stop();
   void SetMessageCallback(const MessageCallback& cb);
+  // Messages are loaned from the receive buffer, without a copy into a
+  // std::string. Takes the place of the message callback.
+  void SetMessageViewCallback(const MessageViewCallback& cb);
+  // Messages read together are handed over in one call instead of through
+  // the message callback.
+  void SetBatchMessageCallback(const BatchMessageCallback& cb);
+  // Messages on the streams peers open, see Connection::OpenStream().
+  // Without it they go to the message callback, and cannot be answered on
+  // their stream.
+  void SetStreamMessageCallback(const StreamMessageCallback& cb);
   void SetExceptionCallback(const ExceptionCallback& cb);
+  // Bounds the send queue of every connection made from now on, see
+  // SendLimits.
+  void SetSendLimits(const SendLimits& limits);
+  // Compresses the messages of at least |bytes|, kMinCompressedSize at
+  // least, that connections made from now on send to peers which compress
+  // too; 0, the default, turns it off. Peers find out about each other once
+  // connected. A message that would not shrink by a sixteenth is sent as is.
+  void SetCompressionThreshold(size_t bytes);
+  // Coalesces what connections made from now on send, see SendBatching.
+  void SetSendBatching(const SendBatching& batching);
+  void SetHighWaterMarkCallback(const WaterMarkCallback& cb);
+  void SetLowWaterMarkCallback(const WaterMarkCallback& cb);
   void Broadcast(const std::string& message);
+  void Broadcast(const Buffer& buffer);
+  // Writes the message once into a shared memory ring every subscribed
+  // client reads, instead of once per connection. A subscriber too slow to
+  // keep up loses messages, see Client::Subscribe(). The ring is created by
+  // the first publish or subscription, a server that never publishes maps
+  // none unless a client subscribes.
+  void Publish(const std::string& message);
+  void Publish(const Buffer& buffer);
+  // Sends the message only to the connections subscribed to |topic|, see
+  // Connection::Subscribe().
+  void Publish(const std::string& topic, const std::string& message);
+  void Publish(const std::string& topic, const Buffer& buffer);
   void CloseConnection(const std::string& name);
+  void CloseConnection(ConnectionId id);
+  // Adds up the counters of every connection without stopping their I/O,
+  // and appends those of each open one to |connections| if given.
+  ServerStats Stats(std::vector<ConnectionStats>* connections = nullptr) const;
 
  private:
   class Impl;
@@ -0,0 +1,148 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#include "interprocess/session.h"
+#include <windows.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include "interprocess/connection.h"
+#include "interprocess/frame.h"
+
+namespace interprocess {
+
+std::string EncodeSessionHello(const SessionHello& hello) {
+  std::string message(1, CONTROL_SESSION);
+  message.append(reinterpret_cast<const char*>(&hello), sizeof hello);
+  return message;
+}
+
+bool DecodeSessionHello(const char* data, size_t size, SessionHello* hello) {
+  if (size != 1 + sizeof *hello || data[0] != CONTROL_SESSION) {
+    return false;
+  }
+  CopyMemory(hello, data + 1, sizeof *hello);
+  return true;
+}
+
+std::string EncodeSessionAck(uint64_t received) {
+  std::string message(1, CONTROL_ACK);
+  message.append(reinterpret_cast<const char*>(&received), sizeof received);
+  return message;
+}
+
+bool DecodeSessionAck(const char* data, size_t size, uint64_t* received) {
+  if (size != 1 + sizeof *received || data[0] != CONTROL_ACK) {
+    return false;
+  }
+  CopyMemory(received, data + 1, sizeof *received);
+  return true;
+}
+
+Session::Session(uint64_t id, uint64_t sent, uint64_t received)
+  : id_(id),
+    connection_(nullptr),
+    flushing_(false),
+    detached_(std::chrono::steady_clock::now()),
+    sent_(sent),
+    acknowledged_(sent),
+    received_(received),
+    reported_(received) {}
+
+uint64_t Session::Id() const {
+  return id_;
+}
+
+SessionHello Session::Hello() const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  SessionHello hello = { id_, received_.load(), acknowledged_ };
+  return hello;
+}
+
+void Session::Send(const std::shared_ptr<const std::string>& frames) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  unacknowledged_.push_back(frames);
+  ++sent_;
+  if (connection_) {
+    pending_.push_back(frames);
+  }
+  Flush(&lock);
+}
+
+uint64_t Session::Receive(size_t count) {
+  auto received = received_ += count;
+  if (received - reported_ < static_cast<uint64_t>(kSessionAckInterval)) {
+    return 0;
+  }
+  reported_ = received;
+  return received;
+}
+
+void Session::Acknowledge(uint64_t received) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  Drop(received);
+}
+
+void Session::Resume(Connection* conn, uint64_t received) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  Drop(received);
+  connection_ = conn;
+  weak_connection_ = conn->shared_from_this();
+  pending_.assign(std::begin(unacknowledged_), std::end(unacknowledged_));
+  Flush(&lock);
+}
+
+void Session::Detach(Connection* conn) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (connection_ == conn) {
+    connection_ = nullptr;
+    weak_connection_.reset();
+    pending_.clear();
+    detached_ = std::chrono::steady_clock::now();
+  }
+}
+
+bool Session::Expired(
+  std::chrono::steady_clock::time_point now,
+  std::chrono::milliseconds linger) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return !connection_ && now - detached_ >= linger;
+}
+
+void Session::Flush(std::unique_lock<std::mutex>* lock) {
+  if (flushing_) {
+    return;
+  }
+  flushing_ = true;
+  while (!pending_.empty()) {
+    std::deque<std::shared_ptr<const std::string>> frames;
+    frames.swap(pending_);
+    auto conn = weak_connection_.lock();
+    lock->unlock();
+    if (conn) {
+      std::for_each(std::begin(frames),
+                    std::end(frames),
+                    [&conn](const std::shared_ptr<const std::string>& f) {
+        conn->Enqueue(f);
+      });
+    }
+    // The last reference destroys the connection, which detaches it.
+    conn.reset();
+    lock->lock();
+  }
+  flushing_ = false;
+}
+
+void Session::Drop(uint64_t received) {
+  // A peer that was restarted may count more than this side ever sent.
+  received = std::min(received, sent_);
+  while (acknowledged_ < received) {
+    unacknowledged_.pop_front();
+    ++acknowledged_;
+  }
+}
+
+}  // namespace interprocess
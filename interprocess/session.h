@@ -0,0 +1,103 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef INTERPROCESS_SESSION_H_
+#define INTERPROCESS_SESSION_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "interprocess/types.h"
+
+namespace interprocess {
+
+// What a connection opens or resumes its session with. |received| and
+// |acknowledged| count the sequenced messages the sender received from the
+// session, and those of its own the peer acknowledged.
+struct SessionHello {
+  uint64_t id;
+  uint64_t received;
+  uint64_t acknowledged;
+};
+
+std::string EncodeSessionHello(const SessionHello& hello);
+
+// Returns false if |size| bytes at |data| are not a hello.
+bool DecodeSessionHello(const char* data, size_t size, SessionHello* hello);
+
+std::string EncodeSessionAck(uint64_t received);
+
+// Returns false if |size| bytes at |data| are not an ack.
+bool DecodeSessionAck(const char* data, size_t size, uint64_t* received);
+
+// Plain messages of a client and a server that outlive the connection they
+// were sent on. Each one is kept until the peer acknowledges it, and a
+// connection resuming the session sends again what the peer did not
+// receive, before anything sent after it. Messages are numbered by their
+// order on the wire: sent with FRAME_SEQUENCED, the peers only count them
+// and tell each other their counts, in the hello of every connection and in
+// acks every kSessionAckInterval messages.
+// Requests, replies, control and stream messages belong to the connection
+// they were sent on, they are not sequenced.
+class Session {
+ public:
+  // A server takes on a session it does not know from the hello of the
+  // client, it may have been restarted: the client received |sent| of its
+  // messages, it acknowledged |received| of the client's.
+  Session(uint64_t id, uint64_t sent, uint64_t received);
+  Session(const Session&) = delete;
+  Session& operator=(const Session&) = delete;
+  uint64_t Id() const;
+  SessionHello Hello() const;
+  // Keeps |frames| and queues them on the connection of the session, if it
+  // has one; they wait for the next one otherwise. The connection may call
+  // back into the session while they are queued, see Flush().
+  void Send(const std::shared_ptr<const std::string>& frames);
+  // Counts |count| messages received, on the loop of the connection.
+  // Returns how many to acknowledge, or 0 if no ack is due yet.
+  uint64_t Receive(size_t count);
+  // The peer received the first |received| messages sent.
+  void Acknowledge(uint64_t received);
+  // |conn| takes the session over, the messages the peer did not receive
+  // out of the first |received| are queued on it again.
+  void Resume(Connection* conn, uint64_t received);
+  // |conn| broke, if it has the session the messages sent from now on wait
+  // for the next connection.
+  void Detach(Connection* conn);
+  // Whether the session has been without a connection for |linger|.
+  bool Expired(std::chrono::steady_clock::time_point now,
+               std::chrono::milliseconds linger);
+
+ private:
+  void Drop(uint64_t received);
+  // Queues |pending_| on the connection with |lock| released. One thread
+  // does at a time, in the order the messages are numbered; what is sent
+  // meanwhile, from its own callbacks too, is left to it.
+  void Flush(std::unique_lock<std::mutex>* lock);
+
+  const uint64_t id_;
+  mutable std::mutex mutex_;
+  Connection* connection_;
+  // Keeps the connection alive while messages are queued on it.
+  std::weak_ptr<Connection> weak_connection_;
+  std::deque<std::shared_ptr<const std::string>> pending_;
+  bool flushing_;
+  std::chrono::steady_clock::time_point detached_;
+  // Messages [acknowledged_, sent_) in order.
+  std::deque<std::shared_ptr<const std::string>> unacknowledged_;
+  uint64_t sent_;
+  uint64_t acknowledged_;
+  std::atomic<uint64_t> received_;
+  uint64_t reported_;
+};
+
+}  // namespace interprocess
+
+#endif  // INTERPROCESS_SESSION_H_
@@ -0,0 +1,205 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#include "interprocess/shared_memory.h"
+#include <windows.h>
+#include <cassert>
+#include <string>
+
+namespace interprocess {
+
+namespace {
+
+const uint32_t kWrapMarker = 0xFFFFFFFF;
+
+const uint32_t kRingStride = sizeof(SharedRing::Header) + kSharedRingSize;
+
+inline uint32_t RecordSize(size_t size) {
+  return (sizeof(uint32_t) + size + 7) & ~7;
+}
+
+}  // namespace
+
+SharedRing::SharedRing()
+  : header_(nullptr),
+    data_(nullptr),
+    capacity_(0) {}
+
+void SharedRing::Attach(char* memory, uint32_t capacity, bool initialize) {
+  assert(("ring capacity must be a power of two",
+    (capacity & (capacity - 1)) == 0));
+  header_ = reinterpret_cast<Header*>(memory);
+  data_ = memory + sizeof(Header);
+  capacity_ = capacity;
+  if (initialize) {
+    header_->head.store(0);
+    header_->tail.store(0);
+    header_->consumer_parked.store(0);
+    header_->producer_parked.store(0);
+  }
+}
+
+bool SharedRing::Write(const char* data, size_t size) {
+  auto head = header_->head.load(std::memory_order_relaxed);
+  auto tail = header_->tail.load(std::memory_order_seq_cst);
+  auto record = RecordSize(size);
+  auto offset = head & (capacity_ - 1);
+  auto contiguous = capacity_ - offset;
+  auto padding = record > contiguous ? contiguous : 0;
+  if (padding + record > capacity_ - (head - tail)) {
+    return false;
+  }
+  if (padding) {
+    *reinterpret_cast<uint32_t*>(data_ + offset) = kWrapMarker;
+    head += padding;
+    offset = 0;
+  }
+  *reinterpret_cast<uint32_t*>(data_ + offset) = static_cast<uint32_t>(size);
+  CopyMemory(data_ + offset + sizeof(uint32_t), data, size);
+  header_->head.store(head + record, std::memory_order_seq_cst);
+  return true;
+}
+
+bool SharedRing::Peek(const char** data, size_t* size) {
+  auto tail = header_->tail.load(std::memory_order_relaxed);
+  auto head = header_->head.load(std::memory_order_acquire);
+  if (tail == head) {
+    return false;
+  }
+  auto offset = tail & (capacity_ - 1);
+  auto length = *reinterpret_cast<const uint32_t*>(data_ + offset);
+  if (length == kWrapMarker) {
+    tail += capacity_ - offset;
+    header_->tail.store(tail, std::memory_order_seq_cst);
+    offset = 0;
+    length = *reinterpret_cast<const uint32_t*>(data_);
+  }
+  *data = data_ + offset + sizeof(uint32_t);
+  *size = length;
+  return true;
+}
+
+void SharedRing::Pop() {
+  auto tail = header_->tail.load(std::memory_order_relaxed);
+  auto length = *reinterpret_cast<const uint32_t*>(
+    data_ + (tail & (capacity_ - 1)));
+  header_->tail.store(tail + RecordSize(length), std::memory_order_seq_cst);
+}
+
+bool SharedRing::Empty() const {
+  return header_->head.load(std::memory_order_seq_cst) ==
+    header_->tail.load(std::memory_order_relaxed);
+}
+
+bool SharedRing::ParkConsumer() {
+  header_->consumer_parked.store(1, std::memory_order_seq_cst);
+  if (!Empty()) {
+    header_->consumer_parked.store(0, std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+void SharedRing::UnparkConsumer() {
+  header_->consumer_parked.store(0, std::memory_order_relaxed);
+}
+
+bool SharedRing::ConsumerParked() const {
+  return header_->consumer_parked.load(std::memory_order_seq_cst) != 0;
+}
+
+void SharedRing::ParkProducer() {
+  header_->producer_parked.store(1, std::memory_order_seq_cst);
+}
+
+bool SharedRing::UnparkProducer() {
+  return header_->producer_parked.load(std::memory_order_seq_cst) != 0 &&
+    header_->producer_parked.exchange(0) != 0;
+}
+
+SharedMemoryChannel::SharedMemoryChannel(const std::string& name, bool create)
+  : view_(nullptr) {
+  if (create) {
+    section_.reset(CreateFileMapping(
+      INVALID_HANDLE_VALUE,  // backed by the paging file
+      NULL,                  // default security attributes
+      PAGE_READWRITE,        // read/write access
+      0,                     // maximum object size (high-order DWORD)
+      2 * kRingStride,       // maximum object size (low-order DWORD)
+      name.c_str()));        // name of mapping object
+    raise_exception_if([this]() {
+      return !section_ || GetLastError() == ERROR_ALREADY_EXISTS;
+    });
+  } else {
+    section_.reset(OpenFileMapping(FILE_MAP_ALL_ACCESS, FALSE, name.c_str()));
+    raise_exception_if([this]() { return !section_; });
+  }
+
+  view_ = static_cast<char*>(
+    MapViewOfFile(section_.get(), FILE_MAP_ALL_ACCESS, 0, 0, 2 * kRingStride));
+  raise_exception_if([this]() { return !view_; });
+
+  auto server_event = std::string(name).append("#0");
+  auto client_event = std::string(name).append("#1");
+  if (create) {
+    wake_event_.reset(CreateEvent(NULL, FALSE, FALSE, server_event.c_str()));
+    peer_event_.reset(CreateEvent(NULL, FALSE, FALSE, client_event.c_str()));
+    inbound_.Attach(view_, kSharedRingSize, true);
+    outbound_.Attach(view_ + kRingStride, kSharedRingSize, true);
+  } else {
+    auto access = SYNCHRONIZE | EVENT_MODIFY_STATE;
+    wake_event_.reset(OpenEvent(access, FALSE, client_event.c_str()));
+    peer_event_.reset(OpenEvent(access, FALSE, server_event.c_str()));
+    inbound_.Attach(view_ + kRingStride, kSharedRingSize, false);
+    outbound_.Attach(view_, kSharedRingSize, false);
+  }
+  raise_exception_if([this]() { return !wake_event_ || !peer_event_; });
+}
+
+SharedMemoryChannel::~SharedMemoryChannel() {
+  if (view_) {
+    UnmapViewOfFile(view_);
+  }
+}
+
+HANDLE SharedMemoryChannel::WakeEvent() const {
+  return wake_event_.get();
+}
+
+bool SharedMemoryChannel::Write(const char* data, size_t size) {
+  auto written = outbound_.Write(data, size);
+  if (!written) {
+    // Park first, then retry once: the consumer may have drained the ring
+    // before it could see the flag.
+    outbound_.ParkProducer();
+    written = outbound_.Write(data, size);
+  }
+  if (written && outbound_.ConsumerParked()) {
+    SetEvent(peer_event_.get());
+  }
+  return written;
+}
+
+bool SharedMemoryChannel::Peek(const char** data, size_t* size) {
+  return inbound_.Peek(data, size);
+}
+
+void SharedMemoryChannel::Pop() {
+  inbound_.Pop();
+  if (inbound_.UnparkProducer()) {
+    SetEvent(peer_event_.get());
+  }
+}
+
+bool SharedMemoryChannel::Park() {
+  return inbound_.ParkConsumer();
+}
+
+void SharedMemoryChannel::Unpark() {
+  inbound_.UnparkConsumer();
+}
+
+}  // namespace interprocess
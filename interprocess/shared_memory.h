@@ -0,0 +1,84 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef INTERPROCESS_SHARED_MEMORY_H_
+#define INTERPROCESS_SHARED_MEMORY_H_
+
+#include <windows.h>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include "interprocess/types.h"
+
+namespace interprocess {
+
+// Single-producer/single-consumer message ring living in a shared memory
+// section. Each record is a length prefix followed by the payload, padded to
+// 8 bytes; a record that would straddle the end of the ring is preceded by a
+// wrap marker. The parked flags tell the other side whether it has to signal
+// the wakeup event at all.
+class SharedRing {
+ public:
+  struct Header {
+    __declspec(align(64)) std::atomic<uint32_t> head;
+    __declspec(align(64)) std::atomic<uint32_t> tail;
+    __declspec(align(64)) std::atomic<uint32_t> consumer_parked;
+    std::atomic<uint32_t> producer_parked;
+  };
+
+  SharedRing();
+  SharedRing(const SharedRing&) = delete;
+  SharedRing& operator=(const SharedRing&) = delete;
+  void Attach(char* memory, uint32_t capacity, bool initialize);
+  bool Write(const char* data, size_t size);
+  bool Peek(const char** data, size_t* size);
+  void Pop();
+  bool Empty() const;
+  bool ParkConsumer();
+  void UnparkConsumer();
+  bool ConsumerParked() const;
+  void ParkProducer();
+  bool UnparkProducer();
+
+ private:
+  Header* header_;
+  char* data_;
+  uint32_t capacity_;
+};
+
+// A pair of rings in one section, one for each direction, plus a named
+// auto-reset event per side. The server creates the section and tells the
+// client its name through the pipe; ring 0 carries client to server traffic.
+class SharedMemoryChannel {
+ public:
+  SharedMemoryChannel(const std::string& name, bool create);
+  SharedMemoryChannel(const SharedMemoryChannel&) = delete;
+  SharedMemoryChannel& operator=(const SharedMemoryChannel&) = delete;
+  ~SharedMemoryChannel();
+  HANDLE WakeEvent() const;
+  // Returns false when the outbound ring is full; the peer signals the wake
+  // event once it has drained some records.
+  bool Write(const char* data, size_t size);
+  // The record stays valid in the ring until Pop().
+  bool Peek(const char** data, size_t* size);
+  void Pop();
+  // Returns false if a message arrived while parking, the caller should keep
+  // reading instead of going to sleep.
+  bool Park();
+  void Unpark();
+
+ private:
+  handle section_;
+  char* view_;
+  handle wake_event_;
+  handle peer_event_;
+  SharedRing inbound_;
+  SharedRing outbound_;
+};
+
+}  // namespace interprocess
+
+#endif  // INTERPROCESS_SHARED_MEMORY_H_
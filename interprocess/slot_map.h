@@ -0,0 +1,100 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef INTERPROCESS_SLOT_MAP_H_
+#define INTERPROCESS_SLOT_MAP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace interprocess {
+
+// Values stored in reusable slots and named by 64-bit ids: the generation of
+// the slot in the high half, its index in the low half. Insertion, lookup
+// and removal are O(1). A slot's generation is odd while it is in use and
+// is bumped whenever it is taken or freed, so the id of a removed value
+// never finds the value that reuses its slot. Indexes start at
+// |first_index|, which lets several maps hand out disjoint ids.
+template <typename T>
+class SlotMap {
+ public:
+  typedef uint64_t Id;
+
+  explicit SlotMap(uint32_t first_index = 0)
+    : first_index_(first_index),
+      size_(0) {}
+
+  Id Insert(const T& value) {
+    uint32_t slot = 0;
+    if (free_.empty()) {
+      slot = static_cast<uint32_t>(slots_.size());
+      slots_.push_back(Slot());
+      slots_.back().generation = 0;
+    } else {
+      slot = free_.back();
+      free_.pop_back();
+    }
+    auto& entry = slots_[slot];
+    entry.value = value;
+    ++entry.generation;
+    ++size_;
+    return static_cast<Id>(entry.generation) << 32 | (first_index_ + slot);
+  }
+
+  T* Find(Id id) {
+    auto slot = static_cast<uint32_t>(id) - first_index_;
+    if (slot >= slots_.size() ||
+        slots_[slot].generation != static_cast<uint32_t>(id >> 32) ||
+        !(slots_[slot].generation & 1)) {
+      return nullptr;
+    }
+    return &slots_[slot].value;
+  }
+
+  bool Erase(Id id) {
+    if (!Find(id)) {
+      return false;
+    }
+    auto slot = static_cast<uint32_t>(id) - first_index_;
+    slots_[slot].value = T();
+    ++slots_[slot].generation;
+    free_.push_back(slot);
+    --size_;
+    return true;
+  }
+
+  // Calls |f| with the id and value of every value in the map.
+  template <typename Function>
+  void ForEach(Function f) {
+    for (uint32_t slot = 0; slot < slots_.size(); ++slot) {
+      auto& entry = slots_[slot];
+      if (entry.generation & 1) {
+        f(static_cast<Id>(entry.generation) << 32 | (first_index_ + slot),
+          entry.value);
+      }
+    }
+  }
+
+  size_t Size() const {
+    return size_;
+  }
+
+ private:
+  struct Slot {
+    T value;
+    uint32_t generation;
+  };
+
+  std::vector<Slot> slots_;
+  std::vector<uint32_t> free_;
+  const uint32_t first_index_;
+  size_t size_;
+};
+
+}  // namespace interprocess
+
+#endif  // INTERPROCESS_SLOT_MAP_H_
@@ -0,0 +1,75 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#include "interprocess/stream.h"
+#include <memory>
+#include <string>
+#include "interprocess/connection.h"
+
+namespace interprocess {
+
+Stream::Stream(
+  StreamId id,
+  const std::weak_ptr<interprocess::Connection>& connection,
+  const StreamMessageCallback& cb)
+  : id_(id),
+    connection_(connection),
+    message_callback_(cb) {}
+
+StreamId Stream::Id() const {
+  return id_;
+}
+
+ConnectionPtr Stream::Connection() const {
+  return connection_.lock();
+}
+
+bool Stream::Send(const std::string& message) {
+  auto conn = connection_.lock();
+  return conn && conn->SendOnStream(id_, message);
+}
+
+void Stream::Close() {
+  auto conn = connection_.lock();
+  if (conn) {
+    conn->CloseStream(id_);
+  }
+}
+
+StreamScheduler::StreamScheduler() {}
+
+void StreamScheduler::Push(
+  uint64_t stream, const std::shared_ptr<const std::string>& frames) {
+  auto& queue = queues_[stream];
+  if (queue.empty()) {
+    turns_.push_back(stream);
+  }
+  queue.push_back(frames);
+}
+
+bool StreamScheduler::Pop(std::shared_ptr<const std::string>* frames) {
+  if (turns_.empty()) {
+    return false;
+  }
+  auto stream = turns_.front();
+  turns_.pop_front();
+  auto it = queues_.find(stream);
+  frames->swap(it->second.front());
+  it->second.pop_front();
+  // Back in line behind the others, or forgotten until it sends again.
+  if (it->second.empty()) {
+    queues_.erase(it);
+  } else {
+    turns_.push_back(stream);
+  }
+  return true;
+}
+
+bool StreamScheduler::Empty() const {
+  return turns_.empty();
+}
+
+}  // namespace interprocess
@@ -0,0 +1,72 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef INTERPROCESS_STREAM_H_
+#define INTERPROCESS_STREAM_H_
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "interprocess/types.h"
+
+namespace interprocess {
+
+// Logical stream over a connection, see Connection::OpenStream(). Its
+// messages arrive in the order they were sent, and only to its own
+// callback. Either side may send on it and close it, for both sides; a
+// message the peer sent before it learned of the close is dropped, or
+// opens the stream anew if the peer opened it.
+class Stream {
+ public:
+  Stream(const Stream&) = delete;
+  Stream& operator=(const Stream&) = delete;
+  StreamId Id() const;
+  // Null once the connection is gone.
+  ConnectionPtr Connection() const;
+  // Returns false if the stream is closed, or if the send queue of the
+  // connection was full and the overflow policy refused the message.
+  bool Send(const std::string& message);
+  void Close();
+
+ private:
+  friend class Connection;
+  Stream(
+    StreamId id,
+    const std::weak_ptr<interprocess::Connection>& connection,
+    const StreamMessageCallback& cb);
+
+  const StreamId id_;
+  const std::weak_ptr<interprocess::Connection> connection_;
+  const StreamMessageCallback message_callback_;
+};
+
+// Write scheduling of the streams of a connection, on its loop thread.
+// Streams with messages waiting take turns, a message each, so that one
+// sending a lot does not hold back the others.
+class StreamScheduler {
+ public:
+  StreamScheduler();
+  StreamScheduler(const StreamScheduler&) = delete;
+  StreamScheduler& operator=(const StreamScheduler&) = delete;
+  // Queues |frames| behind the messages of |stream| not yet taken.
+  void Push(uint64_t stream, const std::shared_ptr<const std::string>& frames);
+  // Takes the next message of the stream whose turn it is. Returns false if
+  // none is waiting.
+  bool Pop(std::shared_ptr<const std::string>* frames);
+  bool Empty() const;
+
+ private:
+  typedef std::deque<std::shared_ptr<const std::string>> Queue;
+
+  std::unordered_map<uint64_t, Queue> queues_;
+  std::deque<uint64_t> turns_;
+};
+
+}  // namespace interprocess
+
+#endif  // INTERPROCESS_STREAM_H_
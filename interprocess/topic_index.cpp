@@ -0,0 +1,143 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#include "interprocess/topic_index.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace interprocess {
+
+namespace {
+
+// Splits |pattern| into the path of its node and whether it is a prefix.
+bool IsPrefix(const std::string& pattern, size_t* length) {
+  auto prefix = !pattern.empty() && pattern.back() == '*';
+  *length = pattern.size() - (prefix ? 1 : 0);
+  return prefix;
+}
+
+}  // namespace
+
+TopicIndex::TopicIndex()
+  : size_(0) {}
+
+TopicIndex::~TopicIndex() {}
+
+bool TopicIndex::Subscribe(Id id, const std::string& pattern) {
+  size_t length = 0;
+  auto prefix = IsPrefix(pattern, &length);
+  auto node = &root_;
+  for (size_t i = 0; i < length; ++i) {
+    auto& child = node->children[pattern[i]];
+    if (!child) {
+      child.reset(new Node);
+    }
+    node = child.get();
+  }
+  auto& ids = prefix ? node->prefix : node->exact;
+  if (std::find(std::begin(ids), std::end(ids), id) != std::end(ids)) {
+    return false;
+  }
+  ids.push_back(id);
+  patterns_[id].push_back(pattern);
+  ++size_;
+  return true;
+}
+
+bool TopicIndex::Unsubscribe(Id id, const std::string& pattern) {
+  if (!Detach(id, pattern)) {
+    return false;
+  }
+  auto it = patterns_.find(id);
+  auto& patterns = it->second;
+  patterns.erase(std::find(std::begin(patterns), std::end(patterns), pattern));
+  if (patterns.empty()) {
+    patterns_.erase(it);
+  }
+  return true;
+}
+
+void TopicIndex::Remove(Id id) {
+  auto it = patterns_.find(id);
+  if (it == std::end(patterns_)) {
+    return;
+  }
+  std::for_each(std::begin(it->second),
+                std::end(it->second),
+                [this, id](const std::string& pattern) {
+    Detach(id, pattern);
+  });
+  patterns_.erase(it);
+}
+
+void TopicIndex::Match(const std::string& topic, std::vector<Id>* ids) const {
+  auto first = ids->size();
+  auto lists = 0;
+  auto node = &root_;
+  for (size_t i = 0; node; ++i) {
+    if (!node->prefix.empty()) {
+      ids->insert(std::end(*ids), std::begin(node->prefix),
+                  std::end(node->prefix));
+      ++lists;
+    }
+    if (i == topic.size()) {
+      if (!node->exact.empty()) {
+        ids->insert(std::end(*ids), std::begin(node->exact),
+                    std::end(node->exact));
+        ++lists;
+      }
+      break;
+    }
+    auto it = node->children.find(topic[i]);
+    node = it == std::end(node->children) ? nullptr : it->second.get();
+  }
+  // Each list holds an id once, only several lists can repeat it.
+  if (lists > 1) {
+    auto begin = std::begin(*ids) + first;
+    std::sort(begin, std::end(*ids));
+    ids->erase(std::unique(begin, std::end(*ids)), std::end(*ids));
+  }
+}
+
+size_t TopicIndex::Size() const {
+  return size_;
+}
+
+bool TopicIndex::Detach(Id id, const std::string& pattern) {
+  size_t length = 0;
+  auto prefix = IsPrefix(pattern, &length);
+  std::vector<Node*> path(1, &root_);
+  for (size_t i = 0; i < length; ++i) {
+    auto it = path.back()->children.find(pattern[i]);
+    if (it == std::end(path.back()->children)) {
+      return false;
+    }
+    path.push_back(it->second.get());
+  }
+  auto& ids = prefix ? path.back()->prefix : path.back()->exact;
+  auto it = std::find(std::begin(ids), std::end(ids), id);
+  if (it == std::end(ids)) {
+    return false;
+  }
+  // Order does not matter, the last one takes its place.
+  *it = ids.back();
+  ids.pop_back();
+  --size_;
+
+  // Nodes left without subscribers or children are pruned bottom up.
+  for (auto i = length; i > 0; --i) {
+    auto node = path[i];
+    if (!node->children.empty() || !node->exact.empty() ||
+        !node->prefix.empty()) {
+      break;
+    }
+    path[i - 1]->children.erase(pattern[i - 1]);
+  }
+  return true;
+}
+
+}  // namespace interprocess
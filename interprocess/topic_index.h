@@ -0,0 +1,61 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef INTERPROCESS_TOPIC_INDEX_H_
+#define INTERPROCESS_TOPIC_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace interprocess {
+
+// Subscriptions of connections to topics, in a trie keyed by the characters
+// of the topic. A pattern ending with '*' subscribes to every topic starting
+// with what precedes it; matching a topic walks its path once and collects
+// the prefix subscribers met on the way and the exact ones at its end, so
+// its cost depends on the length of the topic and the number of matches,
+// not on how many topics there are.
+class TopicIndex {
+ public:
+  typedef uint64_t Id;
+
+  TopicIndex();
+  TopicIndex(const TopicIndex&) = delete;
+  TopicIndex& operator=(const TopicIndex&) = delete;
+  ~TopicIndex();
+  // Returns false if |id| was subscribed to |pattern| already.
+  bool Subscribe(Id id, const std::string& pattern);
+  // Returns false if |id| was not subscribed to |pattern|.
+  bool Unsubscribe(Id id, const std::string& pattern);
+  // Drops every subscription of |id|.
+  void Remove(Id id);
+  // Appends the subscribers of |topic| to |ids|, each one once.
+  void Match(const std::string& topic, std::vector<Id>* ids) const;
+  // Number of subscriptions.
+  size_t Size() const;
+
+ private:
+  struct Node {
+    std::map<char, std::unique_ptr<Node>> children;
+    std::vector<Id> exact;
+    std::vector<Id> prefix;
+  };
+  // Takes |id| out of the node of |pattern|, without the bookkeeping.
+  bool Detach(Id id, const std::string& pattern);
+
+  Node root_;
+  std::unordered_map<Id, std::vector<std::string>> patterns_;
+  size_t size_;
+};
+
+}  // namespace interprocess
+
+#endif  // INTERPROCESS_TOPIC_INDEX_H_
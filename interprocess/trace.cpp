@@ -0,0 +1,137 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#include "interprocess/trace.h"
+#include <windows.h>
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace interprocess {
+
+namespace {
+
+// Rings outlive their threads, the events of a thread that has exited are
+// still exported.
+std::mutex rings_mutex;
+std::vector<std::unique_ptr<TraceRing>> rings;
+
+__declspec(thread) TraceRing* thread_ring = nullptr;
+
+TraceRing* ThreadRing() {
+  if (!thread_ring) {
+    std::unique_ptr<TraceRing> ring(new TraceRing);
+    std::unique_lock<std::mutex> lock(rings_mutex);
+    thread_ring = ring.get();
+    rings.push_back(std::move(ring));
+  }
+  return thread_ring;
+}
+
+}  // namespace
+
+std::atomic<bool> Tracer::enabled_(false);
+
+TraceRing::TraceRing()
+  : events_(kTraceRingSize),
+    position_(0),
+    thread_id_(GetCurrentThreadId()) {}
+
+void TraceRing::Record(
+  const char* name, char phase, uint64_t id, int64_t time) {
+  auto position = position_.load(std::memory_order_relaxed);
+  auto& event = events_[position & (kTraceRingSize - 1)];
+  event.time = time;
+  event.name = name;
+  event.id = id;
+  event.phase = phase;
+  position_.store(position + 1, std::memory_order_release);
+}
+
+void TraceRing::Snapshot(std::vector<TraceEvent>* events) const {
+  uint64_t size = kTraceRingSize;
+  auto end = position_.load(std::memory_order_acquire);
+  auto begin = end > size ? end - size : 0;
+  std::vector<TraceEvent> copied;
+  copied.reserve(static_cast<size_t>(end - begin));
+  for (auto i = begin; i < end; ++i) {
+    copied.push_back(events_[i & (size - 1)]);
+  }
+  // The event being written now overwrites the one a ring before it.
+  std::atomic_thread_fence(std::memory_order_acquire);
+  auto now = position_.load(std::memory_order_relaxed);
+  auto intact = now + 1 > size ? now + 1 - size : 0;
+  for (auto i = std::max(begin, intact); i < end; ++i) {
+    auto& event = copied[static_cast<size_t>(i - begin)];
+    if (event.name) {
+      events->push_back(event);
+    }
+  }
+}
+
+DWORD TraceRing::ThreadId() const {
+  return thread_id_;
+}
+
+void Tracer::Enable(bool enable) {
+  enabled_ = enable;
+}
+
+void Tracer::Record(const char* name, PhaseE phase, uint64_t id) {
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  ThreadRing()->Record(name, static_cast<char>(phase), id, now.QuadPart);
+}
+
+bool Tracer::Export(const std::string& path) {
+  FILE* file = nullptr;
+  if (fopen_s(&file, path.c_str(), "w") || !file) {
+    return false;
+  }
+  // Timestamps are counted from boot, traces of the server and its clients
+  // taken on the same machine line up.
+  LARGE_INTEGER frequency;
+  QueryPerformanceFrequency(&frequency);
+  auto ticks_per_us = frequency.QuadPart / 1e6;
+  auto pid = GetCurrentProcessId();
+  const char* separator = "";
+  fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  std::unique_lock<std::mutex> lock(rings_mutex);
+  std::vector<TraceEvent> events;
+  std::for_each(std::begin(rings),
+                std::end(rings),
+                [&](const std::unique_ptr<TraceRing>& ring) {
+    events.clear();
+    ring->Snapshot(&events);
+    std::for_each(std::begin(events),
+                  std::end(events),
+                  [&](const TraceEvent& event) {
+      fprintf(file,
+              "%s\n{\"name\":\"%s\",\"cat\":\"interprocess\",\"ph\":\"%c\","
+              "\"ts\":%.3f,\"pid\":%lu,\"tid\":%lu",
+              separator,
+              event.name,
+              event.phase,
+              event.time / ticks_per_us,
+              pid,
+              ring->ThreadId());
+      if (event.phase == ASYNC_BEGIN || event.phase == ASYNC_END) {
+        fprintf(file, ",\"id\":\"%llu\"", event.id);
+      } else if (event.phase == INSTANT) {
+        fprintf(file, ",\"s\":\"t\"");
+      }
+      fprintf(file, ",\"args\":{\"id\":\"%llu\"}}", event.id);
+      separator = ",";
+    });
+  });
+  fprintf(file, "\n]}\n");
+  return fclose(file) == 0;
+}
+
+}  // namespace interprocess
@@ -0,0 +1,82 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef INTERPROCESS_TRACE_H_
+#define INTERPROCESS_TRACE_H_
+
+#include <windows.h>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "interprocess/types.h"
+
+namespace interprocess {
+
+struct TraceEvent {
+  int64_t time;
+  const char* name;
+  uint64_t id;
+  char phase;
+};
+
+// Events of one thread, the last kTraceRingSize of them. Only its own
+// thread writes to it, Snapshot() may run on any thread meanwhile and
+// leaves out the events overwritten while it copied them.
+class TraceRing {
+ public:
+  TraceRing();
+  TraceRing(const TraceRing&) = delete;
+  TraceRing& operator=(const TraceRing&) = delete;
+  void Record(const char* name, char phase, uint64_t id, int64_t time);
+  void Snapshot(std::vector<TraceEvent>* events) const;
+  DWORD ThreadId() const;
+
+ private:
+  std::vector<TraceEvent> events_;
+  std::atomic<uint64_t> position_;
+  const DWORD thread_id_;
+};
+
+// Timestamped events of the hot path, to tell where a message spent its
+// time. Off by default, an event then costs a relaxed load and a branch.
+// Each thread records into a ring of its own, allocated the first time it
+// records, so threads never contend. |name| must be a string literal.
+class Tracer {
+ public:
+  // Phases of the Chrome trace event format. Async events pair up by
+  // name and id across threads, the others nest on their own thread.
+  enum PhaseE {
+    INSTANT = 'i',
+    BEGIN = 'B',
+    END = 'E',
+    ASYNC_BEGIN = 'b',
+    ASYNC_END = 'e',
+  };
+  static bool Enabled() {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+  static void Enable(bool enable);
+  static void Record(const char* name, PhaseE phase, uint64_t id);
+  // Writes the events of every thread to |path| as Chrome trace JSON, for
+  // chrome://tracing or Perfetto. Returns false if it cannot be written.
+  static bool Export(const std::string& path);
+
+ private:
+  static std::atomic<bool> enabled_;
+};
+
+}  // namespace interprocess
+
+#define INTERPROCESS_TRACE(name, phase, id)                         \
+  do {                                                              \
+    if (::interprocess::Tracer::Enabled()) {                        \
+      ::interprocess::Tracer::Record(                               \
+        name, ::interprocess::Tracer::phase, id);                   \
+    }                                                               \
+  } while (0)
+
+#endif  // INTERPROCESS_TRACE_H_
@@ -0,0 +1,46 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#include "interprocess/typed.h"
+#include <windows.h>
+#include <memory>
+#include "interprocess/connection.h"
+
+namespace interprocess {
+
+bool ReadTypedHeader(const Message& message, TypedHeader* header) {
+  if (message.Size() < sizeof *header) {
+    return false;
+  }
+  CopyMemory(header, message.Data(), sizeof *header);
+  return true;
+}
+
+void MessageDispatcher::OnReject(const MessageViewCallback& cb) {
+  reject_ = cb;
+}
+
+MessageViewCallback MessageDispatcher::Callback() const {
+  auto handlers = std::make_shared<const HandlerMap>(handlers_);
+  auto reject = reject_;
+  MessageViewCallback callback = [handlers, reject](
+    const ConnectionPtr& conn, const Message& message) {
+    TypedHeader header;
+    auto handler = ReadTypedHeader(message, &header) ?
+      handlers->find(header.tag) : std::end(*handlers);
+    if (handler != std::end(*handlers) && handler->second(conn, message)) {
+      return;
+    }
+    if (reject) {
+      reject(conn, message);
+    } else {
+      conn->Close();
+    }
+  };
+  return callback;
+}
+
+}  // namespace interprocess
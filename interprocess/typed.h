@@ -0,0 +1,141 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef INTERPROCESS_TYPED_H_
+#define INTERPROCESS_TYPED_H_
+
+#include <windows.h>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include "interprocess/buffer.h"
+#include "interprocess/message.h"
+#include "interprocess/types.h"
+
+namespace interprocess {
+
+// A typed message is this header followed by the bytes of the value, so
+// both peers must be built from the same declaration of the type for the
+// same architecture. The tag names the type, the version and the size tell
+// a peer built from another declaration of it. The header keeps the value
+// on a kFrameAlignment boundary of the payload.
+struct TypedHeader {
+  uint32_t tag;
+  uint32_t version;
+  uint32_t size;
+  uint32_t reserved;
+};
+
+// Wire identity of a type, declared with INTERPROCESS_TYPED_MESSAGE.
+template <typename T>
+struct MessageTraits {
+  static const bool kTyped = false;
+};
+
+// Returns false if |message| is too short to be a typed message.
+bool ReadTypedHeader(const Message& message, TypedHeader* header);
+
+template <typename T>
+std::string TypedPayload(const T& value) {
+  static_assert(MessageTraits<T>::kTyped,
+                "declare the type with INTERPROCESS_TYPED_MESSAGE");
+  static_assert(std::is_trivially_copyable<T>::value,
+                "a typed message is sent byte for byte");
+  TypedHeader header = {
+    MessageTraits<T>::kTag,
+    MessageTraits<T>::kVersion,
+    sizeof value,
+    0,
+  };
+  std::string payload;
+  payload.reserve(sizeof header + sizeof value);
+  payload.append(reinterpret_cast<const char*>(&header), sizeof header);
+  payload.append(reinterpret_cast<const char*>(&value), sizeof value);
+  return payload;
+}
+
+// Encoded once, for Server::Broadcast() and Server::Publish().
+template <typename T>
+Buffer TypedBuffer(const T& value) {
+  return Buffer(TypedPayload(value));
+}
+
+// Points at the value of |message| in the receive buffer when it is aligned
+// for T, or copies it into |*copy| otherwise. Payloads are aligned to
+// kFrameAlignment, so a type aligned to no more than that is read in place.
+// Returns nullptr if |message| is not a T of the same version and size.
+template <typename T>
+const T* MessageCast(const Message& message, T* copy) {
+  TypedHeader header;
+  if (!ReadTypedHeader(message, &header) ||
+      header.tag != MessageTraits<T>::kTag ||
+      header.version != MessageTraits<T>::kVersion ||
+      header.size != sizeof(T) ||
+      message.Size() != sizeof header + sizeof(T)) {
+    return nullptr;
+  }
+  auto value = message.Data() + sizeof header;
+  if (reinterpret_cast<uintptr_t>(value) % std::alignment_of<T>::value) {
+    CopyMemory(copy, value, sizeof(T));
+    return copy;
+  }
+  return reinterpret_cast<const T*>(value);
+}
+
+// Message view callback handing typed messages to the handler of their
+// type. A message of no registered type, or of another version or size of
+// it, is rejected: it goes to the reject callback, or the connection is
+// closed if there is none.
+class MessageDispatcher {
+ public:
+  template <typename T>
+  void OnMessage(
+    const std::function<void(const ConnectionPtr&, const T&)>& handler) {
+    const uint32_t tag = MessageTraits<T>::kTag;
+    handlers_[tag] = [handler](
+      const ConnectionPtr& conn, const Message& message) {
+      // Only used when the value is not aligned in the receive buffer.
+      typename std::aligned_storage<
+        sizeof(T), std::alignment_of<T>::value>::type copy;
+      auto value = MessageCast<T>(message, reinterpret_cast<T*>(&copy));
+      if (!value) {
+        return false;
+      }
+      handler(conn, *value);
+      return true;
+    };
+  }
+  void OnReject(const MessageViewCallback& cb);
+  // The callback to install on a server or a client. Handlers registered
+  // after it was made are not part of it.
+  MessageViewCallback Callback() const;
+
+ private:
+  typedef std::function<bool(const ConnectionPtr&, const Message&)> Handler;
+  typedef std::unordered_map<uint32_t, Handler> HandlerMap;
+
+  HandlerMap handlers_;
+  MessageViewCallback reject_;
+};
+
+}  // namespace interprocess
+
+// Declares |type| as a typed message, at global scope. |tag| must be unique
+// among the types a connection carries, |version| changes with the layout.
+#define INTERPROCESS_TYPED_MESSAGE(type, tag, version)              \
+  namespace interprocess {                                          \
+  template <>                                                       \
+  struct MessageTraits<type> {                                      \
+    static const bool kTyped = true;                                \
+    static const uint32_t kTag = tag;                               \
+    static const uint32_t kVersion = version;                       \
+  };                                                                \
+  }
+
+#endif  // INTERPROCESS_TYPED_H_
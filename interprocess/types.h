@@ -9,10 +9,13 @@
 
 #include <windows.h>
 #include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <exception>
 #include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 #include "interprocess/unique_handle.h"
 
 namespace interprocess {
@@ -20,7 +23,8 @@ namespace interprocess {
 class ScopeGuard {
  public:
   explicit ScopeGuard(std::function<void()> on_exit_scope)
-    : on_exit_scope_(on_exit_scope) {}
+    : on_exit_scope_(on_exit_scope),
+      dismissed_(false) {}
   ScopeGuard(const ScopeGuard&) = delete;
   ScopeGuard& operator=(const ScopeGuard&) = delete;
   ~ScopeGuard() {
@@ -45,15 +49,46 @@ class ScopeGuard {
 
 class Connection;
 
+class EventLoop;
+
+class Message;
+
+class Stream;
+
 typedef std::shared_ptr<Connection> ConnectionPtr;
 
-typedef std::function<void(HANDLE, HANDLE, HANDLE)> NewConnectionCallback;
+typedef std::shared_ptr<Stream> StreamPtr;
+
+// The high bit is set on the ids of the streams the peer opened. Never 0.
+typedef uint32_t StreamId;
+
+// Generation-tagged slot id, see SlotMap. Never 0.
+typedef uint64_t ConnectionId;
+
+typedef std::function<void(HANDLE, EventLoop*)> NewConnectionCallback;
 
 typedef std::function<void(const ConnectionPtr&)> CloseCallback;
 
 typedef
 std::function<void(const ConnectionPtr&, const std::string&)> MessageCallback;
 
+typedef
+std::function<void(const ConnectionPtr&, const Message&)> MessageViewCallback;
+
+typedef std::function<void(
+  const ConnectionPtr&, const std::vector<Message>&)> BatchMessageCallback;
+
+typedef
+std::function<void(const StreamPtr&, const Message&)> StreamMessageCallback;
+
+// A broadcast subscriber fell more than a ring behind and skipped messages.
+typedef std::function<void()> LappedCallback;
+
+// The send queue of the connection crossed a water mark, |queued| bytes are
+// waiting in it.
+typedef
+std::function<void(const ConnectionPtr&, size_t queued)> WaterMarkCallback;
+
 class ConnectionExcepton : public std::exception {
  public:
   explicit ConnectionExcepton(const char* what_arg)
@@ -67,17 +102,187 @@ class ConnectionExcepton : public std::exception {
   }
 };
 
+// The reply of a transaction did not arrive before its deadline.
+class TimeoutException : public ConnectionExcepton {
+ public:
+  explicit TimeoutException(const char* what_arg)
+    : ConnectionExcepton(what_arg) {}
+};
+
+// The connection closed while a transaction was waiting for its reply.
+class DisconnectedException : public ConnectionExcepton {
+ public:
+  explicit DisconnectedException(const char* what_arg)
+    : ConnectionExcepton(what_arg) {}
+};
+
+// The send queue was full and the overflow policy refused the message.
+class OverflowException : public ConnectionExcepton {
+ public:
+  explicit OverflowException(const char* what_arg)
+    : ConnectionExcepton(what_arg) {}
+};
+
 typedef std::function<void(const std::exception_ptr&)> ExceptionCallback;
 
 static const int kTimeout = 5000;
 
 static const int kBufferSize = 4096;
 
-inline void raise() {
+static const int kPacketSize = 16 * kBufferSize;
+
+static const int kSharedRingSize = 64 * kBufferSize;
+
+static const int kBroadcastRingSize = 256 * kBufferSize;
+
+// Subscribers a broadcast ring wakes, at most.
+static const int kBroadcastSubscribers = 64;
+
+static const int kCompletionBatch = 64;
+
+static const int kMessageBatch = 256;
+
+static const int kTraceRingSize = 4 * kBufferSize;
+
+// Shorter messages are never compressed.
+static const int kMinCompressedSize = 256;
+
+// Session messages a peer receives before it acknowledges them.
+static const int kSessionAckInterval = 64;
+
+// How long a server keeps the session of a client gone, in milliseconds.
+static const int kSessionLinger = 60 * 1000;
+
+enum TransportE {
+  NAMED_PIPE,
+  SHARED_MEMORY,
+};
+
+// What a send does when the queue is full.
+enum OverflowE {
+  // Waits for room. Sends from the loop thread are queued regardless.
+  OVERFLOW_BLOCK,
+  // Returns false without queueing the message.
+  OVERFLOW_FAIL,
+  // Queues the message, the loop drops the oldest ones not yet being
+  // written until the queue fits again. Session and control messages are
+  // never dropped.
+  OVERFLOW_DROP_OLDEST,
+  // Closes the connection at once, discarding what is queued.
+  OVERFLOW_DISCONNECT,
+};
+
+// Bounds of the send queue of a connection, in encoded bytes and messages,
+// 0 meaning unbounded. A message counts until the pipe or the ring takes it.
+// A message larger than |max_bytes| is let into an empty queue. Concurrent
+// senders may overshoot a bound by a message each.
+// Both water mark callbacks run on the loop thread: the high one once a
+// send made the queue reach |high_water_mark|, the low one once the queue
+// drained down to |low_water_mark| after that.
+struct SendLimits {
+  SendLimits()
+    : max_bytes(0),
+      max_messages(0),
+      high_water_mark(0),
+      low_water_mark(0),
+      overflow(OVERFLOW_FAIL) {}
+
+  size_t max_bytes;
+  size_t max_messages;
+  size_t high_water_mark;
+  size_t low_water_mark;
+  OverflowE overflow;
+};
+
+// Coalescing of the sends of a connection. A message that finds the queue
+// idle is held for up to |delay|, along with whatever is sent after it,
+// until |bytes| are queued or Connection::Flush() is called; the batch then
+// goes out in as few writes as it fits in. A zero delay, the default, wakes
+// the loop for every message found idle.
+struct SendBatching {
+  SendBatching()
+    : delay(0),
+      bytes(kPacketSize) {}
+
+  std::chrono::microseconds delay;
+  size_t bytes;
+};
+
+// Backoff of a client connecting again after its connection broke: the
+// first attempt after |initial|, every next one after twice as long, up to
+// |maximum|. Each wait is drawn at random from the upper half of its
+// backoff, so that clients dropped together do not come back together.
+// The backoff starts over from |initial| only after a connection that
+// stayed up for |maximum|.
+struct ReconnectPolicy {
+  ReconnectPolicy()
+    : initial(10),
+      maximum(5000) {}
+
+  std::chrono::milliseconds initial;
+  std::chrono::milliseconds maximum;
+};
+
+// Counters of a connection since it was made, and the state of its send
+// queue. Bytes are counted as encoded on the wire, frame headers included.
+// Each counter is read on its own while I/O goes on, they need not add up
+// exactly with each other.
+struct ConnectionStats {
+  ConnectionStats()
+    : id(0),
+      messages_in(0),
+      bytes_in(0),
+      messages_out(0),
+      bytes_out(0),
+      messages_dropped(0),
+      messages_compressed(0),
+      writes(0),
+      transact_timeouts(0),
+      queued_bytes(0),
+      queued_messages(0),
+      queued_bytes_peak(0) {}
+
+  ConnectionId id;
+  uint64_t messages_in;
+  uint64_t bytes_in;
+  // Handed to the pipe or the shared memory ring.
+  uint64_t messages_out;
+  uint64_t bytes_out;
+  // Dropped from the send queue by OVERFLOW_DROP_OLDEST.
+  uint64_t messages_dropped;
+  // Sent compressed, counted in |messages_out| too.
+  uint64_t messages_compressed;
+  uint64_t writes;
+  uint64_t transact_timeouts;
+  size_t queued_bytes;
+  size_t queued_messages;
+  size_t queued_bytes_peak;
+};
+
+// Counters of a server since it started listening. |totals| adds up the
+// counters of every connection, closed ones included, its queue figures
+// are those of the open connections, the peak being the highest of them.
+struct ServerStats {
+  ServerStats()
+    : accepted(0),
+      disconnected(0),
+      connections(0) {}
+
+  uint64_t accepted;
+  uint64_t disconnected;
+  size_t connections;
+  ConnectionStats totals;
+};
+
+// What raise() throws, for errors handed to an exception callback instead.
+inline std::exception_ptr last_error() {
   auto msg = std::string("ConnectionExcepton GetLastError = ");
   msg.append(std::to_string(GetLastError()));
-  std::rethrow_exception(
-    std::make_exception_ptr(ConnectionExcepton(msg)));
+  return std::make_exception_ptr(ConnectionExcepton(msg));
+}
+
+inline void raise() {
+  std::rethrow_exception(last_error());
 }
 
 template<typename Predicate>
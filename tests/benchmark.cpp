@@ -0,0 +1,879 @@
+//  Copyright 2014, bitdewy@gmail.com
+//  Distributed under the Boost Software License, Version 1.0.
+//  You may obtain a copy of the License at
+//
+//  http://www.boost.org/LICENSE_1_0.txt
+
+// Usage: benchmark [--json <file>] [--trace <file>] [group...]
+// Runs the groups whose name contains one of the arguments, all of them by
+// default, and writes every result as a JSON object per line to <file> for
+// regression tracking. --trace records the hot path events of the run and
+// writes the last of them as a Chrome trace. Exits with 1 if any benchmark
+// could not run.
+
+#include <windows.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "interprocess/client.h"
+#include "interprocess/compress.h"
+#include "interprocess/connection.h"
+#include "interprocess/event_loop.h"
+#include "interprocess/server.h"
+#include "interprocess/topic_index.h"
+#include "interprocess/trace.h"
+#include "tests/histogram.h"
+
+namespace {
+
+const int kWarmupRounds = 1000;
+const int kRounds = 100000;
+const int kTransactRounds = 20000;
+const size_t kThroughputBytes = 256 * 1024 * 1024;
+const size_t kThroughputMessages = 1000000;
+const int kFanInClients = 32;
+const int kFanInMessages = 20000;
+const int kContentionMessages = 640000;
+const int kFanOutMessages = 10000;
+const int kTopicMatches = 1000000;
+const int kTopicMessages = 20000;
+const int kConnects = 1000;
+const int kCodecRounds = 2000;
+const size_t kCompressedBytes = 64 * 1024 * 1024;
+
+uint64_t Nanoseconds() {
+  static LARGE_INTEGER frequency = [] {
+    LARGE_INTEGER f;
+    QueryPerformanceFrequency(&f);
+    return f;
+  }();
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  return static_cast<uint64_t>(now.QuadPart * 1e9 / frequency.QuadPart);
+}
+
+// A named number, a parameter or a measurement of a benchmark.
+struct Field {
+  template <typename T>
+  Field(const char* key, T value)
+    : key(key),
+      value(static_cast<double>(value)) {}
+
+  const char* key;
+  double value;
+};
+
+typedef std::vector<Field> Fields;
+
+// Prints every result as it comes, and keeps it as a line of JSON.
+class Report {
+ public:
+  Report()
+    : failures_(0) {}
+
+  void Add(
+    const std::string& name,
+    const Fields& params,
+    const benchmark::Histogram* latency,
+    const Fields& values) {
+    auto line = std::string("{\"name\":\"").append(name).append("\"");
+    printf("%-24s", name.c_str());
+    std::for_each(std::begin(params), std::end(params), [&](const Field& f) {
+      printf(" %s=%g", f.key, f.value);
+      Append(&line, f);
+    });
+    Fields measured;
+    if (latency) {
+      measured.push_back(Field("p50_us", latency->Percentile(50) / 1e3));
+      measured.push_back(Field("p99_us", latency->Percentile(99) / 1e3));
+      measured.push_back(Field("p999_us", latency->Percentile(99.9) / 1e3));
+      measured.push_back(Field("max_us", latency->Max() / 1e3));
+      measured.push_back(Field("mean_us", latency->Mean() / 1e3));
+    }
+    measured.insert(std::end(measured), std::begin(values), std::end(values));
+    std::for_each(std::begin(measured),
+                  std::end(measured),
+                  [&](const Field& f) {
+      printf("  %s %.6g", f.key, f.value);
+      Append(&line, f);
+    });
+    printf("\n");
+    lines_.push_back(line.append("}"));
+  }
+
+  void Fail(const std::string& name, const char* what) {
+    printf("%-24s FAILED: %s\n", name.c_str(), what);
+    lines_.push_back(std::string("{\"name\":\"").append(name)
+                     .append("\",\"error\":\"").append(what).append("\"}"));
+    ++failures_;
+  }
+
+  bool Write(const std::string& path) const {
+    auto file = fopen(path.c_str(), "w");
+    if (!file) {
+      return false;
+    }
+    std::for_each(std::begin(lines_),
+                  std::end(lines_),
+                  [file](const std::string& line) {
+      fprintf(file, "%s\n", line.c_str());
+    });
+    return fclose(file) == 0;
+  }
+
+  int Failures() const {
+    return failures_;
+  }
+
+ private:
+  static void Append(std::string* line, const Field& field) {
+    char number[32];
+    _snprintf_s(number, _TRUNCATE, "%.9g", field.value);
+    line->append(",\"").append(field.key).append("\":").append(number);
+  }
+
+  std::vector<std::string> lines_;
+  int failures_;
+};
+
+const char* TransportName(interprocess::TransportE transport) {
+  return transport == interprocess::SHARED_MEMORY ? "shared_memory"
+                                                  : "named_pipe";
+}
+
+void StopAll(std::vector<std::unique_ptr<interprocess::Client>>* clients) {
+  std::for_each(std::begin(*clients), std::end(*clients), [](
+    const std::unique_ptr<interprocess::Client>& client) {
+    client->Stop();
+  });
+}
+
+// Ping-pong round trip: the client sends a message, the server echoes it
+// and the client waits for the echo before sending the next one.
+void PingPong(
+  Report* report,
+  const std::string& endpoint,
+  interprocess::TransportE transport,
+  size_t size) {
+  auto name = std::string("ping_pong/").append(TransportName(transport));
+  interprocess::Server server(endpoint, transport);
+  server.SetMessageCallback([](
+    const interprocess::ConnectionPtr& conn, const std::string& message) {
+    conn->Send(message);
+  });
+  server.Listen();
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  int received = 0;
+  interprocess::Client client("benchmark", transport);
+  client.SetMessageCallback([&](
+    const interprocess::ConnectionPtr&, const std::string&) {
+    std::unique_lock<std::mutex> lock(mutex);
+    ++received;
+    cond.notify_one();
+  });
+  if (!client.Connect(endpoint, 1000)) {
+    report->Fail(name, "connect failed");
+    server.Stop();
+    return;
+  }
+
+  auto conn = client.Connection();
+  auto message = std::string(size, 'x');
+  benchmark::Histogram latency;
+  for (int i = 0; i < kWarmupRounds + kRounds; ++i) {
+    auto start = Nanoseconds();
+    conn->Send(message);
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [&] { return received == i + 1; });
+    if (i >= kWarmupRounds) {
+      latency.Record(Nanoseconds() - start);
+    }
+  }
+  report->Add(name, { Field("size", size) }, &latency, Fields());
+
+  client.Stop();
+  server.Stop();
+}
+
+// One-way throughput: the client sends as fast as it can, the server only
+// counts. The clock stops when the last message has arrived.
+void OneWay(
+  Report* report,
+  const std::string& endpoint,
+  interprocess::TransportE transport,
+  size_t size) {
+  auto name = std::string("throughput/").append(TransportName(transport));
+  std::atomic<int> received(0);
+  interprocess::Server server(endpoint, transport);
+  server.SetMessageViewCallback([&](
+    const interprocess::ConnectionPtr&, const interprocess::Message&) {
+    ++received;
+  });
+  server.Listen();
+
+  interprocess::Client client("throughput", transport);
+  if (!client.Connect(endpoint, 1000)) {
+    report->Fail(name, "connect failed");
+    server.Stop();
+    return;
+  }
+
+  auto conn = client.Connection();
+  auto message = std::string(size, 'x');
+  auto count = static_cast<int>(
+    std::min(kThroughputBytes / size, kThroughputMessages));
+  auto start = Nanoseconds();
+  for (int i = 0; i < count; ++i) {
+    conn->Send(message);
+  }
+  while (received < count) {
+    std::this_thread::yield();
+  }
+  auto seconds = (Nanoseconds() - start) / 1e9;
+  report->Add(name, { Field("size", size) }, nullptr, {
+    Field("messages_per_s", count / seconds),
+    Field("mb_per_s", count * size / seconds / (1024 * 1024)),
+  });
+
+  client.Stop();
+  server.Stop();
+}
+
+// Log lines of JSON, about as repetitive as the messages worth compressing.
+std::string JsonPayload(size_t size) {
+  std::string payload;
+  for (int i = 0; payload.size() < size; ++i) {
+    payload.append("{\"seq\":").append(std::to_string(i))
+      .append(",\"level\":\"info\",\"source\":\"worker-")
+      .append(std::to_string(i % 7))
+      .append("\",\"text\":\"request served\"}\n");
+  }
+  payload.resize(size);
+  return payload;
+}
+
+// Codec cost: compresses and decompresses the same payload over and over.
+void Codec(Report* report, size_t size) {
+  auto payload = JsonPayload(size);
+  std::string compressed;
+  std::string decompressed;
+  auto start = Nanoseconds();
+  for (int i = 0; i < kCodecRounds; ++i) {
+    interprocess::Compress(payload.data(), payload.size(), &compressed);
+  }
+  auto compress_seconds = (Nanoseconds() - start) / 1e9;
+  start = Nanoseconds();
+  for (int i = 0; i < kCodecRounds; ++i) {
+    interprocess::Decompress(
+      compressed.data(), compressed.size(), &decompressed);
+  }
+  auto decompress_seconds = (Nanoseconds() - start) / 1e9;
+  if (decompressed != payload) {
+    report->Fail("compression/codec", "round trip mismatch");
+    return;
+  }
+  auto megabytes = kCodecRounds * size / (1024.0 * 1024);
+  report->Add("compression/codec", { Field("size", size) }, nullptr, {
+    Field("ratio", static_cast<double>(compressed.size()) / size),
+    Field("compress_mb_per_s", megabytes / compress_seconds),
+    Field("decompress_mb_per_s", megabytes / decompress_seconds),
+  });
+}
+
+// Bytes saved against the CPU spent: one way throughput of JSON messages
+// with compression off, and on at both ends.
+void Compressed(
+  Report* report,
+  const std::string& endpoint,
+  interprocess::TransportE transport,
+  size_t size,
+  bool compress) {
+  auto name = std::string(compress ? "compression/on/" : "compression/off/")
+    .append(TransportName(transport));
+  auto threshold = compress ? interprocess::kMinCompressedSize : 0;
+  std::atomic<int> received(0);
+  interprocess::Server server(endpoint, transport);
+  server.SetCompressionThreshold(threshold);
+  server.SetMessageViewCallback([&](
+    const interprocess::ConnectionPtr&, const interprocess::Message&) {
+    ++received;
+  });
+  server.Listen();
+
+  interprocess::Client client("compression", transport);
+  client.SetCompressionThreshold(threshold);
+  if (!client.Connect(endpoint, 1000)) {
+    report->Fail(name, "connect failed");
+    server.Stop();
+    return;
+  }
+
+  auto conn = client.Connection();
+  auto message = JsonPayload(size);
+  auto count = static_cast<int>(kCompressedBytes / size);
+  auto start = Nanoseconds();
+  for (int i = 0; i < count; ++i) {
+    conn->Send(message);
+  }
+  while (received < count) {
+    std::this_thread::yield();
+  }
+  auto seconds = (Nanoseconds() - start) / 1e9;
+  auto stats = conn->Stats();
+  report->Add(name, { Field("size", size) }, nullptr, {
+    Field("messages_per_s", count / seconds),
+    Field("mb_per_s", count * size / seconds / (1024 * 1024)),
+    Field("wire_ratio", static_cast<double>(stats.bytes_out) / count / size),
+    Field("compressed", stats.messages_compressed),
+  });
+
+  client.Stop();
+  server.Stop();
+}
+
+// Tiny messages one way, each sent on its own or held for up to |delay|
+// and written in batches.
+void Batched(
+  Report* report,
+  const std::string& endpoint,
+  interprocess::TransportE transport,
+  std::chrono::microseconds delay) {
+  auto name = std::string(delay.count() ? "batching/on/" : "batching/off/")
+    .append(TransportName(transport));
+  interprocess::SendBatching batching;
+  batching.delay = delay;
+  std::atomic<int> received(0);
+  interprocess::Server server(endpoint, transport);
+  server.SetMessageViewCallback([&](
+    const interprocess::ConnectionPtr&, const interprocess::Message&) {
+    ++received;
+  });
+  server.Listen();
+
+  interprocess::Client client("batching", transport);
+  client.SetSendBatching(batching);
+  if (!client.Connect(endpoint, 1000)) {
+    report->Fail(name, "connect failed");
+    server.Stop();
+    return;
+  }
+
+  auto conn = client.Connection();
+  auto message = std::string(16, 'x');
+  auto count = static_cast<int>(kThroughputMessages);
+  auto start = Nanoseconds();
+  for (int i = 0; i < count; ++i) {
+    conn->Send(message);
+  }
+  conn->Flush();
+  while (received < count) {
+    std::this_thread::yield();
+  }
+  auto seconds = (Nanoseconds() - start) / 1e9;
+  auto stats = conn->Stats();
+  report->Add(name, { Field("delay_us", delay.count()) }, nullptr, {
+    Field("messages_per_s", count / seconds),
+    Field("messages_per_write",
+          stats.writes ? static_cast<double>(count) / stats.writes : 0),
+  });
+
+  client.Stop();
+  server.Stop();
+}
+
+// TransactMessage latency: the server answers every request from its
+// message callback, the client waits for each reply in turn.
+void Transact(
+  Report* report,
+  const std::string& endpoint,
+  interprocess::TransportE transport) {
+  auto name = std::string("transact/").append(TransportName(transport));
+  interprocess::Server server(endpoint, transport);
+  server.SetMessageViewCallback([](
+    const interprocess::ConnectionPtr& conn,
+    const interprocess::Message& message) {
+    conn->Reply(message, "reply");
+  });
+  server.Listen();
+
+  interprocess::Client client("transact", transport);
+  if (!client.Connect(endpoint, 1000)) {
+    report->Fail(name, "connect failed");
+    server.Stop();
+    return;
+  }
+
+  auto conn = client.Connection();
+  benchmark::Histogram latency;
+  int failed = 0;
+  for (int i = 0; i < kWarmupRounds + kTransactRounds; ++i) {
+    auto start = Nanoseconds();
+    auto reply = conn->TransactMessage("request");
+    if (reply.empty()) {
+      ++failed;
+    } else if (i >= kWarmupRounds) {
+      latency.Record(Nanoseconds() - start);
+    }
+  }
+  report->Add(name, Fields(), &latency, { Field("failed", failed) });
+
+  client.Stop();
+  server.Stop();
+}
+
+// Fan-in throughput: many clients send as fast as they can to one server,
+// whose worker loops have to keep up with all of them.
+void FanIn(
+  Report* report,
+  const char* variant,
+  const std::string& endpoint,
+  bool batching,
+  int workers) {
+  auto name = std::string("fan_in/").append(variant);
+  interprocess::EventLoop::EnableBatching(batching);
+  std::atomic<int> received(0);
+  interprocess::Server server(endpoint, interprocess::NAMED_PIPE, workers);
+  server.SetMessageViewCallback([&](
+    const interprocess::ConnectionPtr&, const interprocess::Message&) {
+    ++received;
+  });
+  server.Listen();
+
+  std::vector<std::unique_ptr<interprocess::Client>> clients;
+  for (int i = 0; i < kFanInClients; ++i) {
+    clients.emplace_back(new interprocess::Client(std::to_string(i)));
+    if (!clients.back()->Connect(endpoint, 1000)) {
+      report->Fail(name, "connect failed");
+      StopAll(&clients);
+      server.Stop();
+      return;
+    }
+  }
+
+  auto message = std::string(64, 'x');
+  auto start = Nanoseconds();
+  std::vector<std::thread> senders;
+  std::for_each(std::begin(clients), std::end(clients), [&](
+    const std::unique_ptr<interprocess::Client>& client) {
+    auto conn = client->Connection();
+    senders.push_back(std::thread([=] {
+      for (int i = 0; i < kFanInMessages; ++i) {
+        conn->Send(message);
+      }
+    }));
+  });
+  std::for_each(std::begin(senders), std::end(senders), [](std::thread& t) {
+    t.join();
+  });
+  while (received < kFanInClients * kFanInMessages) {
+    std::this_thread::yield();
+  }
+  auto seconds = (Nanoseconds() - start) / 1e9;
+  uint64_t writes = 0;
+  uint64_t messages = 0;
+  std::for_each(std::begin(clients), std::end(clients), [&](
+    const std::unique_ptr<interprocess::Client>& client) {
+    writes += client->Connection()->Writes();
+    messages += client->Connection()->MessagesWritten();
+  });
+  report->Add(name, {
+    Field("clients", kFanInClients),
+    Field("workers", workers),
+  }, nullptr, {
+    Field("messages_per_s", received / seconds),
+    Field("messages_per_write", static_cast<double>(messages) / writes),
+  });
+
+  StopAll(&clients);
+  server.Stop();
+}
+
+// Send contention: producer threads share a single client connection, the
+// server counts what arrives.
+void Contention(Report* report, const std::string& endpoint, int producers) {
+  std::atomic<int> received(0);
+  interprocess::Server server(endpoint);
+  server.SetMessageViewCallback([&](
+    const interprocess::ConnectionPtr&, const interprocess::Message&) {
+    ++received;
+  });
+  server.Listen();
+
+  interprocess::Client client("contention");
+  if (!client.Connect(endpoint, 1000)) {
+    report->Fail("contention", "connect failed");
+    server.Stop();
+    return;
+  }
+
+  auto conn = client.Connection();
+  auto message = std::string(64, 'x');
+  auto count = kContentionMessages / producers;
+  auto start = Nanoseconds();
+  std::vector<std::thread> senders;
+  for (int i = 0; i < producers; ++i) {
+    senders.push_back(std::thread([=] {
+      for (int j = 0; j < count; ++j) {
+        conn->Send(message);
+      }
+    }));
+  }
+  std::for_each(std::begin(senders), std::end(senders), [](std::thread& t) {
+    t.join();
+  });
+  auto queued = (Nanoseconds() - start) / 1e9;
+  while (received < count * producers) {
+    std::this_thread::yield();
+  }
+  auto seconds = (Nanoseconds() - start) / 1e9;
+  report->Add("contention", { Field("producers", producers) }, nullptr, {
+    Field("sends_per_s", count * producers / queued),
+    Field("messages_per_s", received / seconds),
+  });
+
+  client.Stop();
+  server.Stop();
+}
+
+// Fan-out: the server sends every message to all its clients, once through
+// Broadcast() and once through the shared ring of Publish(). The latency is
+// that of the last client to receive a broadcast, the costs are what the
+// publishing thread spends per message.
+void FanOut(Report* report, const std::string& endpoint, int subscribers) {
+  interprocess::Server server(endpoint);
+  server.Listen();
+
+  std::atomic<int> received(0);
+  std::atomic<int> published(0);
+  std::atomic<int> lapped(0);
+  std::vector<std::unique_ptr<interprocess::Client>> clients;
+  for (int i = 0; i < subscribers; ++i) {
+    clients.emplace_back(new interprocess::Client(std::to_string(i)));
+    auto& client = clients.back();
+    client->SetMessageViewCallback([&](
+      const interprocess::ConnectionPtr&, const interprocess::Message&) {
+      ++received;
+    });
+    if (!client->Connect(endpoint, 1000) ||
+        !client->Subscribe([&](
+          const interprocess::ConnectionPtr&, const interprocess::Message&) {
+          ++published;
+        }, [&] { ++lapped; })) {
+      report->Fail("fan_out", "connect failed");
+      StopAll(&clients);
+      server.Stop();
+      return;
+    }
+  }
+
+  auto message = std::string(64, 'x');
+  benchmark::Histogram latency;
+  for (int i = 0; i < kWarmupRounds; ++i) {
+    auto start = Nanoseconds();
+    server.Broadcast(message);
+    while (received < (i + 1) * subscribers) {
+      std::this_thread::yield();
+    }
+    latency.Record(Nanoseconds() - start);
+  }
+
+  auto start = Nanoseconds();
+  for (int i = 0; i < kFanOutMessages; ++i) {
+    server.Broadcast(message);
+  }
+  auto broadcast = (Nanoseconds() - start) / 1e3;
+  auto expected = (kWarmupRounds + kFanOutMessages) * subscribers;
+  while (received < expected) {
+    std::this_thread::yield();
+  }
+
+  start = Nanoseconds();
+  for (int i = 0; i < kFanOutMessages; ++i) {
+    server.Publish(message);
+  }
+  auto publish = (Nanoseconds() - start) / 1e3;
+  // Lapped subscribers never see the messages they skipped.
+  start = Nanoseconds();
+  expected = kFanOutMessages * subscribers;
+  while (published + lapped < expected && Nanoseconds() - start < 5e9) {
+    std::this_thread::yield();
+  }
+  report->Add("fan_out", { Field("subscribers", subscribers) }, &latency, {
+    Field("broadcast_us", broadcast / kFanOutMessages),
+    Field("publish_us", publish / kFanOutMessages),
+    Field("delivered", published.load()),
+    Field("lapped", lapped.load()),
+  });
+
+  StopAll(&clients);
+  server.Stop();
+}
+
+// Subscription index alone: matching one topic among |topics|, each with
+// |subscribers| subscribers of its own, plus one subscriber to all of them
+// through a prefix.
+void TopicMatch(Report* report, int topics, int subscribers) {
+  interprocess::TopicIndex index;
+  interprocess::TopicIndex::Id id = 0;
+  for (int i = 0; i < topics; ++i) {
+    auto topic = std::string("topic.").append(std::to_string(i));
+    for (int j = 0; j < subscribers; ++j) {
+      index.Subscribe(++id, topic);
+    }
+  }
+  index.Subscribe(++id, "topic.*");
+
+  std::vector<interprocess::TopicIndex::Id> ids;
+  size_t matched = 0;
+  auto start = Nanoseconds();
+  for (int i = 0; i < kTopicMatches; ++i) {
+    ids.clear();
+    index.Match(
+      std::string("topic.").append(std::to_string(i % topics)), &ids);
+    matched += ids.size();
+  }
+  auto elapsed = static_cast<double>(Nanoseconds() - start);
+  report->Add("topic_match", {
+    Field("topics", topics),
+    Field("subscribers", subscribers),
+  }, nullptr, {
+    Field("match_ns", elapsed / kTopicMatches),
+    Field("matched", static_cast<double>(matched) / kTopicMatches),
+  });
+}
+
+// Topic delivery: |subscribers| clients spread over |topics| topics, the
+// server publishes on every topic in turn. Each message reaches only the
+// clients of its topic, so delivery cost follows the subscribers per topic.
+void TopicDelivery(
+  Report* report, const std::string& endpoint, int topics, int subscribers) {
+  std::atomic<int> ready(0);
+  interprocess::Server server(endpoint);
+  server.SetMessageViewCallback([&](
+    const interprocess::ConnectionPtr&, const interprocess::Message&) {
+    ++ready;
+  });
+  server.Listen();
+
+  std::atomic<int> received(0);
+  std::vector<std::unique_ptr<interprocess::Client>> clients;
+  for (int i = 0; i < subscribers; ++i) {
+    clients.emplace_back(new interprocess::Client(std::to_string(i)));
+    auto& client = clients.back();
+    client->SetMessageViewCallback([&](
+      const interprocess::ConnectionPtr&, const interprocess::Message&) {
+      ++received;
+    });
+    if (!client->Connect(endpoint, 1000)) {
+      report->Fail("topic_delivery", "connect failed");
+      StopAll(&clients);
+      server.Stop();
+      return;
+    }
+    client->Connection()->Subscribe(std::to_string(i % topics));
+    // Behind the subscription on the same pipe, it arrives once the
+    // subscription is in the index.
+    client->Connection()->Send("ready");
+  }
+  while (ready < subscribers) {
+    std::this_thread::yield();
+  }
+
+  auto message = std::string(64, 'x');
+  auto start = Nanoseconds();
+  for (int i = 0; i < kTopicMessages; ++i) {
+    server.Publish(std::to_string(i % topics), message);
+  }
+  auto published = (Nanoseconds() - start) / 1e3;
+  // Every topic has the same number of subscribers give or take one.
+  auto expected = 0;
+  for (int i = 0; i < kTopicMessages; ++i) {
+    expected += subscribers / topics + (i % topics < subscribers % topics);
+  }
+  while (received < expected) {
+    std::this_thread::yield();
+  }
+  auto seconds = (Nanoseconds() - start) / 1e9;
+  report->Add("topic_delivery", {
+    Field("topics", topics),
+    Field("subscribers", subscribers),
+  }, nullptr, {
+    Field("publish_us", published / kTopicMessages),
+    Field("deliveries_per_s", expected / seconds),
+  });
+
+  StopAll(&clients);
+  server.Stop();
+}
+
+// Connect rate: a client connects, waits for its connection and stops, over
+// and over again against the same server.
+void Connect(Report* report, const std::string& endpoint) {
+  interprocess::Server server(endpoint);
+  server.Listen();
+
+  benchmark::Histogram latency;
+  auto start = Nanoseconds();
+  for (int i = 0; i < kConnects; ++i) {
+    interprocess::Client client("connect");
+    auto begin = Nanoseconds();
+    if (!client.Connect(endpoint, 1000)) {
+      report->Fail("connect", "connect failed");
+      server.Stop();
+      return;
+    }
+    latency.Record(Nanoseconds() - begin);
+    client.Stop();
+  }
+  auto seconds = (Nanoseconds() - start) / 1e9;
+  report->Add("connect", Fields(), &latency, {
+    Field("connects_per_s", kConnects / seconds),
+  });
+
+  server.Stop();
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  std::string json;
+  std::string trace;
+  std::vector<std::string> groups;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--json") && i + 1 < argc) {
+      json = argv[++i];
+    } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+      trace = argv[++i];
+    } else {
+      groups.push_back(argv[i]);
+    }
+  }
+  auto selected = [&](const char* group) {
+    return groups.empty() ||
+      std::any_of(std::begin(groups),
+                  std::end(groups),
+                  [group](const std::string& filter) {
+      return strstr(group, filter.c_str()) != nullptr;
+    });
+  };
+
+  interprocess::Tracer::Enable(!trace.empty());
+  Report report;
+  const interprocess::TransportE transports[] = {
+    interprocess::NAMED_PIPE,
+    interprocess::SHARED_MEMORY,
+  };
+  if (selected("ping_pong")) {
+    const size_t sizes[] = { 16, 256, 2048 };
+    std::for_each(std::begin(sizes), std::end(sizes), [&](size_t size) {
+      PingPong(&report, "benchmark_pipe", interprocess::NAMED_PIPE, size);
+      PingPong(&report, "benchmark_shm", interprocess::SHARED_MEMORY, size);
+    });
+  }
+
+  if (selected("throughput")) {
+    const size_t sizes[] = { 16, 256, 4096, 65536 };
+    std::for_each(std::begin(transports), std::end(transports), [&](
+      interprocess::TransportE transport) {
+      std::for_each(std::begin(sizes), std::end(sizes), [&](size_t size) {
+        OneWay(&report, "benchmark_throughput", transport, size);
+      });
+    });
+  }
+
+  if (selected("transact")) {
+    std::for_each(std::begin(transports), std::end(transports), [&](
+      interprocess::TransportE transport) {
+      Transact(&report, "benchmark_transact", transport);
+    });
+  }
+
+  if (selected("fan_in")) {
+    auto batching = interprocess::EventLoop::Batching();
+    FanIn(&report, "single_dequeue", "benchmark_fan_in", false, 1);
+    if (batching) {
+      FanIn(&report, "batched_dequeue", "benchmark_fan_in", true, 1);
+    }
+    auto cores = static_cast<int>(std::thread::hardware_concurrency());
+    for (int workers = 2; workers <= std::max(cores, 2); workers *= 2) {
+      FanIn(&report, "worker_loops", "benchmark_fan_in", batching, workers);
+    }
+  }
+
+  if (selected("contention")) {
+    for (int producers = 1; producers <= 32; producers *= 2) {
+      Contention(&report, "benchmark_contention", producers);
+    }
+  }
+
+  if (selected("fan_out")) {
+    for (int subscribers = 1; subscribers <= 1000; subscribers *= 10) {
+      FanOut(&report, "benchmark_fan_out", subscribers);
+    }
+  }
+
+  if (selected("topic")) {
+    for (int topics = 10; topics <= 100000; topics *= 10) {
+      TopicMatch(&report, topics, 1);
+      TopicMatch(&report, topics, 10);
+    }
+    for (int subscribers = 10; subscribers <= 100; subscribers *= 10) {
+      for (int topics = 1; topics <= subscribers; topics *= 10) {
+        TopicDelivery(&report, "benchmark_topics", topics, subscribers);
+      }
+    }
+  }
+
+  if (selected("batching")) {
+    std::for_each(std::begin(transports), std::end(transports), [&](
+      interprocess::TransportE transport) {
+      Batched(&report,
+              "benchmark_batching",
+              transport,
+              std::chrono::microseconds(0));
+      Batched(&report,
+              "benchmark_batching",
+              transport,
+              std::chrono::microseconds(100));
+    });
+  }
+
+  if (selected("compression")) {
+    const size_t sizes[] = { 1024, 16384, 262144 };
+    std::for_each(std::begin(sizes), std::end(sizes), [&](size_t size) {
+      Codec(&report, size);
+    });
+    std::for_each(std::begin(transports), std::end(transports), [&](
+      interprocess::TransportE transport) {
+      std::for_each(std::begin(sizes), std::end(sizes), [&](size_t size) {
+        Compressed(&report, "benchmark_compression", transport, size, false);
+        Compressed(&report, "benchmark_compression", transport, size, true);
+      });
+    });
+  }
+
+  if (selected("connect")) {
+    Connect(&report, "benchmark_connect");
+  }
+
+  if (!json.empty() && !report.Write(json)) {
+    printf("cannot write %s\n", json.c_str());
+    return 1;
+  }
+  if (!trace.empty() && !interprocess::Tracer::Export(trace)) {
+    printf("cannot write %s\n", trace.c_str());
+    return 1;
+  }
+  return report.Failures() ? 1 : 0;
+}
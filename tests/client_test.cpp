@@ -9,6 +9,8 @@
 #include <string>
 #include "interprocess/client.h"
 #include "interprocess/connection.h"
+#include "interprocess/message.h"
+#include "interprocess/stream.h"
 
 void OnMessage(
   const interprocess::ConnectionPtr& conn, const std::string& msg) {
@@ -38,6 +40,19 @@ void InThread() {
   if (client.Connect("mynamedpipe", 1000)) {
     auto response = client.Connection()->TransactMessage("async & wait");
     printf("TransactMessage response: %s\n", response.c_str());
+    auto first = client.Connection()->AsyncTransactMessage(
+      "first", std::chrono::milliseconds(500));
+    auto second = client.Connection()->AsyncTransactMessage(
+      "second", std::chrono::milliseconds(500));
+    try {
+      printf("AsyncTransactMessage responses: %s %s\n",
+             first.get().c_str(),
+             second.get().c_str());
+    } catch (const interprocess::TimeoutException& e) {
+      printf("Timed out \"%s\"\n", e.what());
+    } catch (const interprocess::DisconnectedException& e) {
+      printf("Disconnected \"%s\"\n", e.what());
+    }
     std::this_thread::sleep_for(std::chrono::seconds(1));
     client.Connection()->Send(client.Name());
     client.Connection()->Send("abcdefghijklmnopqrstuvwxyz");
@@ -46,6 +61,19 @@ void InThread() {
   }
 }
 
+// The threads share one connection, each on a stream of its own.
+void InStream(const interprocess::ConnectionPtr& conn) {
+  auto stream = conn->OpenStream([](
+    const interprocess::StreamPtr& stream,
+    const interprocess::Message& message) {
+    printf("stream %u: %s\n", stream->Id(), message.ToString().c_str());
+  });
+  stream->Send(std::to_string(std::this_thread::get_id().hash()));
+  stream->Send("abcdefghijklmnopqrstuvwxyz");
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+  stream->Close();
+}
+
 int main() {
   Concurrency::task_group tasks;
   int count = 10;
@@ -53,5 +81,15 @@ int main() {
     tasks.run(std::function<void()>(InThread));
   }
   tasks.wait();
+
+  auto client = interprocess::Client("streams");
+  if (client.Connect("mynamedpipe", 1000)) {
+    auto conn = client.Connection();
+    for (count = 10; count--;) {
+      tasks.run([conn]() { InStream(conn); });
+    }
+    tasks.wait();
+    client.Stop();
+  }
   return 0;
 }
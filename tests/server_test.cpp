@@ -4,8 +4,10 @@
 //
 //  http://www.boost.org/LICENSE_1_0.txt
 
+#include <algorithm>
 #include <thread>
 #include <string>
+#include <vector>
 #include "interprocess/server.h"
 #include "interprocess/connection.h"
 
@@ -19,8 +21,47 @@ void OnMessage(
 int main() {
   auto server = interprocess::Server("mynamedpipe");
   server.SetMessageCallback(OnMessage);
+  // Messages on a stream are answered on the same stream.
+  server.SetStreamMessageCallback([](
+    const interprocess::StreamPtr& stream,
+    const interprocess::Message& message) {
+    stream->Send(message.ToString());
+  });
+  // A client that stops reading is dropped rather than buffered for.
+  interprocess::SendLimits limits;
+  limits.max_bytes = 64 * 1024 * 1024;
+  limits.high_water_mark = 16 * 1024 * 1024;
+  limits.low_water_mark = 1024 * 1024;
+  limits.overflow = interprocess::OVERFLOW_DISCONNECT;
+  server.SetSendLimits(limits);
+  server.SetHighWaterMarkCallback([](
+    const interprocess::ConnectionPtr& conn, size_t queued) {
+    printf("%s is falling behind, %u bytes queued\n",
+           conn->Name().c_str(),
+           static_cast<unsigned>(queued));
+  });
   server.Listen();
-  std::this_thread::sleep_for(std::chrono::hours(30));
+  for (int minute = 0; minute < 30 * 60; ++minute) {
+    std::this_thread::sleep_for(std::chrono::minutes(1));
+    std::vector<interprocess::ConnectionStats> connections;
+    auto stats = server.Stats(&connections);
+    printf("%u connections, %llu messages in, %llu out\n",
+           static_cast<unsigned>(stats.connections),
+           stats.totals.messages_in,
+           stats.totals.messages_out);
+    // The connection with the most bytes queued is the one to look at.
+    auto slowest = std::max_element(std::begin(connections),
+                                    std::end(connections),
+                                    [](const interprocess::ConnectionStats& l,
+                                       const interprocess::ConnectionStats& r) {
+      return l.queued_bytes < r.queued_bytes;
+    });
+    if (slowest != std::end(connections) && slowest->queued_bytes) {
+      printf("#%llu has %u bytes queued\n",
+             slowest->id,
+             static_cast<unsigned>(slowest->queued_bytes));
+    }
+  }
   server.Broadcast("0");
   server.Stop();
   return 0;
@@ -5,7 +5,77 @@
 //  http://www.boost.org/LICENSE_1_0.txt
 
 #include <cppunittest.h>
+#include <windows.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include "interprocess/broadcast.h"
+#include "interprocess/client.h"
+#include "interprocess/compress.h"
+#include "interprocess/connection.h"
+#include "interprocess/frame.h"
+#include "interprocess/message.h"
+#include "interprocess/send_queue.h"
 #include "interprocess/server.h"
+#include "interprocess/session.h"
+#include "interprocess/slot_map.h"
+#include "interprocess/stream.h"
+#include "interprocess/topic_index.h"
+#include "interprocess/trace.h"
+#include "interprocess/typed.h"
+
+namespace unittest {
+
+std::atomic<int> allocations(0);
+
+struct Quote {
+  uint32_t id;
+  double price;
+};
+
+// A later layout of Quote, under the same tag.
+struct QuoteV2 {
+  uint32_t id;
+  double bid;
+  double ask;
+};
+
+// Posted to a loop, tells when it got through what was queued before.
+struct Marker : interprocess::IoCompletion {
+  std::promise<void> reached;
+};
+
+VOID WINAPI CompletedMarkerRoutine(DWORD, DWORD, LPOVERLAPPED overlap) {
+  reinterpret_cast<Marker*>(overlap)->reached.set_value();
+}
+
+}  // namespace unittest
+
+INTERPROCESS_TYPED_MESSAGE(unittest::Quote, 1, 1)
+INTERPROCESS_TYPED_MESSAGE(unittest::QuoteV2, 1, 2)
+
+void* operator new(size_t size) {
+  ++unittest::allocations;
+  auto memory = malloc(size ? size : 1);
+  if (!memory) {
+    throw std::bad_alloc();
+  }
+  return memory;
+}
+
+void operator delete(void* memory) {
+  free(memory);
+}
 
 namespace unittest {
 
@@ -59,4 +129,709 @@ TEST_CLASS(ServerTest) {
   }
 };
 
+TEST_CLASS(FrameTest) {
+ public:
+  TEST_METHOD(TestSingleFrame) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    std::string frames;
+    interprocess::EncodeFrames("first", &frames);
+    interprocess::EncodeFrames("second", &frames);
+
+    interprocess::PacketReader reader(frames.data(), frames.size());
+    interprocess::FrameAssembler assembler;
+    const char* frame = nullptr;
+    size_t size = 0;
+    const char* payload = nullptr;
+    size_t length = 0;
+    std::string message;
+    Assert::IsTrue(reader.Next(&frame, &size));
+    Assert::IsTrue(assembler.Feed(frame, size, &payload, &length, &message));
+    Assert::AreEqual(std::string("first"), std::string(payload, length));
+    Assert::IsTrue(reader.Next(&frame, &size));
+    Assert::IsTrue(assembler.Feed(frame, size, &payload, &length, &message));
+    Assert::AreEqual(std::string("second"), std::string(payload, length));
+    Assert::IsFalse(reader.Next(&frame, &size));
+  }
+
+  TEST_METHOD(TestCorrelatedMessages) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    auto reply = std::string(2 * interprocess::kBufferSize, 'x');
+    std::string frames;
+    interprocess::EncodeFrames(
+      "request", &frames, interprocess::FRAME_REQUEST, 7);
+    interprocess::EncodeFrames(reply, &frames, interprocess::FRAME_REPLY, 9);
+    interprocess::EncodeFrames("plain", &frames);
+
+    interprocess::PacketReader reader(frames.data(), frames.size());
+    interprocess::FrameAssembler assembler;
+    const char* frame = nullptr;
+    size_t size = 0;
+    const char* payload = nullptr;
+    size_t length = 0;
+    std::string message;
+    Assert::IsTrue(reader.Next(&frame, &size));
+    Assert::IsTrue(assembler.Feed(frame, size, &payload, &length, &message));
+    Assert::AreEqual(std::string("request"), std::string(payload, length));
+    Assert::AreEqual(
+      static_cast<int>(interprocess::FRAME_REQUEST),
+      static_cast<int>(assembler.Kind()));
+    Assert::IsTrue(assembler.Correlation() == 7);
+    while (reader.Next(&frame, &size) &&
+           !assembler.Feed(frame, size, &payload, &length, &message)) {
+    }
+    Assert::IsNull(payload);
+    Assert::AreEqual(reply, message);
+    Assert::AreEqual(
+      static_cast<int>(interprocess::FRAME_REPLY),
+      static_cast<int>(assembler.Kind()));
+    Assert::IsTrue(assembler.Correlation() == 9);
+    Assert::IsTrue(reader.Next(&frame, &size));
+    Assert::IsTrue(assembler.Feed(frame, size, &payload, &length, &message));
+    Assert::AreEqual(std::string("plain"), std::string(payload, length));
+    Assert::AreEqual(0, static_cast<int>(assembler.Kind()));
+  }
+
+  TEST_METHOD(TestFragmentedMessage) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    auto message = std::string(2 * interprocess::kPacketSize, 'x');
+    auto frames = std::make_shared<std::string>();
+    interprocess::EncodeFrames(message, frames.get());
+    std::deque<interprocess::Packet> packets;
+    interprocess::SlicePackets(frames, &packets);
+    Assert::IsTrue(packets.size() > 1);
+
+    interprocess::FrameAssembler assembler;
+    const char* payload = nullptr;
+    size_t length = 0;
+    std::string assembled;
+    auto limit = static_cast<size_t>(interprocess::kPacketSize);
+    for (size_t i = 0; i < packets.size(); ++i) {
+      Assert::IsTrue(packets[i].size <= limit);
+      interprocess::PacketReader reader(packets[i].Data(), packets[i].size);
+      const char* frame = nullptr;
+      size_t size = 0;
+      while (reader.Next(&frame, &size)) {
+        Assert::IsTrue(assembled.empty());
+        assembler.Feed(frame, size, &payload, &length, &assembled);
+      }
+    }
+    Assert::AreEqual(message, assembled);
+  }
+
+  TEST_METHOD(TestSessionAndControlMessagesAreNotDropped) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    std::string frames;
+    interprocess::EncodeFrames("plain", &frames);
+    Assert::IsTrue(interprocess::Droppable(frames));
+    frames.clear();
+    interprocess::EncodeFrames(
+      "stream", &frames, interprocess::FRAME_STREAM, 3);
+    Assert::IsTrue(interprocess::Droppable(frames));
+    frames.clear();
+    interprocess::EncodeFrames(
+      std::string(2 * interprocess::kBufferSize, 'x'),
+      &frames,
+      interprocess::FRAME_SEQUENCED);
+    Assert::IsFalse(interprocess::Droppable(frames));
+    frames.clear();
+    interprocess::EncodeFrames(
+      interprocess::EncodeSessionAck(64),
+      &frames,
+      interprocess::FRAME_CONTROL);
+    Assert::IsFalse(interprocess::Droppable(frames));
+  }
+};
+
+TEST_CLASS(ReceiverTest) {
+ public:
+  static void Receive(
+    interprocess::Receiver* receiver,
+    const std::string& frames,
+    std::vector<interprocess::Message>* messages) {
+    CopyMemory(receiver->Buffer(), frames.data(), frames.size());
+    receiver->Unpack(frames.size(), messages);
+  }
+
+  TEST_METHOD(TestRetainedMessage) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    std::string first;
+    std::string second;
+    interprocess::EncodeFrames("first", &first);
+    interprocess::EncodeFrames("second", &second);
+    interprocess::Receiver receiver;
+    std::vector<interprocess::Message> messages;
+    Receive(&receiver, first, &messages);
+    auto retained = messages.front();
+    messages.clear();
+    Receive(&receiver, second, &messages);
+    Assert::AreEqual(std::string("first"), retained.ToString());
+    Assert::AreEqual(std::string("second"), messages.front().ToString());
+  }
+
+  TEST_METHOD(TestReceiveDoesNotAllocate) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    std::string frames;
+    for (int i = 0; i < 64; ++i) {
+      interprocess::EncodeFrames(std::string(100, 'x'), &frames);
+    }
+    interprocess::Receiver receiver;
+    std::vector<interprocess::Message> messages;
+    messages.reserve(interprocess::kMessageBatch);
+    std::vector<interprocess::Message> retained;
+    retained.reserve(1);
+
+    // A message kept across reads makes the receiver switch buffers. The
+    // first rounds fill the buffer pool, after that neither unpacking nor
+    // keeping a message touches the heap.
+    for (int round = 0; round < 100; ++round) {
+      auto before = allocations.load();
+      Receive(&receiver, frames, &messages);
+      retained.clear();
+      retained.push_back(messages.back());
+      messages.clear();
+      if (round >= 2) {
+        Assert::AreEqual(before, allocations.load());
+      }
+    }
+    Assert::AreEqual(static_cast<size_t>(0), messages.size());
+  }
+};
+
+TEST_CLASS(SendQueueTest) {
+ public:
+  TEST_METHOD(TestWakesOncePerBurst) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    interprocess::SendQueue queue;
+    auto first = std::make_shared<const std::string>("first");
+    auto second = std::make_shared<const std::string>("second");
+    Assert::IsTrue(queue.Push(first));
+    Assert::IsFalse(queue.Push(second));
+
+    std::shared_ptr<const std::string> frames;
+    Assert::IsTrue(queue.Pop(&frames));
+    Assert::AreEqual(*first, *frames);
+    Assert::IsTrue(queue.Pop(&frames));
+    Assert::AreEqual(*second, *frames);
+    Assert::IsFalse(queue.Pop(&frames));
+    Assert::IsTrue(queue.Empty());
+    Assert::IsTrue(queue.Idle());
+
+    // Drained and idle, the next push has to wake the consumer again.
+    Assert::IsTrue(queue.Push(first));
+  }
+
+  TEST_METHOD(TestIdleKeepsLateMessage) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    interprocess::SendQueue queue;
+    auto message = std::make_shared<const std::string>("late");
+    Assert::IsTrue(queue.Push(message));
+    std::shared_ptr<const std::string> frames;
+    Assert::IsTrue(queue.Pop(&frames));
+
+    // Pushed while the queue is still scheduled, nobody wakes the consumer
+    // for it, so it must not go idle.
+    Assert::IsFalse(queue.Push(message));
+    Assert::IsFalse(queue.Idle());
+    Assert::IsTrue(queue.Pop(&frames));
+    Assert::IsTrue(queue.Idle());
+  }
+};
+
+TEST_CLASS(SlotMapTest) {
+ public:
+  TEST_METHOD(TestStaleIdAfterReuse) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    interprocess::SlotMap<int> map(1 << 24);
+    auto first = map.Insert(1);
+    auto second = map.Insert(2);
+    Assert::AreEqual(2, *map.Find(second));
+    Assert::IsTrue(map.Erase(first));
+    Assert::IsFalse(map.Erase(first));
+
+    // The freed slot is reused under a new generation.
+    auto third = map.Insert(3);
+    Assert::IsTrue(static_cast<uint32_t>(third) ==
+                   static_cast<uint32_t>(first));
+    Assert::IsTrue(third != first);
+    Assert::IsNull(map.Find(first));
+    Assert::AreEqual(3, *map.Find(third));
+    Assert::IsTrue(map.Size() == 2);
+    Assert::IsNull(map.Find(0));
+  }
+};
+
+TEST_CLASS(BroadcastRingTest) {
+ public:
+  TEST_METHOD(TestReaderIsLapped) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    const uint32_t capacity = 256;
+    auto memory = static_cast<char*>(_aligned_malloc(
+      sizeof(interprocess::BroadcastRing::Header) + capacity, 64));
+    interprocess::BroadcastRing writer;
+    writer.Attach(memory, capacity, true);
+    interprocess::BroadcastRing reader;
+    reader.Attach(memory, capacity, false);
+
+    std::string frames;
+    interprocess::EncodeFrames("hello", &frames);
+    uint64_t cursor = reader.Head();
+    Assert::IsTrue(writer.Publish(frames) == 0);
+    const char* frame = nullptr;
+    size_t size = 0;
+    Assert::IsTrue(reader.Peek(&cursor, &frame, &size));
+    interprocess::Receiver receiver;
+    std::vector<interprocess::Message> messages;
+    receiver.Stage(frame, size, &messages);
+    Assert::AreEqual(std::string("hello"), messages.front().ToString());
+    Assert::IsFalse(reader.Peek(&cursor, &frame, &size));
+    Assert::IsFalse(reader.Lapped(cursor));
+
+    // Every parked reader is woken once, however often the writer
+    // publishes.
+    interprocess::BroadcastRing other;
+    other.Attach(memory, capacity, false);
+    auto slot = reader.Claim();
+    auto other_slot = other.Claim();
+    Assert::IsTrue(slot >= 0 && other_slot >= 0 && slot != other_slot);
+    reader.Park(slot);
+    other.Park(other_slot);
+    Assert::IsTrue(writer.Publish(frames) ==
+                   ((uint64_t(1) << slot) | (uint64_t(1) << other_slot)));
+    Assert::IsTrue(writer.Publish(frames) == 0);
+    other.Release(other_slot);
+    Assert::IsTrue(other.Claim() == other_slot);
+
+    // Once the writer is a ring ahead, the cursor points at overwritten
+    // records.
+    for (int i = 0; i < 32; ++i) {
+      writer.Publish(frames);
+    }
+    Assert::IsTrue(reader.Lapped(cursor));
+    Assert::IsFalse(reader.Lapped(reader.Head()));
+    _aligned_free(memory);
+  }
+
+  TEST_METHOD(TestParkedSubscribersAreWokenByOnePublish) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    interprocess::BroadcastChannel channel("unittest_broadcast");
+    interprocess::EventLoop loop;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::vector<std::string> received;
+    auto collect = [&](const interprocess::Message& message) {
+      std::unique_lock<std::mutex> lock(mutex);
+      received.push_back(message.ToString());
+      cond.notify_all();
+    };
+    interprocess::Subscriber first(
+      "unittest_broadcast", &loop, collect, nullptr);
+    interprocess::Subscriber second(
+      "unittest_broadcast", &loop, collect, nullptr);
+    std::thread thread([&loop]() {
+      while (loop.Wait() != interprocess::EventLoop::CLOSE) {}
+    });
+    // Dequeued after the first wakeup of both, which parks them.
+    unittest::Marker parked;
+    ZeroMemory(&parked.overlap, sizeof parked.overlap);
+    parked.routine = unittest::CompletedMarkerRoutine;
+    loop.Post(&parked);
+    Assert::IsTrue(parked.reached.get_future().wait_for(
+      std::chrono::seconds(1)) == std::future_status::ready);
+
+    channel.Publish(interprocess::Buffer("hello"));
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      Assert::IsTrue(cond.wait_for(lock, std::chrono::seconds(1), [&]() {
+        return received.size() == 2;
+      }));
+      Assert::IsTrue(received[0] == "hello" && received[1] == "hello");
+    }
+    loop.Post(interprocess::EventLoop::CLOSE);
+    thread.join();
+  }
+};
+
+TEST_CLASS(TopicIndexTest) {
+ public:
+  TEST_METHOD(TestPrefixAndExactMatch) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    interprocess::TopicIndex index;
+    Assert::IsTrue(index.Subscribe(1, "prices.eur"));
+    Assert::IsFalse(index.Subscribe(1, "prices.eur"));
+    Assert::IsTrue(index.Subscribe(1, "prices.*"));
+    Assert::IsTrue(index.Subscribe(2, "prices.*"));
+    Assert::IsTrue(index.Subscribe(3, "news"));
+
+    // Subscribed twice over, the first connection is matched once.
+    std::vector<interprocess::TopicIndex::Id> ids;
+    index.Match("prices.eur", &ids);
+    Assert::IsTrue(ids.size() == 2);
+    ids.clear();
+    index.Match("prices.usd", &ids);
+    Assert::IsTrue(ids.size() == 2);
+    ids.clear();
+    index.Match("prices", &ids);
+    Assert::IsTrue(ids.empty());
+    index.Match("news", &ids);
+    Assert::IsTrue(ids.size() == 1 && ids.front() == 3);
+
+    Assert::IsTrue(index.Unsubscribe(2, "prices.*"));
+    Assert::IsFalse(index.Unsubscribe(2, "prices.*"));
+    index.Remove(1);
+    Assert::IsTrue(index.Size() == 1);
+    ids.clear();
+    index.Match("prices.eur", &ids);
+    Assert::IsTrue(ids.empty());
+  }
+};
+
+TEST_CLASS(TraceRingTest) {
+ public:
+  TEST_METHOD(TestKeepsLatestEvents) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    interprocess::TraceRing ring;
+    std::vector<interprocess::TraceEvent> events;
+    ring.Snapshot(&events);
+    Assert::IsTrue(events.empty());
+
+    uint64_t count = interprocess::kTraceRingSize + 10;
+    for (uint64_t i = 0; i < count; ++i) {
+      ring.Record("event", interprocess::Tracer::INSTANT, i, i);
+    }
+    // The oldest slot is left out, it could be the one being overwritten.
+    ring.Snapshot(&events);
+    Assert::IsTrue(events.size() == interprocess::kTraceRingSize - 1);
+    Assert::IsTrue(events.front().id == 11);
+    Assert::IsTrue(events.back().id == count - 1);
+  }
+};
+
+TEST_CLASS(TypedMessageTest) {
+ public:
+  TEST_METHOD(TestDispatchAndReject) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    Quote quote = { 7, 1.5 };
+    QuoteV2 newer = { 7, 1.5, 1.75 };
+    std::string frames;
+    interprocess::EncodeFrames(interprocess::TypedPayload(quote), &frames);
+    interprocess::EncodeFrames(interprocess::TypedPayload(newer), &frames);
+    interprocess::EncodeFrames("untyped", &frames);
+    interprocess::Receiver receiver;
+    std::vector<interprocess::Message> messages;
+    ReceiverTest::Receive(&receiver, frames, &messages);
+    Assert::IsTrue(messages.size() == 3);
+
+    Quote copy;
+    auto value = interprocess::MessageCast<Quote>(messages[0], &copy);
+    Assert::IsTrue(value && value->id == 7 && value->price == 1.5);
+    Assert::IsNull(interprocess::MessageCast<Quote>(messages[1], &copy));
+    Assert::IsNull(interprocess::MessageCast<Quote>(messages[2], &copy));
+
+    // Only the first message is a Quote as this side knows it.
+    int handled = 0;
+    int rejected = 0;
+    interprocess::MessageDispatcher dispatcher;
+    dispatcher.OnMessage<Quote>([&](
+      const interprocess::ConnectionPtr&, const Quote& q) {
+      handled += q.id == 7;
+    });
+    dispatcher.OnReject([&](
+      const interprocess::ConnectionPtr&, const interprocess::Message&) {
+      ++rejected;
+    });
+    auto callback = dispatcher.Callback();
+    std::for_each(std::begin(messages),
+                  std::end(messages),
+                  [&](const interprocess::Message& message) {
+      callback(nullptr, message);
+    });
+    Assert::AreEqual(1, handled);
+    Assert::AreEqual(2, rejected);
+  }
+
+  TEST_METHOD(TestAlignedValueIsReadInPlace) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    Quote quote = { 7, 1.5 };
+    std::string frames;
+    interprocess::EncodeFrames("odd", &frames);
+    interprocess::EncodeFrames(
+      interprocess::TypedPayload(quote), &frames, interprocess::FRAME_REPLY, 3);
+    interprocess::EncodeFrames(interprocess::TypedPayload(quote), &frames);
+    interprocess::Receiver receiver;
+    std::vector<interprocess::Message> messages;
+    ReceiverTest::Receive(&receiver, frames, &messages);
+    // Staged next to a frame of odd length.
+    interprocess::PacketReader reader(frames.data(), frames.size());
+    const char* frame = nullptr;
+    size_t size = 0;
+    while (reader.Next(&frame, &size)) {
+      receiver.Stage(frame, size, &messages);
+    }
+    Assert::IsTrue(messages.size() == 6);
+
+    // A Quote holds a double, it is not copied out of the buffer.
+    for (size_t i = 1; i < messages.size(); ++i) {
+      if (i % 3 == 0) {
+        continue;
+      }
+      Quote copy;
+      auto value = interprocess::MessageCast<Quote>(messages[i], &copy);
+      Assert::IsTrue(value && value != &copy && value->price == 1.5);
+    }
+  }
+};
+
+TEST_CLASS(CompressionTest) {
+ public:
+  TEST_METHOD(TestCompressedMessageIsReceivedWhole) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    std::string text;
+    for (int i = 0; text.size() < 64 * 1024; ++i) {
+      text.append("{\"id\":").append(std::to_string(i % 100))
+          .append(",\"level\":\"info\",\"text\":\"connected\"}\n");
+    }
+    std::string compressed;
+    Assert::IsTrue(interprocess::Compress(
+      text.data(), text.size(), &compressed));
+    Assert::IsTrue(compressed.size() < text.size() / 4);
+
+    std::string frames;
+    interprocess::EncodeFrames(
+      compressed, &frames, interprocess::FRAME_COMPRESSED);
+    interprocess::Receiver receiver;
+    std::vector<interprocess::Message> messages;
+    ReceiverTest::Receive(&receiver, frames, &messages);
+    Assert::IsTrue(messages.size() == 1);
+    Assert::IsTrue(messages.front().ToString() == text);
+
+    // Bytes without repetition are left alone.
+    std::string noise(4096, 0);
+    uint32_t seed = 1;
+    std::for_each(std::begin(noise), std::end(noise), [&](char& c) {
+      seed = seed * 1103515245 + 12345;
+      c = static_cast<char>(seed >> 24);
+    });
+    Assert::IsFalse(interprocess::Compress(
+      noise.data(), noise.size(), &compressed));
+  }
+
+  TEST_METHOD(TestSizePrefixedBlockVector) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    // lz4.block.compress(text, store_size=True) from the python lz4
+    // package, a length prefix and one block.
+    const char vector[] =
+      "\x4e\x00\x00\x00\xdf\x69\x6e\x74\x65\x72\x70\x72\x6f\x63"
+      "\x65\x73\x73\x20\x0d\x00\x29\x50\x63\x65\x73\x73\x20";
+    const std::string block(vector, sizeof vector - 1);
+    std::string text;
+    for (int i = 0; i < 6; ++i) {
+      text.append("interprocess ");
+    }
+    std::string message;
+    interprocess::Decompress(block.data(), block.size(), &message);
+    Assert::IsTrue(message == text);
+    std::string compressed;
+    Assert::IsTrue(interprocess::Compress(
+      text.data(), text.size(), &compressed));
+    Assert::IsTrue(compressed == block);
+  }
+};
+
+TEST_CLASS(StreamTest) {
+ public:
+  TEST_METHOD(TestStreamsTakeTurns) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    interprocess::StreamScheduler scheduler;
+    const char* sent[] = { "a1", "a2", "a3" };
+    std::for_each(std::begin(sent), std::end(sent), [&](const char* m) {
+      scheduler.Push(1, std::make_shared<const std::string>(m));
+    });
+    scheduler.Push(2, std::make_shared<const std::string>("b1"));
+
+    std::string order;
+    std::shared_ptr<const std::string> frames;
+    while (scheduler.Pop(&frames)) {
+      order.append(*frames);
+    }
+    Assert::IsTrue(order == "a1b1a2a3");
+    Assert::IsTrue(scheduler.Empty());
+  }
+
+  TEST_METHOD(TestStreamIdIsEncoded) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    std::string frames;
+    interprocess::EncodeFrames(
+      std::string(100000, 'x'), &frames, interprocess::FRAME_STREAM, 7);
+    Assert::IsTrue(interprocess::StreamOf(frames) == 7);
+
+    interprocess::FrameAssembler assembler;
+    interprocess::PacketReader reader(frames.data(), frames.size());
+    const char* frame = nullptr;
+    size_t size = 0;
+    const char* payload = nullptr;
+    size_t length = 0;
+    std::string message;
+    while (reader.Next(&frame, &size) &&
+           !assembler.Feed(frame, size, &payload, &length, &message)) {}
+    Assert::IsTrue(assembler.Kind() == interprocess::FRAME_STREAM);
+    Assert::IsTrue(assembler.Correlation() == 7);
+    Assert::IsTrue(message == std::string(100000, 'x'));
+
+    frames.clear();
+    interprocess::EncodeFrames("plain", &frames);
+    Assert::IsTrue(interprocess::StreamOf(frames) == 0);
+  }
+
+  TEST_METHOD(TestPeerOpensStream) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    interprocess::Server server("unittest_stream");
+    std::mutex mutex;
+    std::condition_variable cond;
+    interprocess::StreamId opened = 0;
+    std::string echoed;
+    // The first message of a stream the client opened creates it here,
+    // under an id marked as the peer's.
+    server.SetStreamMessageCallback([&](
+      const interprocess::StreamPtr& stream,
+      const interprocess::Message& message) {
+      opened = stream->Id();
+      stream->Send(message.ToString());
+    });
+    server.Listen();
+
+    interprocess::Client client("client");
+    Assert::IsTrue(client.Connect("unittest_stream", 1000));
+    auto stream = client.Connection()->OpenStream([&](
+      const interprocess::StreamPtr&, const interprocess::Message& message) {
+      std::unique_lock<std::mutex> lock(mutex);
+      echoed = message.ToString();
+      cond.notify_all();
+    });
+    Assert::IsTrue(stream->Send("ping"));
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      Assert::IsTrue(cond.wait_for(lock, std::chrono::seconds(1), [&]() {
+        return !echoed.empty();
+      }));
+    }
+    Assert::AreEqual(std::string("ping"), echoed);
+    Assert::IsTrue(opened == (stream->Id() | 0x80000000u));
+    client.Stop();
+    server.Stop();
+  }
+};
+
+TEST_CLASS(SessionTest) {
+ public:
+  TEST_METHOD(TestHelloAndAckAreDecoded) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    interprocess::SessionHello hello = { 42, 7, 3 };
+    auto message = interprocess::EncodeSessionHello(hello);
+    interprocess::SessionHello decoded;
+    Assert::IsTrue(interprocess::DecodeSessionHello(
+      message.data(), message.size(), &decoded));
+    Assert::IsTrue(decoded.id == 42);
+    Assert::IsTrue(decoded.received == 7 && decoded.acknowledged == 3);
+
+    uint64_t received = 0;
+    Assert::IsFalse(interprocess::DecodeSessionAck(
+      message.data(), message.size(), &received));
+    message = interprocess::EncodeSessionAck(9);
+    Assert::IsTrue(interprocess::DecodeSessionAck(
+      message.data(), message.size(), &received));
+    Assert::IsTrue(received == 9);
+  }
+
+  TEST_METHOD(TestKeepsUntilAcknowledged) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    interprocess::Session session(1, 0, 0);
+    for (int i = 0; i < 3; ++i) {
+      session.Send(std::make_shared<const std::string>("m"));
+    }
+    Assert::IsTrue(session.Hello().acknowledged == 0);
+    session.Acknowledge(2);
+    Assert::IsTrue(session.Hello().acknowledged == 2);
+    // Never past what was sent.
+    session.Acknowledge(10);
+    Assert::IsTrue(session.Hello().acknowledged == 3);
+
+    Assert::IsTrue(session.Receive(interprocess::kSessionAckInterval - 1) == 0);
+    Assert::IsTrue(session.Receive(1) == interprocess::kSessionAckInterval);
+    Assert::IsTrue(session.Receive(1) == 0);
+    Assert::IsTrue(session.Hello().received ==
+                   interprocess::kSessionAckInterval + 1);
+  }
+
+  TEST_METHOD(TestResumesWithRestartedServer) {
+    using Microsoft::VisualStudio::CppUnitTestFramework::Assert;
+    const int acked = interprocess::kSessionAckInterval;
+    const int sent = acked + 6;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::vector<std::string> received;
+    auto collect = [&](
+      const interprocess::ConnectionPtr& conn, const std::string& message) {
+      if (message == "sync") {
+        conn->Send(message);
+        return;
+      }
+      std::unique_lock<std::mutex> lock(mutex);
+      received.push_back(message);
+      cond.notify_all();
+    };
+    auto wait = [&](size_t count) {
+      std::unique_lock<std::mutex> lock(mutex);
+      return cond.wait_for(lock, std::chrono::seconds(5), [&]() {
+        return received.size() >= count;
+      });
+    };
+
+    interprocess::Client client("client");
+    interprocess::ReconnectPolicy policy;
+    policy.maximum = std::chrono::milliseconds(100);
+    client.SetReconnect(policy);
+    {
+      interprocess::Server server("unittest_session");
+      server.SetMessageCallback(collect);
+      server.Listen();
+      Assert::IsTrue(client.Connect("unittest_session", 1000));
+      for (int i = 0; i < acked; ++i) {
+        client.Connection()->Send(std::to_string(i));
+      }
+      Assert::IsTrue(wait(acked));
+      // The reply of a later request comes after the ack of those.
+      Assert::AreEqual(
+        std::string("sync"), client.Connection()->TransactMessage("sync"));
+      for (int i = acked; i < sent; ++i) {
+        client.Connection()->Send(std::to_string(i));
+      }
+      Assert::IsTrue(wait(sent));
+      server.Stop();
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      received.clear();
+    }
+
+    // The restarted server takes the counts of the client, only the
+    // messages it did not acknowledge are sent again, before any new one.
+    interprocess::Server server("unittest_session");
+    server.SetMessageCallback(collect);
+    server.Listen();
+    Assert::IsTrue(wait(sent - acked));
+    client.Connection()->Send(std::to_string(sent));
+    Assert::IsTrue(wait(sent - acked + 1));
+    std::vector<std::string> expected;
+    for (int i = acked; i <= sent; ++i) {
+      expected.push_back(std::to_string(i));
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      Assert::IsTrue(received == expected);
+    }
+    client.Stop();
+    server.Stop();
+  }
+};
+
 }  // namespace unittest